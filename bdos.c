@@ -5,7 +5,9 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "defs.h"
@@ -14,56 +16,87 @@
 #define BIOS 0xFE00
 #define DPH0 (BIOS + 0x0036)
 #define DPB0 (DPH0 + 0x0010)
+#define ALV0 (DPB0 + 0x001A)
+#define ALVSIZE 256
 #define DIRBUF 0xff80
 #define CPMLIBDIR "./"
-static int storedfps = 0;
-unsigned short usercode = 0x00;
-int restricted_mode = 0;
-int silent_exit = 0;
-char *stuff_cmd = 0;
-int exec = 0;
-int trace_bdos = 0;
+
+/* Give up on the machine after an error in the emulation */
+
+static void bdosfatal(z80info *z80)
+{
+    tracesave(z80, "BDOS emulation error");
+    if (z80->con.embedded) {
+	finish(z80);
+	return;
+    }
+    resetterm();
+    exit(1);
+}
+
+/* Get a character for a console input call: if an embedded machine has
+   no input yet, it is stopped to make the call again once it has some */
+
+static int waitkey(z80info *z80)
+{
+    int c = kget(z80, 0);
+    if (c == -1 && z80->con.embedded)
+	z80->blocked = TRUE;
+    return c;
+}
 
 /* Kill CP/M command line prompt */
 
-static void killprompt()
+static void killprompt(z80info *z80)
 {
-    vt52('\b');
-    vt52(' ');
-    vt52('\b');
-    vt52('\b');
-    vt52(' ');
-    vt52('\b');
+    vt52(z80, '\b');
+    vt52(z80, ' ');
+    vt52(z80, '\b');
+    vt52(z80, '\b');
+    vt52(z80, ' ');
+    vt52(z80, '\b');
 }
 
+/* Read a command line into z80->cmdline.  Returns NULL if an embedded
+   machine runs out of input part way through: the line read so far is
+   kept for when the call is made again. */
+
 char *rdcmdline(z80info *z80, int max, int ctrl_c_enable)
 {
     int i, c;
-    static char s[259];
+    char *s = z80->cmdline;
 
     fflush(stdout);
     max &= 0xff;
     i = 1;      /* number of next character */
 
-    if (stuff_cmd) {
-        killprompt();
-    	strcpy(s + i, stuff_cmd);
+    if (z80->cmdpos) {
+	i = z80->cmdpos;
+	z80->cmdpos = 0;
+    } else if (z80->stuff_cmd) {
+        killprompt(z80);
+    	strncpy(s + i, z80->stuff_cmd, sizeof z80->cmdline - 2);
+    	s[sizeof z80->cmdline - 1] = 0;
     	/* printf("'%s'\n", stuff_cmd); */
     	i = 1 + strlen(s + i);
-    	stuff_cmd = 0;
-    	silent_exit = 1;
+    	z80->stuff_cmd = 0;
+    	z80->silent_exit = 1;
     	goto hit_rtn;
-    } else if (exec) {
-        killprompt();
-        printf("\r\n");
+    } else if (z80->exec) {
+        killprompt(z80);
+        vt52_puts(z80, (const unsigned char *)"\r\n", 2);
         finish(z80);
+        s[0] = 0;
         return s;
     }
 
 loop:
-    c = kget(0);
-    if (c == INTR_CHAR) {
-    	command(z80);
+    c = waitkey(z80);
+    if (c == -1 && z80->blocked) {
+	z80->cmdpos = i;
+	return NULL;
+    } else if (c == INTR_CHAR) {
+    	monitor(z80);
     	i = 1;
     	s[0] = i - 1;
     	s[i] = 0;
@@ -72,8 +105,8 @@ loop:
         switch (c) {
 	case 3:
 	    if (ctrl_c_enable) {
-		vt52('^');
-		vt52('C');
+		vt52(z80, '^');
+		vt52(z80, 'C');
 		z80->regpc = BIOS+3;
 		s[0] = 0;
 		return s;
@@ -83,9 +116,9 @@ loop:
 	case 0x7f:
 	    if (i > 1) {
 		--i;
-		vt52('\b');
-		vt52(' ');
-		vt52('\b');
+		vt52(z80, '\b');
+		vt52(z80, ' ');
+		vt52(z80, '\b');
 		fflush(stdout);
 	    }
 	    break;
@@ -95,7 +128,7 @@ loop:
 	    s[0] = i-1;
 	    s[i] = 0;
 	    if (!strcmp(s + 1, "bye")) {
-	    	printf("\r\n");
+	    	vt52_puts(z80, (const unsigned char *)"\r\n", 2);
 	    	finish(z80);
 	    }
 	    if (i <= max)
@@ -105,7 +138,7 @@ loop:
         goto loop;
     } else if (i <= max) {
         s[i++] = c;
-        vt52(c);
+        vt52(z80, c);
 	fflush(stdout);
     }
     goto loop;
@@ -120,7 +153,7 @@ static struct FCB {
 } samplefcb;
 #endif
 
-static void FCB_to_filename(unsigned char *p, char *name) {
+static void FCB_to_filename(z80info *z80, unsigned char *p, char *name) {
     int i;
     char *org = name;
     /* strcpy(name, "test/");
@@ -135,11 +168,11 @@ static void FCB_to_filename(unsigned char *p, char *name) {
 		*name++ = tolower(p[i+9]);
     }
     *name = '\0';
-    if (trace_bdos)
+    if (z80->trace_bdos)
     	printf("File name is %s\r\n", org);
 }
 
-static void FCB_to_ufilename(unsigned char *p, char *name) {
+static void FCB_to_ufilename(z80info *z80, unsigned char *p, char *name) {
     int i;
     char *org = name;
     /* strcpy(name, "test/");
@@ -154,55 +187,138 @@ static void FCB_to_ufilename(unsigned char *p, char *name) {
 		*name++ = toupper(p[i+9]);
     }
     *name = '\0';
-    if (trace_bdos)
+    if (z80->trace_bdos)
     	printf("File name is %s\r\n", org);
 }
 
-static struct stfps {
-    FILE *fp;
-    unsigned where;
-    char name[12];
-} stfps[100];
-
-static void storefp(z80info *z80, FILE *fp, unsigned where) {
+static void storefp(z80info *z80, FILE *fp, unsigned where, const char *path) {
     int i;
     int ind = -1;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == 0xffffU)
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where == 0xffffU)
 	    ind = i;
-	else if (stfps[i].where == where) {
+	else if (z80->stfps[i].where == where) {
 	    ind = i;
 	    goto putfp;
 	}
     if (ind < 0) {
-	if (++storedfps > 100) {
+	if (z80->storedfps == BDOSFILES) {
 	    fprintf(stderr, "out of fp stores!\n");
-            resetterm();
-	    exit(1);
+	    fclose(fp);
+	    bdosfatal(z80);
+	    return;
 	}
-	ind = storedfps - 1;
+	++z80->storedfps;
+	ind = z80->storedfps - 1;
     }
-    stfps[ind].where = where;
+    z80->stfps[ind].where = where;
  putfp:
-    stfps[ind].fp = fp;
-    memcpy(stfps[ind].name, z80->mem+z80->regde+1, 11);
-    stfps[ind].name[11] = '\0';
+    z80->stfps[ind].fp = fp;
+    memcpy(z80->stfps[ind].name, z80->mem+z80->regde+1, 11);
+    z80->stfps[ind].name[11] = '\0';
+    strncpy(z80->stfps[ind].path, path, BDOSPATHLEN - 1);
+    z80->stfps[ind].path[BDOSPATHLEN - 1] = '\0';
+}
+
+/* Save the user code and the open file table for a snapshot: for each
+   open file, the FCB address, the CP/M name and the host file name.
+   Returns the number of bytes used. */
+
+long bdos_savefiles(z80info *z80, byte *buf, long max) {
+    long n = 0;
+    int i;
+    buf[n++] = z80->usercode;
+    for (i = 0; i < z80->storedfps; ++i) {
+	long len = strlen(z80->stfps[i].path) + 1;
+	if (z80->stfps[i].where == 0xffffU)
+	    continue;
+	if (n + 2 + 11 + len > max) {
+	    fprintf(stderr, "too many open files for snapshot\r\n");
+	    break;
+	}
+	buf[n++] = z80->stfps[i].where & 0xff;
+	buf[n++] = z80->stfps[i].where >> 8;
+	memcpy(buf + n, z80->stfps[i].name, 11);
+	n += 11;
+	memcpy(buf + n, z80->stfps[i].path, len);
+	n += len;
+    }
+    return n;
+}
+
+/* Restore what bdos_savefiles() saved, reopening the files.  Returns -1
+   if a name in it is unterminated or too long. */
+
+int bdos_loadfiles(z80info *z80, const byte *buf, long len) {
+    long n = 0;
+    const byte *end;
+    z80->storedfps = 0;
+    if (len > 0)
+	z80->usercode = buf[n++];
+    while (n + 2 + 11 < len && z80->storedfps < BDOSFILES) {
+	bdosfile *f = &z80->stfps[z80->storedfps];
+	f->where = buf[n] + (buf[n + 1] << 8);
+	memcpy(f->name, buf + n + 2, 11);
+	f->name[11] = '\0';
+	n += 2 + 11;
+	end = (const byte *)memchr(buf + n, 0, len - n);
+	if (end == NULL || end - (buf + n) >= BDOSPATHLEN) {
+	    fprintf(stderr, "bad file name in snapshot\n");
+	    bdos_closeall(z80);
+	    return -1;
+	}
+	memcpy(f->path, buf + n, end - (buf + n) + 1);
+	n = end + 1 - buf;
+	if (!(f->fp = fopen(f->path, "r+b")) && !(f->fp = fopen(f->path, "rb"))) {
+	    fprintf(stderr, "cannot reopen '%s' from snapshot\n", f->path);
+	    continue;
+	}
+	++z80->storedfps;
+    }
+    return 0;
+}
+
+/* Host calls made for more than one BDOS function, counted for
+   callstats */
+
+/* A replay keeps its files in a directory of its own (see replaypath) */
+
+static FILE *hostopen(z80info *z80, const char *name, const char *mode) {
+    char path[1024];
+    IOSTAT(1, 0);
+    return fopen(replaypath(z80, name, path, sizeof(path)), mode);
+}
+
+static DIR *hostopendir(z80info *z80) {
+    IOSTAT(1, 0);
+    return z80->dp = opendir(replaydir(z80));
+}
+
+static struct dirent *hostreaddir(z80info *z80) {
+    IOSTAT(1, 0);
+    return readdir(z80->dp);
+}
+
+static void hostclosedir(z80info *z80) {
+    IOSTAT(1, 0);
+    closedir(z80->dp);
+    z80->dp = NULL;
 }
 
 /* Lookup an FCB to find the host file. */
 
 static FILE *lookfp(z80info *z80, unsigned where) {
     int i;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == where)
-            if (memcmp(stfps[i].name, z80->mem+z80->regde+1, 11) == 0)
-	    return stfps[i].fp;
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where == where)
+            if (memcmp(z80->stfps[i].name, z80->mem+z80->regde+1, 11) == 0)
+	    return z80->stfps[i].fp;
     /* fcb not found. maybe it has been moved? */
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where != 0xffffU &&
-	    !memcmp(z80->mem+z80->regde+1, stfps[i].name, 11)) {
-	    stfps[i].where = where;	/* moved FCB */
-	    return stfps[i].fp;
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where != 0xffffU &&
+	    !memcmp(z80->mem+z80->regde+1, z80->stfps[i].name, 11)) {
+	    z80->stfps[i].where = where;	/* moved FCB */
+	    return z80->stfps[i].fp;
 	}
     return NULL;
 }
@@ -215,11 +331,10 @@ static void fcberr(z80info *z80, unsigned where) {
     fprintf(stderr, "error: cannot find fp entry for FCB at %04x"
 	    " fctn %d, FCB named %s\n", where, z80->regbc & 0xff,
 	    z80->mem+where+1);
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where != 0xffffU)
-	    printf("%s %04x\n", stfps[i].name, stfps[i].where);
-    resetterm();
-    exit(1);
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where != 0xffffU)
+	    printf("%s %04x\n", z80->stfps[i].name, z80->stfps[i].where);
+    bdosfatal(z80);
 }
 
 /* Get the host file for an FCB when it should be open. */
@@ -234,9 +349,9 @@ static FILE *getfp(z80info *z80, unsigned where) {
 
 static void delfp(z80info *z80, unsigned where) {
     int i;
-    for (i = 0; i < storedfps; ++i)
-	if (stfps[i].where == where) {
-	    stfps[i].where = 0xffffU;
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where == where) {
+	    z80->stfps[i].where = 0xffffU;
 	    return;
 	}
     fcberr(z80, where);
@@ -295,8 +410,6 @@ static void delfp(z80info *z80, unsigned where) {
 /* Convert offset to high byte of extent number */
 #define SEQ_S2(n) (SEQ_EXTENT(n) / 32)
 
-static DIR *dp = NULL;
-static unsigned sfn = 0;
 
 char *bdos_decode(int n)
 {
@@ -389,6 +502,93 @@ void bdos_fcb_dump(z80info *z80)
 	       z80->mem[DE + 34], z80->mem[DE + 35]);
 }
 
+/* Fill in DPB0 and ALV0 so that A: looks like a CP/M disk with as much
+   free space as the host directory has.  CP/M 2.2 can not address more
+   than 8MB per drive, so bigger volumes are clamped to that.  statvfs()
+   is done at most once a second, or again after a disk reset, unless the
+   session is being recorded. */
+
+static unsigned long kbytes(unsigned long n, unsigned long size)
+{
+    if (size >= 1024)
+	return n * (size / 1024);
+    else
+	return n / (1024 / (size ? size : 1024));
+}
+
+static void diskparams(z80info *z80)
+{
+    struct statvfs fs;
+    unsigned long total, avail; /* in K */
+    unsigned long blocks, used, dirblks, x;
+    unsigned bsh, drm, al;
+    byte *p;
+
+    /* a recording has every call, so that its replay does the same */
+    if (z80->dpbtime == time(NULL) && !z80->rec)
+	return;
+    z80->dpbtime = time(NULL);
+
+    if (z80->replay) {
+	total = avail = 0;		/* from the recording */
+    } else {
+	IOSTAT(1, 0);
+	if (statvfs(".", &fs)) {
+	    total = 8192;
+	    avail = 0;
+	} else {
+	    total = kbytes(fs.f_blocks, fs.f_frsize);
+	    avail = kbytes(fs.f_bavail, fs.f_frsize);
+	}
+    }
+    if (z80->rec)
+	recstatfs(z80, &total, &avail);
+    if (total > 8192)
+	total = 8192;
+    if (total < 64)
+	total = 64;
+    if (avail > total)
+	avail = total;
+
+    /* Smallest block size which keeps the allocation vector in ALVSIZE
+       bytes (1K blocks are only allowed on disks with < 256 blocks) */
+    for (bsh = 3; ; ++bsh) {
+	blocks = total >> (bsh - 3);
+	if (blocks <= ALVSIZE * 8 && (bsh > 3 || blocks <= 256))
+	    break;
+    }
+    drm = (blocks <= 256) ? 63 : 1023;
+    dirblks = ((drm + 1) * 32L + (128L << bsh) - 1) / (128L << bsh);
+    used = blocks - (avail >> (bsh - 3));
+    if (used < dirblks)
+	used = dirblks;
+
+    p = z80->mem + DPB0;
+    p[0] = 64;				/* SPT */
+    p[1] = 0;
+    p[2] = bsh;				/* BSH */
+    p[3] = (1 << bsh) - 1;		/* BLM */
+    p[4] = (blocks <= 256) ? (1 << (bsh - 3)) - 1 : (1 << (bsh - 4)) - 1;
+    p[5] = (blocks - 1) & 0xFF;		/* DSM */
+    p[6] = (blocks - 1) >> 8;
+    p[7] = drm & 0xFF;			/* DRM */
+    p[8] = drm >> 8;
+    al = (0xFFFF0000UL >> dirblks) & 0xFFFF;
+    p[9] = al >> 8;			/* AL0 */
+    p[10] = al & 0xFF;			/* AL1 */
+    p[11] = 0;				/* CKS: fixed disk */
+    p[12] = 0;
+    p[13] = 0;				/* OFF */
+    p[14] = 0;
+
+    /* Allocated blocks are reported as being at the front of the disk */
+    p = z80->mem + ALV0;
+    memset(p, 0, ALVSIZE);
+    memset(p, 0xFF, used / 8);
+    for (x = used & ~7UL; x != used; ++x)
+	p[x / 8] |= 0x80 >> (x % 8);
+}
+
 /* Get count of records in current extent */
 
 int fixrc(z80info *z80, FILE *fp)
@@ -398,6 +598,7 @@ int fixrc(z80info *z80, FILE *fp)
     unsigned long full;
     unsigned long ext;
     /* Get file size */
+    IOSTAT(1, 0);
     if (fstat(fileno(fp), &stbuf) || !S_ISREG(stbuf.st_mode)) {
         return -1;
     }
@@ -426,10 +627,11 @@ void check_BDOS_hook(z80info *z80) {
     int i;
     char name[32];
     char name2[32];
+    char path[1024], path2[1024];
     FILE *fp;
     char *s, *t;
     const char *mode;
-    if (trace_bdos)
+    if (z80->trace_bdos)
     {
         printf("\r\nbdos %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
 	for (i = 0; i < 8; ++i)
@@ -437,6 +639,12 @@ void check_BDOS_hook(z80info *z80) {
 		   + 256 * z80->mem[SP + 2*i + 1]);
 	printf(")\r\n");
     }
+    /* about to wait for console input: a snapshot resumes by making
+       this call again */
+    if (z80->savestatefile && (C == 1 || (C == 6 && E == 0xfd) ||
+			       (C == 10 && !z80->cmdpos && !z80->stuff_cmd &&
+				!z80->exec)))
+	inputwait(z80, PC);
     switch (C) {
     case  0:    /* System Reset */
 	warmboot(z80);
@@ -450,18 +658,20 @@ void check_BDOS_hook(z80info *z80) {
 #endif
 	break;
     case 1:     /* Console Input */
-	HL = kget(0);
+	if ((i = waitkey(z80)) == -1 && z80->blocked)
+	    return;
+	HL = i;
 	B = H; A = L;
 	if (A < ' ') {
 	    switch(A) {
 	    case '\r':
 	    case '\n':
 	    case '\t':
-		vt52(A);
+		vt52(z80, A);
 		break;
 	    default:
-		vt52('^');
-		vt52((A & 0xff)+'@');
+		vt52(z80, '^');
+		vt52(z80, (A & 0xff)+'@');
 		if (A == 3) {	/* ctrl-C pressed */
 		    /* PC = BIOS+3;
 		       check_BIOS_hook(); */
@@ -470,11 +680,11 @@ void check_BDOS_hook(z80info *z80) {
 		}
 	    }
 	} else {
-	    vt52(A);
+	    vt52(z80, A);
 	}
 	break;
     case 2:     /* Console Output */
-	vt52(0x7F & E);
+	vt52(z80, 0x7F & E);
 	HL = 0;
         B = H; A = L;
 	break;
@@ -492,21 +702,23 @@ void check_BDOS_hook(z80info *z80) {
         goto UNSUP;
     case 6:     /* direct I/O */
 	switch (E) {
-	case 0xff:  if (!constat()) {
+	case 0xff:  if (!constat(z80)) {
 	    HL = 0;
             B = H; A = L;
 	    F = 0;
 	    break;
 	} /* FALLTHRU */
-	case 0xfd:  HL = kget(0);
+	case 0xfd:  if ((i = waitkey(z80)) == -1 && z80->blocked)
+		return;
+	    HL = i;
             B = H; A = L;
 	    F = 0;
 	    break;
-	case 0xfe:  HL = constat() ? 0xff : 0;
+	case 0xfe:  HL = constat(z80) ? 0xff : 0;
             B = H; A = L;
 	    F = 0;
 	    break;
-	default:    vt52(0x7F & E);
+	default:    vt52(z80, 0x7F & E);
             HL = 0;
             B = H; A = L;
 	}
@@ -518,14 +730,17 @@ void check_BDOS_hook(z80info *z80) {
         /* FIXME */
         goto UNSUP;
     case 9:	/* Print String */
-	s = (char *)(z80->mem + DE);
-	while (*s != '$')
-	    vt52(0x7F & *s++);
+	{   unsigned char *p = z80->mem + DE;
+	    unsigned char *e = memchr(p, '$', 0x10000L - DE);
+	    vt52_puts(z80, p, e ? e - p : 0x10000L - DE);
+	}
         HL = 0;
         B = H; A = L;
 	break;
     case 10:    /* Read Command Line */
 	s = rdcmdline(z80, *(unsigned char *)(t = (char *)(z80->mem + DE)), 1);
+	if (s == NULL)		/* waiting for the rest of the line */
+	    return;
 	if (PC == BIOS+3) { 	/* ctrl-C pressed */
 	    /* check_BIOS_hook(); */		/* execute WBOOT */
 	    warmboot(z80);
@@ -538,7 +753,7 @@ void check_BDOS_hook(z80info *z80) {
         B = H; A = L;
 	break;
     case 11:	/* Console Status */
-	HL = (constat() ? 0xff : 0x00);
+	HL = (constat(z80) ? 0xff : 0x00);
         B = H; A = L;
 	F = 0;
 	break;
@@ -548,23 +763,24 @@ void check_BDOS_hook(z80info *z80) {
 	F = 0;
 	break;
     case 13:	/* reset disk system */
-	/* storedfps = 0; */	/* WS crashes then */
+	/* z80->storedfps = 0; */	/* WS crashes then */
 	HL = 0;
         B = H; A = L;
-	if (dp)
-	    closedir(dp);
+	if (z80->dp)
+	    hostclosedir(z80);
 	{   struct dirent *de;
-            if ((dp = opendir("."))) {
-                while ((de = readdir(dp))) {
+            if (hostopendir(z80)) {
+                while ((de = hostreaddir(z80))) {
                     if (strchr(de->d_name, '$')) {
                         A = 0xff;
                         break;
                     }
                 }
-                closedir(dp);
+                hostclosedir(z80);
             }
         }
-	dp = NULL;
+	z80->dp = NULL;
+	z80->dpbtime = 0;
 	z80->dma = 0x80;
 	/* select only A:, all r/w */
 	break;
@@ -577,18 +793,21 @@ void check_BDOS_hook(z80info *z80) {
     fileio:
         /* check if the file is already open */
         if (!(fp = lookfp(z80, DE))) {
+	    if (z80->replay)
+		recfile(z80, NULL);
             /* not already open - try lowercase */
-            FCB_to_filename(z80->mem+DE, name);
-	if (!(fp = fopen(name, mode))) {
-	    FCB_to_ufilename(z80->mem+DE, name); /* Try all uppercase instead */
-            if (!(fp = fopen(name, mode))) {
-	            FCB_to_filename(z80->mem+DE, name);
+            FCB_to_filename(z80, z80->mem+DE, name);
+	if (!(fp = hostopen(z80, name, mode))) {
+	    FCB_to_ufilename(z80, z80->mem+DE, name); /* Try all uppercase instead */
+            if (!(fp = hostopen(z80, name, mode))) {
+	            FCB_to_filename(z80, z80->mem+DE, name);
 		    if (*mode == 'r') {
 			char ss[50];
 			snprintf(ss, sizeof(ss), "%s/%s", CPMLIBDIR, name);
-			fp = fopen(ss, mode);
+			fp = hostopen(z80, ss, mode);
 			if (!fp)
-			  fp = fopen(ss, "rb");
+			  fp = hostopen(z80, ss, "rb");
+			strcpy(name, ss);
 		    }
 		    if (!fp) {
 			/* still no success */
@@ -599,8 +818,10 @@ void check_BDOS_hook(z80info *z80) {
 		    }
             }
             }
+	    if (z80->rec && !z80->replay && *mode == 'r')
+		recfile(z80, name);
             /* where to store fp? */
-            storefp(z80, fp, DE);
+            storefp(z80, fp, DE, name);
 	}
 	/* success */
 
@@ -622,6 +843,7 @@ void check_BDOS_hook(z80info *z80) {
 	    HL = 0xFF;
             B = H; A = L;
 	    F = 0;
+	    IOSTAT(1, 0);
 	    fclose(fp);
             delfp(z80, DE);
 	    break;
@@ -641,6 +863,7 @@ void check_BDOS_hook(z80info *z80) {
 		B = H, A = L;
 		break;
 	    }
+            IOSTAT(2, 0);
             fseek(fp, 0, SEEK_END);
             host_size = ftell(fp);
             host_exts = SEQ_EXTENT(host_size);
@@ -649,10 +872,12 @@ void check_BDOS_hook(z80info *z80) {
                    CP/M program to truncate it by reducing RC */
                 if (z80->mem[DE + FCB_RC] < SEQ_CR(host_size)) {
                     host_size = (16384L * SEQ_EXT + 128L * (long)z80->mem[DE + FCB_RC]);
+                    IOSTAT(1, 0);
                     ftruncate(fileno(fp), host_size);
                 }
             }
 	delfp(z80, DE);
+	IOSTAT(1, 0);
 	fclose(fp);
             z80->mem[DE + FCB_S2] &= 0x7F; /* Clear high bit: indicates closed */
 	HL = 0;
@@ -661,25 +886,24 @@ void check_BDOS_hook(z80info *z80) {
         }
 	break;
     case 17:	/* search for first */
-	if (dp)
-	    closedir(dp);
-	if (!(dp = opendir("."))) {
+	if (z80->dp)
+	    hostclosedir(z80);
+	if (!hostopendir(z80)) {
 	    fprintf(stderr, "opendir fails\n");
-            resetterm();
-	    exit(1);
+	    bdosfatal(z80);
+	    break;
 	}
-	sfn = DE;
+	z80->sfn = DE;
 	/* fall through */
     case 18:	/* search for next */
-	if (!dp)
+	if (!z80->dp)
 	    goto retbad;
 	{   struct dirent *de;
 	    unsigned char *p;
 	    const char *sr;
 	nocpmname:
-	    if (!(de = readdir(dp))) {
-		closedir(dp);
-		dp = NULL;
+	    if (!(de = hostreaddir(z80))) {
+		hostclosedir(z80);
 	    retbad:
 	        HL = 0xff;
                 B = H; A = L;
@@ -715,7 +939,7 @@ void check_BDOS_hook(z80info *z80) {
 	    /* OK, fcb block is filled */
 	    /* match name */
 	    p -= 11;
-	    sr = (char *)(z80->mem + sfn);
+	    sr = (char *)(z80->mem + z80->sfn);
 	    for (i = 1; i <= 12; ++i)
 		if (sr[i] != '?' && sr[i] != p[i])
 		    goto nocpmname;
@@ -727,16 +951,20 @@ void check_BDOS_hook(z80info *z80) {
 	}
 	break;
     case 19:	/* delete file (no wildcards yet) */
-	FCB_to_filename(z80->mem + DE, name);
-	unlink(name);
+	FCB_to_filename(z80, z80->mem + DE, name);
+	IOSTAT(1, 0);
+	unlink(replaypath(z80, name, path, sizeof(path)));
 	HL = 0;
         B = H; A = L;
 	break;
     case 20:	/* read sequential */
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
     readseq:
+	IOSTAT(2, 0);
 	if (!fseek(fp, SEQ_ADDRESS, SEEK_SET) && ((i = fread(z80->mem+z80->dma, 1, 128, fp)) > 0)) {
 	    long ofst = ftell(fp) + 127;
+	    IOSTAT(0, i);
 	    if (i != 128)
 		memset(z80->mem+z80->dma+i, 0x1a, 128-i);
 	    z80->mem[DE + FCB_CR] = SEQ_CR(ofst);
@@ -751,13 +979,16 @@ void check_BDOS_hook(z80info *z80) {
 	}    
 	break;
     case 21:	/* write sequential */
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
     writeseq:
+	IOSTAT(2, 0);
 	if (!fseek(fp, SEQ_ADDRESS, SEEK_SET) && fwrite(z80->mem+z80->dma, 1, 128, fp) == 128) {
 	    long ofst = ftell(fp);
 	    z80->mem[DE + FCB_CR] = SEQ_CR(ofst);
 	    z80->mem[DE + FCB_EX] = SEQ_EX(ofst);
 	    z80->mem[DE + FCB_S2] = (0x80 | SEQ_S2(ofst));
+            IOSTAT(1, 128);
             fflush(fp);
 	    fixrc(z80, fp);
 	    HL = 0x00;
@@ -771,10 +1002,12 @@ void check_BDOS_hook(z80info *z80) {
 	mode = "w+b";
 	goto fileio;
     case 23:	/* rename file */
-	FCB_to_filename(z80->mem + DE, name);
-	FCB_to_filename(z80->mem + DE + 16, name2);
+	FCB_to_filename(z80, z80->mem + DE, name);
+	FCB_to_filename(z80, z80->mem + DE + 16, name2);
 	/* printf("rename %s %s called\n", name, name2); */
-	rename(name, name2);
+	IOSTAT(1, 0);
+	rename(replaypath(z80, name, path, sizeof(path)),
+	       replaypath(z80, name2, path2, sizeof(path2)));
 	HL = 0;
         B = H; A = L;
 	break;
@@ -794,8 +1027,10 @@ void check_BDOS_hook(z80info *z80) {
         B = H; A = L;
 	break;
     case 27:    /* Get Allocation ADR */
-        /* FIXME */
-        goto UNSUP;
+	diskparams(z80);
+	HL = ALV0;    /* only A: */
+        B = H; A = L;
+	break;
     case 28:    /* Write protect disk */
         /* FIXME */
         goto UNSUP;
@@ -808,23 +1043,25 @@ void check_BDOS_hook(z80info *z80) {
         /* FIXME */
         goto UNSUP;
     case 31:    /* get disk parameters */
+	diskparams(z80);
         HL = DPB0;    /* only A: */
         B = H; A = L;
         break;
     case 32:    /* Get/Set User Code */
 	if (E == 0xff) {  /* Get Code */
-	    HL = usercode;
+	    HL = z80->usercode;
             B = H; A = L;
 	} else {
-	    usercode = E;
-            HL = 0; /* Or does it get usercode? */
+	    z80->usercode = E;
+            HL = 0; /* Or does it get z80->usercode? */
             B = H; A = L;
         }
 	break;
     case 33:	/* read random record */
         {
         long ofst;
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
 	/* printf("data is %02x %02x %02x\n", z80->mem[z80->regde+33],
 	       z80->mem[z80->regde+34], z80->mem[z80->regde+35]); */
 	ofst = ADDRESS;
@@ -837,7 +1074,8 @@ void check_BDOS_hook(z80info *z80) {
         {
         long ofst;
         RANDWRITE:
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
 	/* printf("data is %02x %02x %02x\n", z80->mem[z80->regde+33],
 	       z80->mem[z80->regde+34], z80->mem[z80->regde+35]); */
 	ofst = ADDRESS;
@@ -847,11 +1085,14 @@ void check_BDOS_hook(z80info *z80) {
 	goto writeseq;
 	}
     case 35:	/* compute file size */
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
+	IOSTAT(1, 0);
 	fseek(fp, 0L, SEEK_END);
 	/* fall through */
     case 36:	/* set random record */
-	fp = getfp(z80, DE);
+	if (!(fp = getfp(z80, DE)))
+	    break;
 	{   
 	    long ofst = ftell(fp) + 127;
 	    long pos = (ofst >> 7);
@@ -875,7 +1116,8 @@ void check_BDOS_hook(z80info *z80) {
     case 41:    /* Change directory- this is non-standard */
 	for (s = (char *)(z80->mem + DE); *s; ++s)
 	    *s = tolower(*(unsigned char *)s);
-	HL = (restricted_mode || chdir((char  *)(z80->mem + DE))) ? 0xff : 0x00;
+	IOSTAT(1, 0);
+	HL = (z80->restricted_mode || chdir((char  *)(z80->mem + DE))) ? 0xff : 0x00;
         B = H; A = L;
 	break;
     default:
@@ -891,6 +1133,20 @@ void check_BDOS_hook(z80info *z80) {
 	/*exit(1); */
 	break;
     }
+    conflush(z80);
     z80->mem[PC = DIRBUF-1] = 0xc9; /* Return instruction */
     return;
 }
+
+/* Close the files and directory search a machine has open */
+
+void bdos_closeall(z80info *z80) {
+    int i;
+    for (i = 0; i < z80->storedfps; ++i)
+	if (z80->stfps[i].where != 0xffffU)
+	    fclose(z80->stfps[i].fp);
+    z80->storedfps = 0;
+    if (z80->dp)
+	closedir(z80->dp);
+    z80->dp = NULL;
+}
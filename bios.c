@@ -25,6 +25,11 @@
 #include <sys/stat.h>
 #endif
 
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 /* definition of: extern unsigned char	cpm_array[]; */
 #include "cpm.c"
 
@@ -36,46 +41,46 @@
 #define NENTRY		30	/* number of BIOS entries */
 #define STACK		0xEF00	/* grows down from here */
 
-/* The first NUMHDISCS drives may be specified as hard-drives. */
+/* The first NUMHDISCS drives default to hard-drives. */
 #define NUMHDISCS	2
-#define NUMDISCS	(MAXDISCS - NUMHDISCS)
 
 #if NUMHDISCS > MAXDISCS
 #	error	Too many hard-discs specified here.
 #endif
 
-/* disk parameter block information */
+/* The BIOS tables are laid out by setupdisks() from CBIOS + NENTRY * 8 up
+   to BIOSTOP (bdos.c keeps its own tables above that). */
+#define BIOSTOP		0xFE00
 #define DPBSIZE		15
-#define HDPBLOCK	(CBIOS + NENTRY * 8)
-#define DPBLOCK		(HDPBLOCK + DPBSIZE)
-#define DIRBUF		(DPBLOCK + DPBSIZE)
 #define DPHSIZE		16
 
-/* hard disc parameter info */
-#define HDPBASE		(DIRBUF + SECTORSIZE)
-
-#define DPBASE		(HDPBASE + DPHSIZE * NUMHDISCS)
-#define CVSIZE		0
-#define ALVSIZE		33
-#define CVBASE		(DPBASE + DPHSIZE * NUMDISCS)
-#define ALVBASE		(CVBASE + CVSIZE * NUMDISCS)
-
-/* ST-506 allocation vector size */
-#define HALVBASE	(ALVBASE + ALVSIZE * NUMDISCS)
-#define HALVSIZE	306
-
 /* buffer for where to return time/date info */
-#define TIMEBUF		(HALVBASE + HALVSIZE * NUMHDISCS)
 #define TIMEBUFSIZE	5
 
-/* just a marker for future expansion */
-#define END_OF_BIOS	(TIMEBUF + TIMEBUFSIZE)
+/* The largest allocation vector one drive can have: what is left of the
+   tables when every other drive has the smallest one. */
+#define MAXALV		(BIOSTOP - (CBIOS + NENTRY * 8) - \
+			 MAXDISCS * (DPBSIZE + DPHSIZE) - SECTORSIZE - \
+			 TIMEBUFSIZE - (MAXDISCS - 1))
+
+/* so the most blocks a drive can have, a bit each in its vector (the
+   message in checkgeom() gives the number) */
+#define MAXBLOCKS	33888
+
+#if MAXBLOCKS != MAXALV * 8
+#	error	MAXBLOCKS does not match the room for the allocation vectors.
+#endif
 
 
 /* ST-506 HD sector info (floppy defs are in cpmdisc.h for makedisc.c) */
 #define	HDSECTORSPERTRACK	64
 #define	HDTRACKSPERDISC		610
 
+/* An image may describe its own geometry: the first sector of its first
+   reserved track holds DISKMAGIC followed by a CP/M 2.2 DPB. */
+#define DISKMAGIC	"CPMDISK\032"
+#define DISKMAGICLEN	8
+
 /* offsets into FCB needed for reading/writing Unix files */
 #define FDOFFSET	12
 #define BLKOFFSET	16
@@ -93,17 +98,118 @@
 #define USERSTART	0x0100
 
 
+/* track cache used when disk images are not memory-mapped: the cached
+   "tracks" are CACHESECS sectors long whatever the drive geometry */
+#define NCACHE		32	/* number of tracks to keep */
+#define CACHESECS	64	/* sectors per cached track */
+#define FLUSHSECS	5	/* write back dirty tracks at least this often */
+
+struct dcache
+{
+	struct ctrack
+	{
+		int drive;		/* -1 if slot is not in use */
+		long track;
+		int dirty;		/* set if any sector is dirty */
+		unsigned long used;	/* for LRU replacement */
+		byte dirtysec[CACHESECS];
+		byte data[CACHESECS * SECTORSIZE];
+	} t[NCACHE];
+	unsigned long clock;
+	time_t flushed;
+	unsigned long hits, misses, writebacks;
+};
+
+
+/* Copy-on-write overlays: if overlaydir is set, the disk images in the
+   current directory are only ever read, through a shared read-only
+   mapping, and sector writes go to a sparse file of the same name in
+   overlaydir.  The overlay file is a header sector, a bitmap with one bit
+   per sector of the drive, and then the sectors themselves.  Sector n is
+   at data + n * SECTORSIZE and is only valid if its bit is set. */
+
+#define OVLMAGIC	"CPMOVL1\n"
+#define OVLMAGICLEN	8
+
+struct overlay
+{
+	byte *base;		/* base image, or NULL if there is none */
+	long baselen;
+	byte *map;		/* the whole overlay file */
+	long maplen;
+	byte *bitmap;
+	byte *data;
+	long nsect;		/* number of sectors the overlay covers */
+};
+
+
 /* forward declarations: */
 static void seldisc(z80info *z80);
+static void flushcache(z80info *z80, int drop);
+
 
+/* Memory-map a disk image so that sector I/O is just a memcpy().  The
+   mapping covers the whole drive even if the file is shorter: the file
+   is extended with ftruncate() before we touch anything past its end.
+   If the mapping fails, we fall back on stdio. */
+
+static void
+mapdisk(z80info *z80, int drive, long len)
+{
+#ifndef NO_MMAP
+	void *p;
+
+	if (z80->drivemap[drive] != NULL)
+	{
+		munmap(z80->drivemap[drive], z80->drivemaplen[drive]);
+		z80->drivemap[drive] = NULL;
+	}
+
+	fflush(z80->drives[drive]);
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fileno(z80->drives[drive]), 0);
+
+	if (p != MAP_FAILED)
+	{
+		z80->drivemap[drive] = p;
+		z80->drivemaplen[drive] = len;
+	}
+#else
+	(void)z80;
+	(void)drive;
+	(void)len;
+#endif
+}
 
 static void
 closeall(z80info *z80)
 {
 	int	i;
 
+	flushcache(z80, TRUE);
+
 	for (i = 0; i < MAXDISCS; i++)
 	{
+#ifndef NO_MMAP
+		if (z80->drivemap[i] != NULL)
+		{
+			munmap(z80->drivemap[i], z80->drivemaplen[i]);
+			z80->drivemap[i] = NULL;
+		}
+
+		if (z80->overlay[i] != NULL)
+		{
+			struct overlay *o = z80->overlay[i];
+
+			if (o->base != NULL)
+				munmap(o->base, o->baselen);
+
+			munmap(o->map, o->maplen);
+			free(o);
+			z80->overlay[i] = NULL;
+		}
+#endif
+
 		if (z80->drives[i] != NULL)
 		{
 			fclose(z80->drives[i]);
@@ -112,6 +218,302 @@ closeall(z80info *z80)
 	}
 }
 
+/* Name of the image file for a drive */
+
+static void
+drivename(int drive, char *name)
+{
+	strcpy(name, drive < NUMHDISCS ? "A-Hdrive" : "A-drive");
+	name[0] += drive; /* set the 1st letter to the drive name */
+}
+
+/* Check a drive geometry and work out how many tracks it has.  Returns
+   NULL if it is fine, otherwise what is wrong with it. */
+
+static const char *
+checkgeom(dgeom *g)
+{
+	long blocksize = SECTORSIZE << g->bsh;
+
+	if (g->spt < 1 || g->spt > 0xFFFF)
+		return "bad number of sectors per track";
+
+	if (g->bsh < 3 || g->bsh > 7)
+		return "block size must be 1K, 2K, 4K, 8K or 16K";
+
+	if (g->dsm < 1 || g->dsm > MAXBLOCKS - 1)
+		return "number of blocks must be 2 to 33888";
+
+	if (g->bsh == 3 && g->dsm > 255)
+		return "1K blocks are only allowed on drives of up to 256 blocks";
+
+	if (g->drm < 3 || g->drm > 4095 || (g->drm + 1) % 4 != 0)
+		return "directory entries must be a multiple of 4 up to 4096";
+
+	if (((g->drm + 1) * 32 + blocksize - 1) / blocksize > 16 ||
+			((g->drm + 1) * 32 + blocksize - 1) / blocksize > g->dsm)
+		return "directory does not fit in 16 blocks";
+
+	if (g->off < 0 || g->off > 0xFFFF)
+		return "bad number of reserved tracks";
+
+	g->tracks = g->off + (((g->dsm + 1) << g->bsh) + g->spt - 1) / g->spt;
+
+	if (g->tracks > 0x10000L || g->tracks > 0xFFFFFFL / g->spt)
+		return "drive is too large";
+
+	return NULL;
+}
+
+/* Do two drives have the same DPB? */
+
+static int
+samegeom(const dgeom *a, const dgeom *b)
+{
+	return a->spt == b->spt && a->bsh == b->bsh && a->dsm == b->dsm &&
+		a->drm == b->drm && a->off == b->off;
+}
+
+/* Default geometry for a drive */
+
+static void
+defgeom(dgeom *g, int drive)
+{
+	memset(g, 0, sizeof *g);
+	g->off = RESERVEDTRACKS;
+
+	if (drive < NUMHDISCS)
+	{
+		/* a 5Mb ST-506 hard disc */
+		g->spt = HDSECTORSPERTRACK;
+		g->bsh = 4;
+		g->dsm = 2441;
+		g->drm = 1023;
+		checkgeom(g);
+		g->tracks = HDTRACKSPERDISC;
+	}
+	else
+	{
+		/* a single-sided single-density 8" 256k disc */
+		g->spt = SECTORSPERTRACK;
+		g->bsh = 3;
+		g->dsm = 242;
+		g->drm = 63;
+		g->skew = TRUE;
+		checkgeom(g);
+		g->tracks = TRACKSPERDISC;
+	}
+}
+
+/* Read drive geometry from a file of lines like
+
+	B: 128 4096 2048 1024 2
+
+   giving the drive, sectors per track, block size, number of blocks,
+   number of directory entries and number of reserved tracks.  Anything
+   after a '#' is ignored. */
+
+int
+diskconfig(z80info *z80, const char *file)
+{
+	char buf[256];
+	int line = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Cannot open disk configuration '%s'\n", file);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof buf, fp) != NULL)
+	{
+		const char *err = NULL;
+		long spt, bls, blocks, dirs, off;
+		char *p = strchr(buf, '#');
+		char drive;
+		dgeom g;
+
+		line++;
+
+		if (p != NULL)
+			*p = '\0';
+
+		for (p = buf; isspace((unsigned char)*p); p++)
+			;
+
+		if (*p == '\0')
+			continue;
+
+		drive = toupper((unsigned char)*p) - 'A';
+
+		if (sscanf(p + 1, ": %ld %ld %ld %ld %ld", &spt, &bls, &blocks,
+				&dirs, &off) != 5 || drive < 0 || drive >= MAXDISCS)
+			err = "expected 'drive: spt blocksize blocks dirs reserved'";
+		else
+		{
+			memset(&g, 0, sizeof g);
+
+			for (g.bsh = 3; g.bsh < 7 && (SECTORSIZE << g.bsh) < bls;
+					g.bsh++)
+				;
+
+			if ((SECTORSIZE << g.bsh) != bls)
+				g.bsh = 0;
+
+			g.spt = spt;
+			g.dsm = blocks - 1;
+			g.drm = dirs - 1;
+			g.off = off;
+			err = checkgeom(&g);
+		}
+
+		if (err != NULL)
+		{
+			fprintf(stderr, "%s:%d: %s\n", file, line, err);
+			fclose(fp);
+			return -1;
+		}
+
+		z80->confgeom[(int)drive] = g;
+		z80->confset[(int)drive] = TRUE;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* Look for a geometry header in a drive's image */
+
+static int
+imagegeom(dgeom *g, int drive)
+{
+	byte buf[DISKMAGICLEN + DPBSIZE];
+	const byte *p = buf + DISKMAGICLEN;
+	const char *err;
+	char name[80];
+	FILE *fp;
+	size_t n;
+
+	drivename(drive, name);
+	fp = fopen(name, "rb");
+
+	if (fp == NULL)
+		return FALSE;
+
+	n = fread(buf, 1, sizeof buf, fp);
+	fclose(fp);
+
+	if (n != sizeof buf || memcmp(buf, DISKMAGIC, DISKMAGICLEN) != 0)
+		return FALSE;
+
+	memset(g, 0, sizeof *g);
+	g->spt = p[0] + (p[1] << 8);
+	g->bsh = p[2];
+	g->dsm = p[5] + (p[6] << 8);
+	g->drm = p[7] + (p[8] << 8);
+	g->off = p[13] + (p[14] << 8);
+
+	err = checkgeom(g);
+
+	if (err == NULL && g->off == 0)
+		err = "no reserved track for the header";
+
+	if (err != NULL)
+	{
+		fprintf(stderr, "%s: %s, using the default geometry\r\n",
+				name, err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Work out the geometry of each drive and lay out the BIOS tables after
+   the entry points: the DPBs (drives with the same geometry share one),
+   the directory buffer, the DPHs, the allocation vectors and the time
+   buffer.  If it does not all fit below BIOSTOP, drives go back to the
+   default geometry starting with the last. */
+
+static void
+setupdisks(z80info *z80)
+{
+	long addr;
+	int i, j;
+
+	for (i = 0; i < MAXDISCS; i++)
+	{
+		if (z80->confset[i])
+			z80->geom[i] = z80->confgeom[i];
+		else if (!z80->nobdos || !imagegeom(&z80->geom[i], i))
+			defgeom(&z80->geom[i], i);
+	}
+
+	for (;;)
+	{
+		addr = CBIOS + NENTRY * 8;
+
+		for (i = 0; i < MAXDISCS; i++)
+		{
+			dgeom *g = &z80->geom[i];
+
+			for (j = 0; j < i; j++)
+				if (samegeom(&z80->geom[j], g))
+					break;
+
+			if (j < i)
+				g->dpb = z80->geom[j].dpb;
+			else
+			{
+				g->dpb = addr;
+				addr += DPBSIZE;
+			}
+		}
+
+		z80->dirbuf = addr;
+		addr += SECTORSIZE;
+
+		for (i = 0; i < MAXDISCS; i++)
+		{
+			z80->geom[i].dph = addr;
+			addr += DPHSIZE;
+		}
+
+		for (i = 0; i < MAXDISCS; i++)
+		{
+			z80->geom[i].alv = addr;
+			addr += z80->geom[i].dsm / 8 + 1;
+		}
+
+		z80->timebuf = addr;
+		addr += TIMEBUFSIZE;
+
+		if (addr <= BIOSTOP)
+			break;
+
+		/* put the last drive not yet at its default back to it */
+		for (i = MAXDISCS - 1; i >= 0; i--)
+		{
+			dgeom g;
+
+			defgeom(&g, i);
+
+			if (!samegeom(&g, &z80->geom[i]))
+			{
+				fprintf(stderr, "BIOS tables do not fit: drive %c: "
+						"reverts to its default geometry\r\n", 'A' + i);
+				z80->geom[i] = g;
+				break;
+			}
+		}
+
+		if (i < 0)
+			break;
+	}
+}
+
 void
 warmboot(z80info *z80)
 {
@@ -119,17 +521,35 @@ warmboot(z80info *z80)
 
 	closeall(z80);
 
-	if (silent_exit) {
+	if (z80->silent_exit) {
 		finish(z80);
+		return;
 	}
 
-	/* load CCP and BDOS into memory (max 0x1600 in size) */
-	for (i = 0; i < 0x1600 && i < sizeof cpm_array; i++)
-		SETMEM(CCP + i, cpm_array[i]);
+	/* load CCP and BDOS into memory (max 0x1600 in size) - after the
+	   first time, from a copy of what was loaded (bdos.hex and ccp.hex
+	   had better fit between CCP and CBIOS as well) */
+	if (!z80->syscached)
+	{
+		for (i = 0; i < 0x1600 && i < sizeof cpm_array; i++)
+			SETMEM(CCP + i, cpm_array[i]);
+
+		/* try to load CCP/BDOS from disk, but ignore any errors */
+		loadfile(z80, "bdos.hex");
+		loadfile(z80, "ccp.hex");
 
-	/* try to load CCP/BDOS from disk, but ignore any errors */
-	loadfile(z80, "bdos.hex");
-	loadfile(z80, "ccp.hex");
+		memcpy(z80->sysimage, z80->mem + CCP, sizeof z80->sysimage);
+		z80->syscached = TRUE;
+	}
+#ifdef MEM_BREAK
+	else if (z80->numbrks)
+	{
+		for (i = 0; i < sizeof z80->sysimage; i++)
+			SETMEM(CCP + i, z80->sysimage[i]);
+	}
+#endif
+	else
+		memcpy(z80->mem + CCP, z80->sysimage, sizeof z80->sysimage);
 
 	/* CP/M system reset via "JP 00" - entry into BIOS warm-boot */
 	SETMEM(0x0000, 0xC3);		/* JP CBIOS+3 */
@@ -165,91 +585,53 @@ warmboot(z80info *z80)
 		SETMEM(CBIOS + NENTRY * 3 + i * 5 + 4, 0xC9);
 	}
 
-	/* disc parameter block - a 5Mb ST-506 hard disc */
-	SETMEM(HDPBLOCK, HDSECTORSPERTRACK & 0xFF);/* SPT - sectors per track */
-	SETMEM(HDPBLOCK + 1, HDSECTORSPERTRACK >> 8);
-	SETMEM(HDPBLOCK + 2, 4);	/* BSH - data block shift factor */
-	SETMEM(HDPBLOCK + 3, 15);		/* BLM - data block mask */
-	SETMEM(HDPBLOCK + 4, 0);		/* EXM - extent mask */
-	SETMEM(HDPBLOCK + 5, 2441 & 0xFF);	/* DSM - total drive capacity */
-	SETMEM(HDPBLOCK + 6, 2441 >> 8);
-	SETMEM(HDPBLOCK + 7, 1023 & 0xFF);	/* DRM - total dir entries */
-	SETMEM(HDPBLOCK + 8, 1023 >> 8);
-	SETMEM(HDPBLOCK + 9, 0xFF);	/* AL0 - blocks for directory entries */
-	SETMEM(HDPBLOCK + 10, 0xFF);	/* AL1 */
-	SETMEM(HDPBLOCK + 11, 0x00);	/* CKS - directory check vector */
-	SETMEM(HDPBLOCK + 12, 0x00);
-	SETMEM(HDPBLOCK + 13, RESERVEDTRACKS & 0xFF);/* OFF - reserved tracks */
-	SETMEM(HDPBLOCK + 14, RESERVEDTRACKS >> 8);
-
-	/* disk parameter headers for hard disc */
-	for (i = 0; i < NUMHDISCS; i++)
-	{
-		SETMEM(HDPBASE + DPHSIZE * i, 0x00);	/* XLT */
-		SETMEM(HDPBASE + DPHSIZE * i + 1, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 2, 0x00); /* scratch 1 */
-		SETMEM(HDPBASE + DPHSIZE * i + 3, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 4, 0x00); /* scratch 2 */
-		SETMEM(HDPBASE + DPHSIZE * i + 5, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 6, 0x00); /* scratch 3 */
-		SETMEM(HDPBASE + DPHSIZE * i + 7, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 8, DIRBUF & 0xFF); /* DIRBUF */
-		SETMEM(HDPBASE + DPHSIZE * i + 9, DIRBUF >> 8);
-		SETMEM(HDPBASE + DPHSIZE * i + 10, HDPBLOCK & 0xFF); /* DPB */
-		SETMEM(HDPBASE + DPHSIZE * i + 11, HDPBLOCK >> 8);
-		SETMEM(HDPBASE + DPHSIZE * i + 12, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 13, 0x00);
-		SETMEM(HDPBASE + DPHSIZE * i + 14,
-			(HALVBASE + HALVSIZE * i) & 0xFF);
-		SETMEM(HDPBASE + DPHSIZE * i + 15,
-			(HALVBASE + HALVSIZE * i) >> 8);
-	}
-
-	/* disc parameter block - a single-sided single-density 8" 256k disc */
-	SETMEM(DPBLOCK, SECTORSPERTRACK & 0xFF); /* SPT - sectors per track */
-	SETMEM(DPBLOCK + 1, SECTORSPERTRACK >> 8);
-	SETMEM(DPBLOCK + 2, 3);		/* BSH - data block shift factor */
-	SETMEM(DPBLOCK + 3, 7);			/* BLM - data block mask */
-	SETMEM(DPBLOCK + 4, 0);			/* EXM - extent mask */
-	SETMEM(DPBLOCK + 5, 242);	/* DSM - total capacity of drive */
-	SETMEM(DPBLOCK + 6, 0);
-	SETMEM(DPBLOCK + 7, 63);	/* DRM - total directory entries */
-	SETMEM(DPBLOCK + 8, 0);
-	SETMEM(DPBLOCK + 9, 0xC0);	/* AL0 - blocks for directory entries */
-	SETMEM(DPBLOCK + 10, 0x00);	/* AL1 */
-	SETMEM(DPBLOCK + 11, 0x00);	/* CKS - directory check vector */
-	SETMEM(DPBLOCK + 12, 0x00);
-	SETMEM(DPBLOCK + 13, RESERVEDTRACKS & 0xFF); /* OFF - reserved tracks */
-	SETMEM(DPBLOCK + 14, RESERVEDTRACKS >> 8);
-
-	/* disc parameter headers */
-	for (i = 0; i < NUMDISCS; i++)
-	{
-		SETMEM(DPBASE + DPHSIZE * i, 0x00);	/* XLT */
-		SETMEM(DPBASE + DPHSIZE * i + 1, 0x00);
-		SETMEM(DPBASE + DPHSIZE * i + 2, 0x00); /* scratch 1 */
-		SETMEM(DPBASE + DPHSIZE * i + 3, 0x00);
-		SETMEM(DPBASE + DPHSIZE * i + 4, 0x00); /* scratch 2 */
-		SETMEM(DPBASE + DPHSIZE * i + 5, 0x00);
-		SETMEM(DPBASE + DPHSIZE * i + 6, 0x00); /* scratch 3 */
-		SETMEM(DPBASE + DPHSIZE * i + 7, 0x00);
-		SETMEM(DPBASE + DPHSIZE * i + 8, DIRBUF & 0xFF); /* DIRBUF */
-		SETMEM(DPBASE + DPHSIZE * i + 9, DIRBUF >> 8);
-		SETMEM(DPBASE + DPHSIZE * i + 10, DPBLOCK & 0xFF); /* DPB */
-		SETMEM(DPBASE + DPHSIZE * i + 11, DPBLOCK >> 8);
-#if (CVSIZE == 0)
-		SETMEM(DPBASE + DPHSIZE * i + 12, 0x00);
-		SETMEM(DPBASE + DPHSIZE * i + 13, 0x00);
-#else
-		SETMEM(DPBASE + DPHSIZE * i + 12,
-			(CVBASE + CVSIZE * i) & 0xFF);
-		SETMEM(DPBASE + DPHSIZE * i + 13,
-			(CVBASE + CVSIZE * i) >> 8);
-#endif
-		SETMEM(DPBASE + DPHSIZE * i + 14,
-			(ALVBASE + ALVSIZE * i) & 0xFF);
-		SETMEM(DPBASE + DPHSIZE * i + 15,
-			(ALVBASE + ALVSIZE * i) >> 8);
+	if (z80->dirbuf == 0)
+		setupdisks(z80);
+
+	for (i = 0; i < MAXDISCS; i++)
+	{
+		dgeom *g = &z80->geom[i];
+		word dpb = g->dpb;
+		word dph = g->dph;
+		int blocksize = SECTORSIZE << g->bsh;
+		int dirblks = ((g->drm + 1) * 32 + blocksize - 1) / blocksize;
+		word al = (0xFFFF0000UL >> dirblks) & 0xFFFF;
+		int exm = (g->dsm < 256 ? blocksize / 1024 : blocksize / 2048) - 1;
+
+		/* disc parameter block */
+		SETMEM(dpb, g->spt & 0xFF);	/* SPT - sectors per track */
+		SETMEM(dpb + 1, g->spt >> 8);
+		SETMEM(dpb + 2, g->bsh);	/* BSH - data block shift factor */
+		SETMEM(dpb + 3, (1 << g->bsh) - 1); /* BLM - data block mask */
+		SETMEM(dpb + 4, exm);		/* EXM - extent mask */
+		SETMEM(dpb + 5, g->dsm & 0xFF);	/* DSM - total drive capacity */
+		SETMEM(dpb + 6, g->dsm >> 8);
+		SETMEM(dpb + 7, g->drm & 0xFF);	/* DRM - total dir entries */
+		SETMEM(dpb + 8, g->drm >> 8);
+		SETMEM(dpb + 9, al >> 8);	/* AL0 - blocks for directory entries */
+		SETMEM(dpb + 10, al & 0xFF);	/* AL1 */
+		SETMEM(dpb + 11, 0x00);		/* CKS - directory check vector */
+		SETMEM(dpb + 12, 0x00);
+		SETMEM(dpb + 13, g->off & 0xFF);	/* OFF - reserved tracks */
+		SETMEM(dpb + 14, g->off >> 8);
+
+		/* disc parameter header */
+		SETMEM(dph, 0x00);	/* XLT */
+		SETMEM(dph + 1, 0x00);
+		SETMEM(dph + 2, 0x00); /* scratch 1 */
+		SETMEM(dph + 3, 0x00);
+		SETMEM(dph + 4, 0x00); /* scratch 2 */
+		SETMEM(dph + 5, 0x00);
+		SETMEM(dph + 6, 0x00); /* scratch 3 */
+		SETMEM(dph + 7, 0x00);
+		SETMEM(dph + 8, z80->dirbuf & 0xFF); /* DIRBUF */
+		SETMEM(dph + 9, z80->dirbuf >> 8);
+		SETMEM(dph + 10, dpb & 0xFF); /* DPB */
+		SETMEM(dph + 11, dpb >> 8);
+		SETMEM(dph + 12, 0x00);	/* CSV - no directory check vector */
+		SETMEM(dph + 13, 0x00);
+		SETMEM(dph + 14, g->alv & 0xFF); /* ALV */
+		SETMEM(dph + 15, g->alv >> 8);
 	}
 
 	/* set up the stack for an 8-level RET to do a system reset */
@@ -279,10 +661,22 @@ warmboot(z80info *z80)
 	PC = CCP;
 }
 
+/* Get ready to run a machine whose memory came from a snapshot */
+
+void
+biosresume(z80info *z80)
+{
+	closeall(z80);
+	setupdisks(z80);
+}
+
 static void
 boot(z80info *z80)
 {
 	z80->drive = 0;
+	z80->syscached = FALSE;	/* a cold boot reloads the CCP and BDOS */
+	closeall(z80);
+	setupdisks(z80);
 	warmboot(z80);
 }
 
@@ -301,7 +695,12 @@ consstat(z80info *z80)
 static void
 consin(z80info *z80)
 {
-	input(z80, 0x00, 0x00, &A);
+	/* a snapshot resumes by doing the OUT to call us again, and so
+	   does an embedded machine once it has been given some input */
+	inputwait(z80, PC - 2);
+
+	if (!input(z80, 0x00, 0x00, &A))
+		PC -= 2;
 
 /* What is this for? It messing up Ctrl-S...
 	if (A == CNTL('S'))
@@ -319,25 +718,23 @@ consout(z80info *z80)
 static void
 list(z80info *z80)
 {
-	static FILE *fp = NULL;
-
-	if (fp == NULL)
+	if (z80->listfp == NULL)
 	{
-		fp = fopen("list", "w");
+		z80->listfp = fopen("list", "w");
 
-		if (fp == NULL)
+		if (z80->listfp == NULL)
 			return;
 	}
 
 	/* close up on EOF */
 	if (C == CNTL('D') || C == '\0')
 	{
-		fclose(fp);
-		fp = NULL;
+		fclose(z80->listfp);
+		z80->listfp = NULL;
 		return;
 	}
 
-	putc(C, fp);
+	putc(C, z80->listfp);
 }
 
 /* punch character in C */
@@ -362,6 +759,205 @@ home(z80info *z80)
 	z80->sector = 1;
 }
 
+/* Size of a full drive in bytes */
+
+static long
+drivesize(z80info *z80, int drive)
+{
+	return z80->geom[drive].tracks * z80->geom[drive].spt * SECTORSIZE;
+}
+
+/* Byte offset of the selected sector in its drive, or -1 if it is not on
+   the drive */
+
+static long
+sectoffset(z80info *z80)
+{
+	int drive = z80->drive;
+	long offset = SECTORSIZE * ((long)z80->sector - SECTOROFFSET +
+			z80->geom[drive].spt * ((long)z80->track - TRACKOFFSET));
+
+	if (offset < 0 || offset + SECTORSIZE > drivesize(z80, drive))
+		return -1;
+
+	return offset;
+}
+
+/* Copy a file, for seeding a replay's overlay with the one it was
+   recorded with */
+
+static void
+copyfile(const char *from, const char *to)
+{
+	FILE *in = fopen(from, "rb"), *out;
+	char buf[8192];
+	size_t n;
+
+	if (in == NULL)
+		return;
+
+	if ((out = fopen(to, "wb")) != NULL)
+	{
+		while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+			if (fwrite(buf, 1, n, out) != n)
+				break;
+
+		fclose(out);
+	}
+
+	fclose(in);
+}
+
+/* Open the overlay in dir for a drive, creating it if need be, and map it
+   along with its base image.  A replay's overlays are in its scratch
+   directory, starting as copies of any in overlaydir. */
+
+static void
+openoverlay(z80info *z80, const char *dir, const char *drivestr)
+{
+#ifndef NO_MMAP
+	int drive = z80->drive;
+	struct overlay *o;
+	struct stat statbuf;
+	char path[1024];
+	long bitlen;
+	void *p;
+	FILE *fp;
+
+	o = (struct overlay *)malloc(sizeof *o);
+
+	if (o == NULL)
+	{
+		fprintf(stderr, "seldisc(): Out of memory!\r\n");
+		return;
+	}
+
+	memset(o, 0, sizeof *o);
+
+	/* the base image may be shared by any number of sessions */
+	fp = fopen(drivestr, "rb");
+
+	if (fp != NULL)
+	{
+		if (fstat(fileno(fp), &statbuf) == 0 && statbuf.st_size > 0)
+		{
+			p = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+					fileno(fp), 0);
+
+			if (p == MAP_FAILED)
+			{
+				fprintf(stderr, "seldisc(): Cannot map file '%s'!\r\n",
+						drivestr);
+				fclose(fp);
+				free(o);
+				return;
+			}
+
+			o->base = p;
+			o->baselen = statbuf.st_size;
+		}
+
+		fclose(fp);
+	}
+
+	o->nsect = drivesize(z80, drive) / SECTORSIZE;
+
+	if (o->baselen > o->nsect * SECTORSIZE)
+		o->nsect = (o->baselen + SECTORSIZE - 1) / SECTORSIZE;
+
+	bitlen = ((o->nsect + 7) / 8 + SECTORSIZE - 1) / SECTORSIZE * SECTORSIZE;
+	o->maplen = SECTORSIZE + bitlen + o->nsect * SECTORSIZE;
+
+	fp = NULL;
+
+	if (strlen(dir) + strlen(drivestr) + 2 > sizeof path ||
+			(z80->overlaydir != NULL && strlen(z80->overlaydir) +
+			 strlen(drivestr) + 2 > sizeof path))
+	{
+		fprintf(stderr, "seldisc(): Overlay directory name too long!\r\n");
+		goto fail;
+	}
+
+	mkdir(dir, 0777);
+	sprintf(path, "%s/%s", dir, drivestr);
+
+	if (z80->replay && z80->overlaydir != NULL &&
+			stat(path, &statbuf) != 0)
+	{
+		char seed[1024];
+
+		sprintf(seed, "%s/%s", z80->overlaydir, drivestr);
+		copyfile(seed, path);
+	}
+
+	fp = fopen(path, "rb+");
+
+	if (fp == NULL)
+		fp = fopen(path, "wb+");
+
+	if (fp == NULL || fstat(fileno(fp), &statbuf) != 0 ||
+			(statbuf.st_size < o->maplen &&
+			 ftruncate(fileno(fp), o->maplen) != 0))
+	{
+		fprintf(stderr, "seldisc(): Cannot open overlay '%s'!\r\n", path);
+		goto fail;
+	}
+
+	p = mmap(NULL, o->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fileno(fp), 0);
+
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "seldisc(): Cannot map overlay '%s'!\r\n", path);
+		goto fail;
+	}
+
+	o->map = p;
+	o->bitmap = o->map + SECTORSIZE;
+	o->data = o->bitmap + bitlen;
+
+	if (statbuf.st_size == 0)
+	{
+		memcpy(o->map, OVLMAGIC, OVLMAGICLEN);
+		o->map[OVLMAGICLEN] = o->nsect & 0xFF;
+		o->map[OVLMAGICLEN + 1] = (o->nsect >> 8) & 0xFF;
+		o->map[OVLMAGICLEN + 2] = (o->nsect >> 16) & 0xFF;
+		o->map[OVLMAGICLEN + 3] = (o->nsect >> 24) & 0xFF;
+	}
+	else if (memcmp(o->map, OVLMAGIC, OVLMAGICLEN) != 0 ||
+			o->map[OVLMAGICLEN] != (o->nsect & 0xFF) ||
+			o->map[OVLMAGICLEN + 1] != ((o->nsect >> 8) & 0xFF) ||
+			o->map[OVLMAGICLEN + 2] != ((o->nsect >> 16) & 0xFF) ||
+			o->map[OVLMAGICLEN + 3] != ((o->nsect >> 24) & 0xFF))
+	{
+		fprintf(stderr, "seldisc(): '%s' is not an overlay for '%s'!\r\n",
+				path, drivestr);
+		munmap(o->map, o->maplen);
+		goto fail;
+	}
+
+	z80->overlay[drive] = o;
+	z80->drives[drive] = fp;
+	z80->drivelen[drive] = o->nsect * SECTORSIZE;
+	return;
+
+fail:
+	if (fp != NULL)
+		fclose(fp);
+
+	if (o->base != NULL)
+		munmap(o->base, o->baselen);
+
+	free(o);
+#else
+	(void)z80;
+	(void)dir;
+	(void)drivestr;
+	fprintf(stderr, "seldisc(): Overlays are not supported in this "
+			"build!\r\n");
+#endif
+}
+
 /* Open disk image */
 
 static void
@@ -369,11 +965,22 @@ realizedisk(z80info *z80)
 {
 	int drive = z80->drive;
 	char drivestr[80];
+	char dir[1024];
+
+	drivename(drive, drivestr);
 
-	strcpy(drivestr, drive < NUMHDISCS ? "A-Hdrive" : "A-drive");
-	drivestr[0] += drive; /* set the 1st letter to the drive name */
+	if (z80->drives[drive] == NULL && z80->rec != NULL)
+		recimage(z80, drive, drivestr);
 
-	if (z80->drives[drive] == NULL)
+	/* a replay leaves the images as they are */
+	if (z80->drives[drive] == NULL && z80->replay)
+		openoverlay(z80, replaypath(z80, ".overlay", dir, sizeof dir),
+				drivestr);
+	else if (z80->drives[drive] == NULL && z80->overlaydir != NULL)
+		openoverlay(z80, z80->overlaydir, drivestr);
+
+	if (z80->drives[drive] == NULL && z80->overlaydir == NULL &&
+			!z80->replay)
 	{
 		struct stat statbuf;
 		long secs;
@@ -422,6 +1029,10 @@ realizedisk(z80info *z80)
 
 		z80->drives[drive] = fp;
 		z80->drivelen[drive] = secs * SECTORSIZE;
+
+		if (!z80->nommap)
+			mapdisk(z80, drive, secs * SECTORSIZE > drivesize(z80, drive) ?
+					secs * SECTORSIZE : drivesize(z80, drive));
 	}
 }
 
@@ -439,17 +1050,7 @@ seldisc(z80info *z80)
 	}
 
 	z80->drive = C;
-
-	if (z80->drive < NUMHDISCS)
-	{
-	    L = (HDPBASE + DPHSIZE * C) & 0xFF;
-	    H = (HDPBASE + DPHSIZE * C) >> 8;
-	}
-	else
-	{
-	    L = (DPBASE + DPHSIZE * C) & 0xFF;
-	    H = (DPBASE + DPHSIZE * C) >> 8;
-	}
+	HL = z80->geom[C].dph;
 
 	home(z80);
 }
@@ -457,12 +1058,11 @@ seldisc(z80info *z80)
 static void
 settrack(z80info *z80)
 {
-	int tracks = (z80->drive < NUMHDISCS) ?
-			HDTRACKSPERDISC : TRACKSPERDISC;
+	dgeom *g = &z80->geom[z80->drive];
 
 	z80->track = (B << 8) + C;
 
-	if (z80->track < RESERVEDTRACKS || z80->track >= tracks)
+	if (z80->track < g->off || z80->track >= g->tracks)
 		fprintf(stderr, "settrack(): bogus track %d!\r\n",
 				z80->track);
 }
@@ -470,8 +1070,7 @@ settrack(z80info *z80)
 static void
 setsector(z80info *z80)
 {
-	int sectors = (z80->drive < NUMHDISCS) ?
-			HDSECTORSPERTRACK : SECTORSPERTRACK;
+	long sectors = z80->geom[z80->drive].spt;
 
 	z80->sector = (B << 8) + C;
 
@@ -487,16 +1086,237 @@ setdma(z80info *z80)
 }
 
 
+/* Write back one cached track: only the run of sectors from the first to
+   the last dirty one is written.  If the image has to grow, the gap is
+   filled with formatted (0xE5) sectors a track at a time. */
+
+static int
+writetrack(z80info *z80, struct ctrack *t)
+{
+	int sectors = CACHESECS;
+	long tracksize = (long)sectors * SECTORSIZE;
+	FILE *fp = z80->drives[t->drive];
+	long len = z80->drivelen[t->drive];
+	long offset;
+	int first, last;
+	size_t n;
+
+	for (first = 0; first < sectors && !t->dirtysec[first]; first++)
+		;
+
+	for (last = sectors - 1; last > first && !t->dirtysec[last]; last--)
+		;
+
+	offset = t->track * tracksize + (long)first * SECTORSIZE;
+
+	if (offset > len)
+	{
+		byte buf[CACHESECS * SECTORSIZE];
+
+		memset(buf, 0xE5, sizeof buf);
+
+		IOSTAT(1, 0);
+
+		if (fseek(fp, len, SEEK_SET) != 0)
+			return -1;
+
+		while (len < offset)
+		{
+			long fill = offset - len < (long)sizeof buf ?
+					offset - len : (long)sizeof buf;
+
+			n = fwrite(buf, 1, fill, fp);
+			IOSTAT(1, n);
+
+			if (n != (size_t)fill)
+				return -1;
+
+			len += fill;
+		}
+	}
+
+	IOSTAT(1, 0);
+
+	if (fseek(fp, offset, SEEK_SET) != 0)
+		return -1;
+
+	n = fwrite(t->data + first * SECTORSIZE, SECTORSIZE, last - first + 1,
+			fp);
+	IOSTAT(1, n * SECTORSIZE);
+
+	if (n != (size_t)(last - first + 1))
+		return -1;
+
+	if (offset + (last - first + 1) * SECTORSIZE > len)
+		len = offset + (last - first + 1) * SECTORSIZE;
+
+	z80->drivelen[t->drive] = len;
+	memset(t->dirtysec, 0, sizeof t->dirtysec);
+	t->dirty = FALSE;
+	z80->dcache->writebacks++;
+	return 0;
+}
+
+/* Write back all dirty tracks, in disk order so that a growing image is
+   extended only once.  If drop is set, the cache is emptied as well. */
+
+static void
+flushcache(z80info *z80, int drop)
+{
+	struct dcache *c = z80->dcache;
+	int i;
+
+	if (c == NULL)
+		return;
+
+	for (;;)
+	{
+		struct ctrack *t = NULL;
+
+		for (i = 0; i < NCACHE; i++)
+			if (c->t[i].dirty && (t == NULL ||
+					c->t[i].drive < t->drive ||
+					(c->t[i].drive == t->drive &&
+					 c->t[i].track < t->track)))
+				t = &c->t[i];
+
+		if (t == NULL)
+			break;
+
+		if (writetrack(z80, t) != 0)
+		{
+			fprintf(stderr, "flushcache(): write failure on drive %d "
+					"track %ld!\r\n", t->drive, t->track);
+			memset(t->dirtysec, 0, sizeof t->dirtysec);
+			t->dirty = FALSE;
+		}
+	}
+
+	for (i = 0; i < MAXDISCS; i++)
+		if (z80->drives[i] != NULL)
+			fflush(z80->drives[i]);
+
+	if (drop)
+		for (i = 0; i < NCACHE; i++)
+			c->t[i].drive = -1;
+
+	c->flushed = time(NULL);
+}
+
+/* Return the cache slot holding a track of the current drive, reading it
+   in (and evicting the least recently used track) if necessary.  Returns
+   NULL if the cache could not be allocated. */
+
+static struct ctrack *
+cachetrack(z80info *z80, long track)
+{
+	struct dcache *c = z80->dcache;
+	struct ctrack *t;
+	int drive = z80->drive;
+	long tracksize = (long)CACHESECS * SECTORSIZE;
+	long len = z80->drivelen[drive];
+	long n = 0;
+	int i;
+
+	if (c == NULL)
+	{
+		c = z80->dcache = (struct dcache *)malloc(sizeof *c);
+
+		if (c == NULL)
+			return NULL;
+
+		memset(c, 0, sizeof *c);
+
+		for (i = 0; i < NCACHE; i++)
+			c->t[i].drive = -1;
+
+		c->flushed = time(NULL);
+	}
+
+	t = &c->t[0];
+
+	for (i = 0; i < NCACHE; i++)
+	{
+		if (c->t[i].drive == drive && c->t[i].track == track)
+		{
+			c->hits++;
+			c->t[i].used = ++c->clock;
+			return &c->t[i];
+		}
+
+		if (c->t[i].used < t->used)
+			t = &c->t[i];
+	}
+
+	c->misses++;
+
+	if (t->dirty && writetrack(z80, t) != 0)
+	{
+		fprintf(stderr, "cachetrack(): write failure on drive %d "
+				"track %ld!\r\n", t->drive, t->track);
+		return NULL;
+	}
+
+	t->drive = -1;
+
+	if (track * tracksize < len)
+	{
+		IOSTAT(1, 0);
+
+		if (fseek(z80->drives[drive], track * tracksize, SEEK_SET) != 0)
+			return NULL;
+
+		n = fread(t->data, 1, tracksize, z80->drives[drive]);
+		IOSTAT(1, n);
+	}
+
+	/* sectors past the end of the image read as formatted */
+	memset(t->data + n, 0xE5, tracksize - n);
+
+	t->drive = drive;
+	t->track = track;
+	t->dirty = FALSE;
+	t->used = ++c->clock;
+	return t;
+}
+
+/* Print the track cache statistics */
+
+void
+diskstats(z80info *z80, FILE *fp)
+{
+	struct dcache *c = z80->dcache;
+	unsigned long total;
+
+	if (c == NULL)
+	{
+		fprintf(fp, "    Track cache not in use\n");
+		return;
+	}
+
+	total = c->hits + c->misses;
+	fprintf(fp, "    Track cache: %lu hits, %lu misses (%lu%% hit rate), "
+			"%lu writebacks\n", c->hits, c->misses,
+			total ? c->hits * 100 / total : 0UL, c->writebacks);
+}
+
 static void
 rdsector(z80info *z80)
 {
 	int n;
 	int drive = z80->drive;
-	int sectors = (drive < NUMHDISCS) ? HDSECTORSPERTRACK : SECTORSPERTRACK;
-	long offset = SECTORSIZE * ((long)z80->sector - SECTOROFFSET +
-			sectors * ((long)z80->track - TRACKOFFSET));
+	long offset = sectoffset(z80);
 	FILE *fp;
 	long len;
+
+	if (offset < 0)
+	{
+		fprintf(stderr, "rdsector(): track %d sector %d is off the drive!\r\n",
+			z80->track, z80->sector);
+		A = 1;
+		return;
+	}
+
 	realizedisk(z80);
 	fp = z80->drives[drive];
 	len = z80->drivelen[drive];
@@ -509,6 +1329,37 @@ rdsector(z80info *z80)
 		return;
 	}
 
+	if (z80->overlay[drive] != NULL)
+	{
+		struct overlay *o = z80->overlay[drive];
+		long n = offset / SECTORSIZE;
+
+		if (n < o->nsect && (o->bitmap[n >> 3] & (1 << (n & 7))))
+			memcpy(&(z80->mem[z80->dma]), o->data + offset, SECTORSIZE);
+		else if (offset + SECTORSIZE <= o->baselen)
+			memcpy(&(z80->mem[z80->dma]), o->base + offset, SECTORSIZE);
+		else
+			memset(&(z80->mem[z80->dma]), 0xE5, SECTORSIZE);
+
+		A = 0;
+		return;
+	}
+
+	/* the cache may hold sectors past the end not yet written back */
+	if (z80->drivemap[drive] == NULL)
+	{
+		long tracksize = (long)CACHESECS * SECTORSIZE;
+		struct ctrack *t = cachetrack(z80, offset / tracksize);
+
+		if (t != NULL)
+		{
+			memcpy(&(z80->mem[z80->dma]),
+				t->data + offset % tracksize, SECTORSIZE);
+			A = 0;
+			return;
+		}
+	}
+
 	if (len && offset >= len)
 	{
 	    memset(&(z80->mem[z80->dma]), 0xE5, SECTORSIZE);
@@ -516,6 +1367,16 @@ rdsector(z80info *z80)
 	    return;
 	}
 
+	if (z80->drivemap[drive] != NULL)
+	{
+		memcpy(&(z80->mem[z80->dma]), z80->drivemap[drive] + offset,
+			SECTORSIZE);
+		A = 0;
+		return;
+	}
+
+	IOSTAT(1, 0);
+
 	if (fseek(fp, offset, SEEK_SET) != 0)
 	{
 		fprintf(stderr, "rdsector(): fseek failure offset=0x%lX!\r\n",
@@ -525,6 +1386,7 @@ rdsector(z80info *z80)
 	}
 
 	n = fread(&(z80->mem[z80->dma]), 1, SECTORSIZE, fp);
+	IOSTAT(1, n);
 
 	if (n != SECTORSIZE)
 	{
@@ -539,12 +1401,20 @@ rdsector(z80info *z80)
 static void
 wrsector(z80info *z80)
 {
+	size_t n;
 	int drive = z80->drive;
-	int sectors = (drive < NUMHDISCS) ? HDSECTORSPERTRACK : SECTORSPERTRACK;
-	long offset = SECTORSIZE * ((long)z80->sector - SECTOROFFSET +
-			sectors * ((long)z80->track - TRACKOFFSET));
+	long offset = sectoffset(z80);
 	FILE *fp;
 	long len;
+
+	if (offset < 0)
+	{
+		fprintf(stderr, "wrsector(): track %d sector %d is off the drive!\r\n",
+			z80->track, z80->sector);
+		A = 1;
+		return;
+	}
+
 	realizedisk(z80);
 	fp = z80->drives[drive];
 	len = z80->drivelen[drive];
@@ -557,10 +1427,84 @@ wrsector(z80info *z80)
 		return;
 	}
 
+	if (z80->overlay[drive] != NULL)
+	{
+		struct overlay *o = z80->overlay[drive];
+		long n = offset / SECTORSIZE;
+
+		if (n >= o->nsect)
+		{
+			fprintf(stderr, "wrsector(): offset 0x%lX past end of "
+					"overlay!\r\n", offset);
+			A = 1;
+			return;
+		}
+
+		memcpy(o->data + offset, &(z80->mem[z80->dma]), SECTORSIZE);
+		o->bitmap[n >> 3] |= 1 << (n & 7);
+		A = 0;
+		return;
+	}
+
+#ifndef NO_MMAP
+	if (z80->drivemap[drive] != NULL &&
+			offset + SECTORSIZE > z80->drivemaplen[drive])
+		mapdisk(z80, drive, offset + SECTORSIZE);
+
+	if (z80->drivemap[drive] != NULL)
+	{
+		if (offset + SECTORSIZE > len)
+		{
+			IOSTAT(1, 0);
+
+			if (ftruncate(fileno(fp), offset + SECTORSIZE) != 0)
+			{
+				fprintf(stderr, "wrsector(): write failure!\r\n");
+				A = 1;
+				return;
+			}
+
+			/* sectors skipped over read back as formatted */
+			if (offset > len)
+				memset(z80->drivemap[drive] + len, 0xE5,
+					offset - len);
+
+			z80->drivelen[drive] = offset + SECTORSIZE;
+		}
+
+		memcpy(z80->drivemap[drive] + offset, &(z80->mem[z80->dma]),
+			SECTORSIZE);
+		A = 0;
+		return;
+	}
+#endif
+
+	if (z80->drivemap[drive] == NULL)
+	{
+		long tracksize = (long)CACHESECS * SECTORSIZE;
+		struct ctrack *t = cachetrack(z80, offset / tracksize);
+
+		if (t != NULL)
+		{
+			memcpy(t->data + offset % tracksize,
+				&(z80->mem[z80->dma]), SECTORSIZE);
+			t->dirtysec[offset % tracksize / SECTORSIZE] = 1;
+			t->dirty = TRUE;
+			A = 0;
+
+			if (time(NULL) - z80->dcache->flushed >= FLUSHSECS)
+				flushcache(z80, FALSE);
+
+			return;
+		}
+	}
+
 	if (len && offset > len)
 	{
 		char buf[SECTORSIZE];
 
+		IOSTAT(1, 0);
+
 		if (fseek(fp, len, SEEK_SET) != 0)
 		{
 			fprintf(stderr, "wrsector(): fseek failure offset=0x%lX!\r\n",
@@ -573,7 +1517,10 @@ wrsector(z80info *z80)
 
 		while (offset > len)
 		{
-			if (fwrite(buf, 1, SECTORSIZE, fp) != SECTORSIZE)
+			n = fwrite(buf, 1, SECTORSIZE, fp);
+			IOSTAT(1, n);
+
+			if (n != SECTORSIZE)
 			{
 				fprintf(stderr, "wrsector(): write failure!\r\n");
 				A = 1;
@@ -585,6 +1532,8 @@ wrsector(z80info *z80)
 		}
 	}
 
+	IOSTAT(1, 0);
+
 	if (fseek(fp, offset, SEEK_SET) != 0)
 	{
 		fprintf(stderr, "wrsector(): fseek failure offset=0x%lX!\r\n",
@@ -593,7 +1542,10 @@ wrsector(z80info *z80)
 		return;
 	}
 
-	if (fwrite(&(z80->mem[z80->dma]), 1, SECTORSIZE, fp) != SECTORSIZE)
+	n = fwrite(&(z80->mem[z80->dma]), 1, SECTORSIZE, fp);
+	IOSTAT(1, n);
+
+	if (n != SECTORSIZE)
 	{
 		fprintf(stderr, "wrsector(): write failure!\r\n");
 		A = 1;
@@ -610,21 +1562,22 @@ wrsector(z80info *z80)
 static void
 secttran(z80info *z80)
 {
-	if (z80->drive < NUMHDISCS)
+	dgeom *g = &z80->geom[z80->drive];
+
+	if (BC >= g->spt)
 	{
-		/* simple sector translation for hard disc */
+		fprintf(stderr, "secttran(): bogus sector %d!\r\n", BC);
 		HL = BC + 1;
-
-		if (BC >= HDSECTORSPERTRACK)
-			fprintf(stderr, "secttran(): bogus sector %d!\r\n", BC);
 	}
-	else
+	else if (g->skew)
 	{
 		/* we do not need to use DE to find our translation table */
 		HL = sectorxlat[BC];
-
-		if (BC >= SECTORSPERTRACK)
-			fprintf(stderr, "secttran(): bogus sector %d!\r\n", BC);
+	}
+	else
+	{
+		/* simple sector translation for hard disc */
+		HL = BC + 1;
 	}
 }
 
@@ -662,34 +1615,32 @@ int2addr(unsigned char *addr, int val)
 
 /* Allocate file pointers - index is stored in DE */
 
-#define CPM_FILES 4
-
-FILE *cpm_file[CPM_FILES];
-
-int cpm_file_alloc(FILE *f)
+static int cpm_file_alloc(z80info *z80, FILE *f)
 {
 	int x;
 	for (x = 0; x != CPM_FILES; ++x)
-		if (!cpm_file[x]) {
-			cpm_file[x] = f;
+		if (!z80->cpm_file[x]) {
+			z80->cpm_file[x] = f;
 			return x;
 		}
 	return -1;
 }
 
-FILE *cpm_file_get(int idx)
+static FILE *cpm_file_get(z80info *z80, int idx)
 {
-	if (idx < 0 || idx > CPM_FILES)
+	if (idx < 0 || idx >= CPM_FILES)
 		return 0;
 	else
-		return cpm_file[idx];
+		return z80->cpm_file[idx];
 }
 
-int cpm_file_free(int x)
+static int cpm_file_free(z80info *z80, int x)
 {
-	if (x >= 0 && x < CPM_FILES && cpm_file[x]) {
-		int rtn = fclose(cpm_file[x]);
-		cpm_file[x] = 0;
+	if (x >= 0 && x < CPM_FILES && z80->cpm_file[x]) {
+		int rtn;
+		IOSTAT(1, 0);
+		rtn = fclose(z80->cpm_file[x]);
+		z80->cpm_file[x] = 0;
 		return rtn;
 	} else {
 		return -1;
@@ -703,7 +1654,8 @@ int cpm_file_free(int x)
 static void
 openunix(z80info *z80)
 {
-	char filename[20], *fp;
+	char filename[20], path[1024], *fp;
+	const char *host;
 	byte *cp;
 	int i;
 	FILE *fd;
@@ -728,12 +1680,26 @@ openunix(z80info *z80)
 	*fp = 0;
 	A = 0xFF;
 
+	if (z80->replay)
+		recfile(z80, NULL);
+
 	/* if file is not readable, try opening it read-only */
-	if ((fd = fopen(filename, "rb+")) == NULL)
-		if ((fd = fopen(filename, "rb")) == NULL)
+	IOSTAT(1, 0);
+
+	host = replaypath(z80, filename, path, sizeof path);
+
+	if ((fd = fopen(host, "rb+")) == NULL)
+	{
+		IOSTAT(1, 0);
+
+		if ((fd = fopen(host, "rb")) == NULL)
 			return;
+	}
 
-	fd_no = cpm_file_alloc(fd);
+	if (z80->rec != NULL && !z80->replay)
+		recfile(z80, filename);
+
+	fd_no = cpm_file_alloc(z80, fd);
 	if (fd_no != -1)
 		A = 0;
 
@@ -750,7 +1716,7 @@ openunix(z80info *z80)
 static void
 createunix(z80info *z80)
 {
-	char filename[20], *fp;
+	char filename[20], path[1024], *fp;
 	byte *cp;
 	int i;
 	FILE *fd;
@@ -775,10 +1741,12 @@ createunix(z80info *z80)
 	*fp = 0;
 	A = 0xFF;
 
-	if ((fd = fopen(filename, "wb+")) == NULL)
+	IOSTAT(1, 0);
+
+	if ((fd = fopen(replaypath(z80, filename, path, sizeof path), "wb+")) == NULL)
 		return;
 
-	fd_no = cpm_file_alloc(fd);
+	fd_no = cpm_file_alloc(z80, fd);
 	if (fd_no != -1)
 		A = 0;
 
@@ -801,7 +1769,7 @@ rdunix(z80info *z80)
 	int fd_no;
   
 	cp = &(z80->mem[z80->dma]);
-	fd = cpm_file_get((fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
+	fd = cpm_file_get(z80, (fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
 	blk = addr2int(&z80->mem[DE + BLKOFFSET]);
 	size = addr2int(&z80->mem[DE + SZOFFSET]);
 
@@ -810,11 +1778,14 @@ rdunix(z80info *z80)
 	if (!fd)
 		return;
 
+	IOSTAT(2, 0);
+
 	if (fseek(fd, (long)blk << 7, SEEK_SET) != 0)
 		return;
 
 	i = fread(cp, 1, SECTORSIZE, fd);
 	size = i;
+	IOSTAT(0, i);
 
 	if (i == 0)
 		return;
@@ -844,16 +1815,18 @@ wrunix(z80info *z80)
 	int fd_no;
 
 	cp = &(z80->mem[z80->dma]);
-	fd = cpm_file_get((fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
+	fd = cpm_file_get(z80, (fd_no = addr2int(&z80->mem[DE + FDOFFSET])));
 	blk = addr2int(&z80->mem[DE + BLKOFFSET]);
 	size = addr2int(&z80->mem[DE + SZOFFSET]);
 
 	A = 0xFF;
+	IOSTAT(2, 0);
 
 	if (fseek(fd, (long)blk << 7, SEEK_SET) != 0)
 		return;
 
 	i = fwrite(cp, 1, size = SECTORSIZE, fd);
+	IOSTAT(0, i);
 
 	if (i != SECTORSIZE)
 		return;
@@ -878,21 +1851,51 @@ closeunix(z80info *z80)
 	fd_no = addr2int(&z80->mem[DE + FDOFFSET]);
 	A = 0xFF;
 
-	if (cpm_file_free(fd_no))
+	if (cpm_file_free(z80, fd_no))
 		return;
 
 	A = 0;
 }
 
-/* clean up and quit - never returns */
+/* clean up and quit - never returns, unless the machine is embedded:
+   then it is only marked as finished, for its owner to destroy */
 void
 finish(z80info *z80)
 {
-	(void)z80;
+	if (z80->rec != NULL && !z80->replay)
+		recordend(z80);
+
+	closeall(z80);
+
+	if (z80->con.embedded)
+	{
+		z80->finished = TRUE;
+		return;
+	}
+
 	resetterm();
 	exit(0);
 }
 
+/* Close everything a machine has open, for destroy_z80info() */
+
+void
+biosclose(z80info *z80)
+{
+	int i;
+
+	closeall(z80);
+
+	for (i = 0; i < CPM_FILES; i++)
+		cpm_file_free(z80, i);
+
+	if (z80->listfp != NULL)
+	{
+		fclose(z80->listfp);
+		z80->listfp = NULL;
+	}
+}
+
 /*  Get/set the time - although only the get-time part is implemented.
     If C==0, then get the time, else of C==0xFF, then set the time.
     HL returns a pointer to our time table:
@@ -906,7 +1909,8 @@ static void
 dotime(z80info *z80)
 {
     time_t now;
-    struct tm *t;
+    struct tm tm, *t = &tm;
+    byte tb[5];
     word days;
     int y;
 
@@ -914,7 +1918,7 @@ dotime(z80info *z80)
 		return;
 
     time(&now);
-    t = localtime(&now);
+    localtime_r(&now, &tm);
 
     /* days since Jan 1, 1978 + one since tm_yday starts at zero */
     days = (t->tm_year - 78) * 365 + t->tm_yday + 1;
@@ -924,17 +1928,42 @@ dotime(z80info *z80)
 		if (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0))
 			days++;
 
-    HL = TIMEBUF;
-    SETMEM(HL + 0, days & 0xFF);
-    SETMEM(HL + 1, days >> 8);
-    SETMEM(HL + 2, ((t->tm_hour / 10) << 4) + (t->tm_hour % 10));
-    SETMEM(HL + 3, ((t->tm_min / 10) << 4) + (t->tm_min % 10));
-    SETMEM(HL + 4, ((t->tm_sec / 10) << 4) + (t->tm_sec % 10));
+    tb[0] = days & 0xFF;
+    tb[1] = days >> 8;
+    tb[2] = ((t->tm_hour / 10) << 4) + (t->tm_hour % 10);
+    tb[3] = ((t->tm_min / 10) << 4) + (t->tm_min % 10);
+    tb[4] = ((t->tm_sec / 10) << 4) + (t->tm_sec % 10);
+
+    if (z80->rec != NULL)
+		rectime(z80, tb);
+
+    HL = z80->timebuf;
+
+    for (y = 0; y < 5; y++)
+		SETMEM(HL + y, tb[y]);
+}
+
+/* The names of the BIOS calls, for traces and reports */
+
+const char *
+bios_decode(unsigned int fn)
+{
+	static const char *names[] =
+	{
+		"boot", "warmboot", "consstat", "consin", "consout", "list",
+		"punch", "reader", "home", "seldisc", "settrack", "setsector",
+		"setdma", "rdsector", "wrsector", "liststat", "secttran",
+		"openunix", "createunix", "rdunix", "wrunix", "closeunix",
+		"finish", "dotime"
+	};
+
+	return fn < sizeof names / sizeof *names ? names[fn] : "illegal";
 }
 
 void
 bios(z80info *z80, unsigned int fn)
 {
+	/* in the order of bios_decode()'s names */
 	static void (*bioscall[])(z80info *z80) =
 	{
 		boot,		/* 0 */
@@ -0,0 +1,169 @@
+/*-----------------------------------------------------------------------*\
+ |  callstats.c  --  make the BDOS and BIOS calls for the emulator,     |
+ |  counting them, the host time they take and the host I/O they do    |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Add a call that took "secs" and did the host I/O counted since
+   "calls" and "bytes" */
+
+static void
+account(z80info *z80, callstat *s, double secs, unsigned long calls,
+		unsigned long bytes)
+{
+	unsigned long ns = secs > 0 ? (unsigned long)(secs * 1e9) : 0;
+	int b = 0;
+
+	while (ns > 1 && b < CALLHIST - 1)
+	{
+		ns >>= 1;
+		b++;
+	}
+
+	s->count++;
+	s->secs += secs;
+	s->hist[b]++;
+
+	if (secs > s->max)
+		s->max = secs;
+	s->iocalls += z80->iocalls - calls;
+	s->iobytes += z80->iobytes - bytes;
+}
+
+/* Make the BDOS call the program has jumped to BDOS_HOOK for.  A call
+   that stops to wait for input is made again later, and only counted
+   then. */
+
+void
+dobdos(z80info *z80)
+{
+	int fn = C;
+	word site = z80->mem[SP] | (z80->mem[(word)(SP + 1)] << 8);
+	unsigned long calls = z80->iocalls, bytes = z80->iobytes;
+	double start = now(), secs;
+
+	check_BDOS_hook(z80);
+
+	if (z80->blocked)
+		return;
+
+	secs = now() - start;
+	account(z80, &z80->bdosstat[fn], secs, calls, bytes);
+
+	if (z80->prof != NULL)
+		profcall(z80, CALL_BDOS, fn, site, secs);
+}
+
+/* Make the BIOS call the BIOS has asked for */
+
+void
+dobios(z80info *z80, unsigned fn)
+{
+	word site = z80->mem[SP] | (z80->mem[(word)(SP + 1)] << 8);
+	unsigned long calls = z80->iocalls, bytes = z80->iobytes;
+	double start = now(), secs;
+
+	bios(z80, fn);
+
+	if (z80->blocked || fn >= BIOSCALLS)
+		return;
+
+	secs = now() - start;
+	account(z80, &z80->biosstat[fn], secs, calls, bytes);
+
+	if (z80->prof != NULL)
+		profcall(z80, CALL_BIOS, fn, site, secs);
+}
+
+/* The time below which a share of the calls took, from the histogram:
+   only good to a factor of two */
+
+static double
+percentile(const callstat *s, double share)
+{
+	unsigned long want = (unsigned long)(s->count * share + 0.5), n = 0;
+	int b;
+
+	for (b = 0; b < CALLHIST; b++)
+		if ((n += s->hist[b]) >= want && n > 0)
+			break;
+
+	return 2.0 * (1UL << (b < CALLHIST ? b : CALLHIST - 1)) / 1e3;
+}
+
+static void
+statline(FILE *fp, const char *kind, int fn, const char *name,
+		const callstat *s)
+{
+	char call[40];
+
+	sprintf(call, "%s %d %.18s", kind, fn, name);
+	fprintf(fp, "%-26s %9lu %9.1f %8.1f %8.0f %8.0f %10lu %8lu\n", call,
+			s->count, s->secs * 1e3, percentile(s, 0.5),
+			percentile(s, 0.99), s->max * 1e6, s->iobytes,
+			s->iocalls);
+}
+
+/* Print the calls made so far */
+
+void
+callstats(z80info *z80, FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "%-26s %9s %9s %8s %8s %8s %10s %8s\n", "call", "count",
+			"total ms", "p50 us", "p99 us", "max us", "bytes", "host io");
+
+	for (i = 0; i < BDOSCALLS; i++)
+		if (z80->bdosstat[i].count)
+			statline(fp, "BDOS", i, bdos_decode(i), &z80->bdosstat[i]);
+
+	for (i = 0; i < BIOSCALLS; i++)
+		if (z80->biosstat[i].count)
+			statline(fp, "BIOS", i, bios_decode(i), &z80->biosstat[i]);
+}
+
+/* Save them in file, or print them on stderr if it is NULL */
+
+int
+callstatsave(z80info *z80, const char *file)
+{
+	FILE *fp;
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "\r\n");
+		callstats(z80, stderr);
+		return 0;
+	}
+
+	if ((fp = fopen(file, "w")) == NULL)
+	{
+		fprintf(stderr, "\r\nCannot create '%s'\r\n", file);
+		return -1;
+	}
+
+	callstats(z80, fp);
+
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "\r\nCannot write '%s'\r\n", file);
+		return -1;
+	}
+
+	return 0;
+}
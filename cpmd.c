@@ -0,0 +1,667 @@
+/*-----------------------------------------------------------------------*\
+ |  cpmd.c  --  serve any number of CP/M sessions from one process:     |
+ |  each connection to a Unix domain socket gets a machine of its own,  |
+ |  and a fixed pool of worker threads runs the machines that can run.  |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "z80cpm.h"
+
+#define FALSE	0
+#define TRUE	1
+
+/* A session is only ever in one place: on a worker's run queue, being
+   run by a worker, or parked.  Parked sessions cost nothing until the
+   I/O thread (main()) has input for them, or their output has been
+   written, or (for one that was only polling for input) a timer runs out.
+   Each worker has its own queue of sessions and takes the oldest from it;
+   a worker with nothing to do steals the newest from another. */
+
+#define S_QUEUED	0	/* on a run queue */
+#define S_RUNNING	1	/* being run by a worker */
+#define S_PARKED	2	/* waiting for input */
+#define S_IDLE		3	/* polling for input: run again at "wake" too */
+#define S_FULL		4	/* waiting for its output to be written */
+#define S_DEAD		5	/* finished or hung up: to be freed */
+
+#define SLICE		100000L	/* instructions per turn */
+#define IDLEWAKE	50	/* ms an idle session stays parked */
+#define OUTMAX		65536L	/* output held for a client before parking */
+
+typedef struct session
+{
+	pthread_mutex_t lock;	/* for everything but the machine */
+	int fd;
+	int state;
+	int hangup;		/* the client has gone */
+	long wake;		/* when an S_IDLE session is run again */
+	z80cpm *m;		/* only touched by whoever made it S_RUNNING */
+	unsigned char *in;	/* input not given to the machine yet */
+	long inlen, insize;
+	unsigned char *out;	/* output not written to the client yet */
+	long outpos, outlen, outsize;
+	char overlay[256];
+} session;
+
+typedef struct deque
+{
+	pthread_mutex_t lock;
+	session **s;		/* ring of maxsessions entries */
+	long top, bottom;	/* the owner takes from the top */
+} deque;
+
+static int nworkers = 4;
+static long slice = SLICE;
+static int maxsessions = 1024;
+static const char *overlaydir = NULL;
+static const char *sockpath = NULL;
+static z80cpm_options opt;
+
+static deque *deques;
+static pthread_mutex_t worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workcv = PTHREAD_COND_INITIALIZER;
+static long nqueued = 0;	/* sessions on all the queues */
+static int wakefd[2];		/* workers wake the I/O thread with this */
+
+
+static long
+msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* Make room for need bytes in a buffer */
+
+static int
+grow(unsigned char **buf, long *size, long need)
+{
+	long n = *size ? *size : 1024;
+	unsigned char *p;
+
+	if (need <= *size)
+		return 0;
+
+	while (n < need)
+		n *= 2;
+
+	if ((p = (unsigned char *)realloc(*buf, n)) == NULL)
+		return -1;
+
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+static void
+wakeio(void)
+{
+	char c = 0;
+
+	if (write(wakefd[1], &c, 1) < 0 && errno != EAGAIN)
+		perror("cpmd: wake");
+}
+
+
+/* Put a session on worker w's run queue - its state is already S_QUEUED */
+
+static void
+push(int w, session *s)
+{
+	deque *d = &deques[w];
+
+	pthread_mutex_lock(&d->lock);
+	d->s[d->bottom++ % maxsessions] = s;
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_mutex_lock(&worklock);
+	nqueued++;
+	pthread_cond_signal(&workcv);
+	pthread_mutex_unlock(&worklock);
+}
+
+/* Take the oldest session on worker w's queue, or else steal the newest
+   from the others */
+
+static session *
+take(int w)
+{
+	session *s = NULL;
+	int i;
+
+	for (i = 0; i < nworkers && s == NULL; i++)
+	{
+		deque *d = &deques[(w + i) % nworkers];
+
+		pthread_mutex_lock(&d->lock);
+
+		if (d->top != d->bottom)
+		{
+			if (i == 0)
+				s = d->s[d->top++ % maxsessions];
+			else
+				s = d->s[--d->bottom % maxsessions];
+		}
+
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	if (s != NULL)
+	{
+		pthread_mutex_lock(&worklock);
+		nqueued--;
+		pthread_mutex_unlock(&worklock);
+	}
+
+	return s;
+}
+
+/* Give a session a slice of worker w's time */
+
+static void
+runsession(int w, session *s)
+{
+	const unsigned char *p;
+	long n;
+	int st, requeue = FALSE;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->hangup)
+	{
+		s->state = S_DEAD;
+		pthread_mutex_unlock(&s->lock);
+		wakeio();
+		return;
+	}
+
+	s->state = S_RUNNING;
+
+	if (s->inlen > 0 && z80cpm_feed(s->m, s->in, s->inlen) == 0)
+		s->inlen = 0;
+
+	pthread_mutex_unlock(&s->lock);
+
+	st = z80cpm_run(s->m, slice);
+	n = z80cpm_drain(s->m, &p);
+
+	pthread_mutex_lock(&s->lock);
+
+	if (n > 0)
+	{
+		if (grow(&s->out, &s->outsize, s->outlen + n) != 0)
+			s->hangup = TRUE;
+		else
+		{
+			memcpy(s->out + s->outlen, p, n);
+			s->outlen += n;
+		}
+	}
+
+	if (st == Z80CPM_FINISHED || s->hangup)
+		s->state = S_DEAD;
+	else if (s->outlen - s->outpos > OUTMAX)
+		s->state = S_FULL;
+	else if (st == Z80CPM_RUNNING || s->inlen > 0)
+		requeue = TRUE;
+	else if (st == Z80CPM_IDLE)
+	{
+		s->state = S_IDLE;
+		s->wake = msnow() + IDLEWAKE;
+	}
+	else
+		s->state = S_PARKED;
+
+	if (requeue)
+		s->state = S_QUEUED;
+
+	pthread_mutex_unlock(&s->lock);
+
+	if (requeue)
+		push(w, s);
+
+	if (n > 0 || !requeue)
+		wakeio();
+}
+
+static void *
+worker(void *arg)
+{
+	int w = (int)(long)arg;
+	session *s;
+
+	for (;;)
+	{
+		if ((s = take(w)) != NULL)
+		{
+			runsession(w, s);
+			continue;
+		}
+
+		pthread_mutex_lock(&worklock);
+
+		while (nqueued <= 0)
+			pthread_cond_wait(&workcv, &worklock);
+
+		pthread_mutex_unlock(&worklock);
+	}
+
+	return NULL;
+}
+
+
+/* Start a session for a new connection */
+
+static session *
+newsession(int fd, long id)
+{
+	session *s = (session *)calloc(1, sizeof *s);
+	z80cpm_options o = opt;
+
+	if (s == NULL)
+		return NULL;
+
+	/* sessions can share disk images, but not what they write */
+	if (overlaydir != NULL)
+	{
+		sprintf(s->overlay, "%.200s/%ld", overlaydir, id);
+		o.overlaydir = s->overlay;
+	}
+
+	if ((s->m = z80cpm_create(&o)) == NULL)
+	{
+		free(s);
+		return NULL;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	s->fd = fd;
+	s->state = S_QUEUED;
+	return s;
+}
+
+static void
+freesession(session *s)
+{
+	close(s->fd);
+	z80cpm_destroy(s->m);
+	pthread_mutex_destroy(&s->lock);
+	free(s->in);
+	free(s->out);
+	free(s);
+}
+
+/* Read what a client has sent, waking its session if it is parked */
+
+static int
+readsession(session *s)
+{
+	unsigned char buf[4096];
+	long n = read(s->fd, buf, sizeof buf);
+	int wake = FALSE;
+
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return FALSE;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (n <= 0 || grow(&s->in, &s->insize, s->inlen + n) != 0)
+	{
+		s->hangup = TRUE;
+
+		if (s->state != S_QUEUED && s->state != S_RUNNING)
+			s->state = S_DEAD;
+	}
+	else
+	{
+		memcpy(s->in + s->inlen, buf, n);
+		s->inlen += n;
+		wake = s->state == S_PARKED || s->state == S_IDLE;
+	}
+
+	if (wake)
+		s->state = S_QUEUED;
+
+	pthread_mutex_unlock(&s->lock);
+	return wake;
+}
+
+/* Write what a session has output, waking it if it was waiting for that */
+
+static int
+writesession(session *s)
+{
+	long n;
+	int wake = FALSE;
+
+	pthread_mutex_lock(&s->lock);
+	n = write(s->fd, s->out + s->outpos, s->outlen - s->outpos);
+
+	if (n > 0)
+		s->outpos += n;
+	else if (n < 0 && errno != EAGAIN && errno != EINTR)
+	{
+		s->hangup = TRUE;
+		s->outpos = s->outlen;
+
+		if (s->state != S_QUEUED && s->state != S_RUNNING)
+			s->state = S_DEAD;
+	}
+
+	if (s->outpos == s->outlen)
+		s->outpos = s->outlen = 0;
+
+	if (s->state == S_FULL && s->outlen - s->outpos <= OUTMAX / 2)
+	{
+		s->state = S_QUEUED;
+		wake = TRUE;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return wake;
+}
+
+static int
+listenon(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof addr.sun_path)
+	{
+		fprintf(stderr, "cpmd: socket name '%s' is too long\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			bind(fd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+			listen(fd, 64) != 0)
+	{
+		perror(path);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void
+quit(int sig)
+{
+	unlink(sockpath);
+	_exit(sig == SIGTERM ? 0 : 2);
+}
+
+/* The I/O thread: accept connections, move data between the clients and
+   their sessions, and free the sessions that are done */
+
+static void
+serve(int lfd)
+{
+	session **sess = (session **)calloc(maxsessions, sizeof *sess);
+	struct pollfd *pfd = (struct pollfd *)calloc(maxsessions + 2,
+			sizeof *pfd);
+	int nsess = 0, npoll, rr = 0, i;
+	long id = 0;
+
+	if (sess == NULL || pfd == NULL)
+	{
+		fprintf(stderr, "cpmd: out of memory\n");
+		return;
+	}
+
+	for (;;)
+	{
+		long now = msnow();
+		int timeout = -1;
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = wakefd[0];
+		pfd[1].events = POLLIN;
+
+		for (i = 0; i < nsess; )
+		{
+			session *s = sess[i];
+			int wake = FALSE, events;
+
+			pthread_mutex_lock(&s->lock);
+
+			if (s->state == S_DEAD && s->outpos == s->outlen)
+			{
+				pthread_mutex_unlock(&s->lock);
+				freesession(s);
+				sess[i] = sess[--nsess];
+				continue;
+			}
+
+			if (s->state == S_IDLE && s->wake <= now)
+			{
+				s->state = S_QUEUED;
+				wake = TRUE;
+			}
+			else if (s->state == S_IDLE &&
+					(timeout < 0 || s->wake - now < timeout))
+				timeout = s->wake - now;
+
+			events = (s->hangup || s->state == S_DEAD) ? 0 : POLLIN;
+
+			if (s->outpos != s->outlen)
+				events |= POLLOUT;
+
+			pthread_mutex_unlock(&s->lock);
+
+			if (wake)
+				push(rr++ % nworkers, s);
+
+			pfd[i + 2].fd = s->fd;
+			pfd[i + 2].events = events;
+			pfd[i + 2].revents = 0;
+			i++;
+		}
+
+		npoll = nsess;
+
+		if (poll(pfd, npoll + 2, timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("cpmd: poll");
+			return;
+		}
+
+		if (pfd[1].revents & POLLIN)
+		{
+			char buf[256];
+
+			while (read(wakefd[0], buf, sizeof buf) > 0)
+				;
+		}
+
+		for (i = 0; i < npoll; i++)
+		{
+			session *s = sess[i];
+			short r = pfd[i + 2].revents;
+
+			if ((r & (POLLIN | POLLHUP | POLLERR)) &&
+					pfd[i + 2].events & POLLIN && readsession(s))
+				push(rr++ % nworkers, s);
+
+			if ((r & POLLOUT) && writesession(s))
+				push(rr++ % nworkers, s);
+		}
+
+		if (pfd[0].revents & POLLIN)
+		{
+			int fd;
+
+			while ((fd = accept(lfd, NULL, NULL)) >= 0)
+			{
+				static const char full[] = "cpmd: too many sessions\r\n";
+				session *s = NULL;
+
+				if (nsess == maxsessions)
+				{
+					if (write(fd, full, sizeof full - 1) < 0)
+						perror("cpmd: write");
+				}
+				else if ((s = newsession(fd, id++)) == NULL)
+					fprintf(stderr, "cpmd: cannot start a session\n");
+
+				if (s == NULL)
+				{
+					close(fd);
+					continue;
+				}
+
+				sess[nsess++] = s;
+				push(rr++ % nworkers, s);
+			}
+		}
+	}
+}
+
+int
+main(int argc, const char *argv[])
+{
+	pthread_t t;
+	int x, lfd;
+	int help = 0;
+	char cmd[256];
+
+	cmd[0] = 0;
+	memset(&opt, 0, sizeof opt);
+
+	for (x = 1; x < argc; ++x) {
+		if (argv[x][0] == '-' && argv[x][1] == '-') {
+			if (!strcmp(argv[x], "--help")) {
+				help = 1;
+			} else if (!strcmp(argv[x], "--exec")) {
+				opt.exec = 1;
+			} else if (!strcmp(argv[x], "--nobdos")) {
+				opt.nobdos = 1;
+			} else if (!strcmp(argv[x], "--overlay") && x + 1 < argc) {
+				overlaydir = argv[++x];
+			} else if (!strcmp(argv[x], "--disks") && x + 1 < argc) {
+				opt.disks = argv[++x];
+			} else if (!strcmp(argv[x], "--workers") && x + 1 < argc) {
+				nworkers = atoi(argv[++x]);
+			} else if (!strcmp(argv[x], "--slice") && x + 1 < argc) {
+				slice = atol(argv[++x]);
+			} else if (!strcmp(argv[x], "--max") && x + 1 < argc) {
+				maxsessions = atoi(argv[++x]);
+			} else {
+				fprintf(stderr, "Unknown option %s\n", argv[x]);
+				exit(1);
+			}
+		} else if (sockpath == NULL) {
+			sockpath = argv[x];
+		} else {
+			if (!cmd[0]) {
+				strncat(cmd, argv[x], sizeof cmd - 1);
+			} else {
+				strncat(cmd, " ", sizeof cmd - 1 - strlen(cmd));
+				strncat(cmd, argv[x], sizeof cmd - 1 - strlen(cmd));
+			}
+		}
+	}
+
+	if (help || sockpath == NULL) {
+		fprintf(stderr, "\n%s [options] socket [CP/M command]\n", argv[0]);
+		fprintf(stderr, "\n   Run a CP/M session for each connection to socket\n");
+		fprintf(stderr, "\n   Options:\n\n");
+		fprintf(stderr, "    --help         Show this help\n");
+		fprintf(stderr, "    --exec         Execute the command and disconnect\n");
+		fprintf(stderr, "    --nobdos       Do not emulate BDOS: only emulate BIOS\n");
+		fprintf(stderr, "                   Real disk images will be used.        \n");
+		fprintf(stderr, "    --overlay dir  Keep the sectors each session writes in\n");
+		fprintf(stderr, "                   overlay files in dir/N\n");
+		fprintf(stderr, "    --disks file   Read drive geometries from file\n");
+		fprintf(stderr, "    --workers n    Run sessions on n threads (4)\n");
+		fprintf(stderr, "    --slice n      Instructions a session runs per turn\n");
+		fprintf(stderr, "    --max n        Most sessions at once (1024)\n");
+		fprintf(stderr, "\n");
+		exit(help ? 0 : 1);
+	}
+
+	if (nworkers < 1 || slice < 1 || maxsessions < 1) {
+		fprintf(stderr, "cpmd: --workers, --slice and --max must be > 0\n");
+		exit(1);
+	}
+
+	if (cmd[0])
+		opt.command = cmd;
+
+	/* sessions can not change the directory of the whole process */
+	opt.restricted = 1;
+
+	if (overlaydir != NULL)
+		mkdir(overlaydir, 0777);
+
+	if (pipe(wakefd) != 0) {
+		perror("cpmd: pipe");
+		exit(1);
+	}
+
+	fcntl(wakefd[0], F_SETFL, fcntl(wakefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(wakefd[1], F_SETFL, fcntl(wakefd[1], F_GETFL) | O_NONBLOCK);
+
+	deques = (deque *)calloc(nworkers, sizeof *deques);
+
+	if (deques == NULL) {
+		fprintf(stderr, "cpmd: out of memory\n");
+		exit(1);
+	}
+
+	for (x = 0; x < nworkers; x++) {
+		pthread_mutex_init(&deques[x].lock, NULL);
+		deques[x].s = (session **)calloc(maxsessions, sizeof (session *));
+
+		if (deques[x].s == NULL) {
+			fprintf(stderr, "cpmd: out of memory\n");
+			exit(1);
+		}
+	}
+
+	if ((lfd = listenon(sockpath)) < 0)
+		exit(1);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, quit);
+	signal(SIGTERM, quit);
+	signal(SIGHUP, quit);
+
+	for (x = 0; x < nworkers; x++) {
+		if (pthread_create(&t, NULL, worker, (void *)(long)x) != 0) {
+			fprintf(stderr, "cpmd: cannot start worker threads\n");
+			unlink(sockpath);
+			exit(1);
+		}
+	}
+
+	serve(lfd);
+	unlink(sockpath);
+	return 1;
+}
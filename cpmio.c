@@ -0,0 +1,557 @@
+/*-----------------------------------------------------------------------*\
+ |  cpmio.c  --  all I/O to the Unix world for a z80 running CP/M  --    |
+ |  "z80.c" calls various functions within this file                    |
+ |                                                                       |
+ |  Copyright 1986-1988 by Parag Patel.  All Rights Reserved.            |
+ |  Copyright 1994-1995 by CodeGen, Inc.  All Rights Reserved.           |
+\*-----------------------------------------------------------------------*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+
+#include "defs.h"
+#include "vt.h"
+
+#if defined macintosh
+#	include <Types.h>
+#	include <Events.h>
+#elif defined DJGPP
+#	include <pc.h>
+#endif
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  monitor  --  hand over to the user-level commands of the program
+ |  running the z80, if it has any
+\*-----------------------------------------------------------------------*/
+
+void
+monitor(z80info *z80)
+{
+	if (z80->monitor != NULL)
+		z80->monitor(z80);
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  dumptrace  --  dump the z80 registers in an easy-to-trace format
+ |  --  note that the dump takes exactly one line so that changes in
+ |  register values are easier to spot  --  disassembles the z80 code
+\*-----------------------------------------------------------------------*/
+
+void
+dumptrace(z80info *z80)
+{
+	printf("a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
+			A, F, BC, DE, HL);
+	printf("ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
+			IX, IY, SP, PC, z80->mem[PC]);
+	disassem(z80, PC, stdout);
+	printf("\r\n");
+
+	if (z80->logfile)
+	{
+		fprintf(z80->logfile, "a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
+				A, F, BC, DE, HL);
+		fprintf(z80->logfile, "ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
+				IX, IY, SP, PC, z80->mem[PC]);
+		disassem(z80, PC, z80->logfile);
+		fprintf(z80->logfile, "\r\n");
+	}
+}
+
+
+
+#define HEXVAL(c)	(('0' <= (c) && (c) <= '9') ? (c) - '0' :\
+			(('a' <= (c) && (c) <= 'f') ? (c) - 'a' + 10 :\
+			(('A' <= (c) && (c) <= 'F') ? (c) - 'A' + 10 :\
+				-1 )))
+
+static int
+gethex(FILE *fp)
+{
+	int i, j;
+
+	i = getc(fp);
+	j = getc(fp);
+
+	if (i < 0 || j < 0)
+		return -1;
+
+	i = HEXVAL(i);
+	j = HEXVAL(j);
+
+	if (i < 0 || j < 0)
+		return -1;
+
+	return (i << 4) | j;
+}
+
+
+static int
+loadhex(z80info *z80, FILE *fp)
+{
+	int start = TRUE;
+	int len, line, i;
+	word addr, check, t;
+
+	for (line = 1; getc(fp) >= 0; line++)		/* should be a ':' */
+	{
+		if ((len = gethex(fp)) <= 0)
+			break;
+
+		check = len;
+
+		if ((i = gethex(fp)) < 0)
+			break;
+
+		addr = (word)i;
+		check += addr;
+
+		if ((i = gethex(fp)) < 0)
+			break;
+
+		t = (word)i;
+		check += t;
+		addr = (addr << 8) | t;
+
+		if (start)
+			PC = addr, start = FALSE;
+
+		if ((i = gethex(fp)) < 0)		/* ??? */
+			break;
+
+		check += (word)i;
+
+		while (len-- > 0)
+		{
+			if ((i = gethex(fp)) < 0)
+				break;
+
+			t = (word)i;
+			check += t;
+			z80->mem[addr] = t;
+			addr++;
+		}
+
+		if ((i = gethex(fp)) < 0)		/* checksum */
+			break;
+
+		t = (word)i;
+
+		if ((t + check) & 0xFF)
+		{
+			fprintf(stderr, "%d: Checksum error: %.2X != 0!\r\n",
+					line, (t + check) & 0xFF);
+			return FALSE;
+		}
+
+		if (getc(fp) < 0)		/* should be a '\n' */
+			break;
+	}
+
+	return TRUE;
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  getword  --  return a 16-bit word from the specified file
+\*-----------------------------------------------------------------------*/
+
+static int
+getword(FILE *file)
+{
+	int w;
+
+	w = getc(file) << 8;
+	w |= getc(file);
+	return w;
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  loadpisces  --  load the specified file (assumed to be in Pisces+
+ |  format) into the z80 memory for subsequent execution
+\*-----------------------------------------------------------------------*/
+
+static int
+loadpisces(z80info *z80, FILE *file)
+{
+	int numbytes, i;
+	unsigned short loadaddr;
+
+	/* ignore the 1st 12 words in the file - the 13th word is the starting
+	   PC value - the 14th is also ignored */
+	for (i = 0; i < 12; i++)
+		getword(file);
+
+	PC = getword(file);
+	getword(file);
+
+	/* read in each block of words into the z80 memory - each block
+	   specifies the number of bytes in the block and the address to load
+	   the data into */
+	while (getword(file) != EOF)
+	{
+		numbytes = getword(file);
+		loadaddr = getword(file);
+		getword(file);
+
+		for (; numbytes > 0; numbytes -= 2)
+		{
+			z80->mem[loadaddr] = getc(file);
+			loadaddr++;
+			z80->mem[loadaddr] = getc(file);
+			loadaddr++;
+		}
+	}
+
+	return TRUE;
+}
+
+
+static void
+suffix(char *str, const char *suff)
+{
+	while(*str != '\0' && *str != '.')
+		str++;
+
+	strcpy(str, suff);
+}
+
+
+boolean
+loadfile(z80info *z80, const char *fname)
+{
+	char buf[200];
+	FILE *fp;
+	int ret;
+
+	if ((fp = fopen(fname, "r")) != NULL)
+	{
+		ret = loadhex(z80, fp);
+		fclose(fp);
+		return ret;
+	}
+
+	strcpy(buf, fname);
+	suffix(buf, ".hex");
+
+	if ((fp = fopen(buf, "r")) != NULL)
+	{
+		ret = loadhex(z80, fp);
+		fclose(fp);
+		return ret;
+	}
+
+	strcpy(buf, fname);
+	suffix(buf, ".X");
+
+	if ((fp = fopen(buf, "r")) != NULL)
+	{
+		ret = loadpisces(z80, fp);
+		fclose(fp);
+		return ret;
+	}
+
+	return FALSE;
+}
+
+
+
+/* input  --  z80 input instruction  --  this function is called whenever
+   an input ports is referenced from the z80 to handle the real I/O  --
+   it returns a byte to the z80 just like the real I/O instruction  --
+   the arguments represent the data on the bus as it would be for a real
+   z80 - this routine is restarted later if there is no input pending,
+   and we must wait for some to occur  --  it returns FALSE to stop the
+   z80 when an embedded console has no input yet */
+
+boolean
+input(z80info *z80, byte haddr, byte laddr, byte *val)
+{
+	unsigned int data;
+
+	/* just uses the lower 8-bits of the I/O address for now... */
+	switch (laddr)
+	{
+
+	/* return a character from the keyboard - wait for it if necessary  --
+	   return "last" if we have already read in something via 0x01 */
+	case 0x00:
+		if (z80->con.embedded)
+		{
+			/* no waiting: the z80 stops until it is given input */
+			int c;
+
+			while ((c = kget(z80, 0)) == INTR_CHAR)
+				monitor(z80);
+
+			if (c == -1)
+			{
+				z80->blocked = TRUE;
+				return FALSE;
+			}
+
+			data = c;
+		}
+		else
+		{
+#if defined macintosh
+			EventRecord ev;
+
+		again:
+			fflush(stdout);
+
+			while (!WaitNextEvent(keyDownMask | autoKeyMask,
+					&ev, 20, nil))
+				;
+
+			data = ev.message & charCodeMask;
+
+			if ((data == '.' && (ev.modifiers & cmdKey)) ||
+					data == INTR_CHAR)
+			{
+				monitor(z80);
+				goto again;
+			}
+			else if (data == 'q' && (ev.modifiers & cmdKey))
+				exit(0);
+#elif defined DJGPP
+			fflush(stdout);
+			data = getkey();
+
+			while (data == INTR_CHAR)
+			{
+				monitor(z80);
+				data = getkey();
+			}
+#else	/* TCGETA */
+			fflush(stdout);
+			data = kget(z80, 0);
+			/* data = getchar(); */
+
+			while ((data > 0x7f && errno == EINTR) ||
+					data == INTR_CHAR)
+			{
+				monitor(z80);
+				data = kget(z80, 0);
+				/* data = getchar(); */
+			}
+#endif
+		}
+
+		*val = data & 0x7F;
+		break;
+
+	/* return 0xFF if we have a character waiting to be read - save the
+	   character in "last" for 0x00 above */
+	case 0x01:
+#if defined macintosh
+		{
+			EventRecord ev;
+			*val = EventAvail(keyDownMask | autoKeyMask, &ev) ?
+					0xFF : 0;
+		}
+#elif defined DJGPP
+		*val = (kbhit()) ? 0xFF : 0;
+#else	/* UNIX or BeBox */
+		fflush(stdout);
+
+		if (constat(z80))
+			*val = 0xFF;
+		else
+			*val = 0x00;
+
+#endif
+		break;
+
+	/* default - prompt the user for an input byte, unless there is
+	   no user: an embedded machine reads nothing there */
+	default:
+		if (z80->con.embedded)
+		{
+			*val = 0xFF;
+			break;
+		}
+
+		resetterm();
+		printf("INPUT : addr = %X%X    DATA = ", haddr, laddr);
+		fflush(stdout);
+		scanf("%x", &data);
+		setterm();
+		*val = data;
+		break;
+	}
+
+	return TRUE;
+}
+
+
+/*-----------------------------------------------------------------------*\
+ |  output  --  output the data at the specified I/O address
+\*-----------------------------------------------------------------------*/
+
+void
+output(z80info *z80, byte haddr, byte laddr, byte data)
+{
+	if (laddr == 0xFF) {
+		/* BIOS call - interrupt the z80 before the next instruction
+		   since we may have to mess with the PC & other stuff -
+		   otherwise we would do it right here */
+		z80->event = TRUE;
+		z80->halt = TRUE;
+		z80->syscall = TRUE;
+		z80->biosfn = data;
+
+		if (z80->trace)
+		{
+			printf("BIOS call %d\r\n", z80->biosfn);
+
+			if (z80->logfile)
+				fprintf(z80->logfile, "BIOS call %d\r\n",
+					z80->biosfn);
+		}
+	} else if (laddr == 0) {
+		/* output a character to the screen */
+		/* putchar(data); */
+		vt52(z80, data);
+		conflush(z80);
+
+		if (z80->logfile != NULL)
+			putc(data, z80->logfile);
+	} else if (!z80->con.embedded) {
+		/* dump the data for our user */
+		printf("OUTPUT: addr = %X%X  DATA = %X\r\n", haddr, laddr,data);
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  haltcpu  --  this is called after the z80 halts  --  it is used for
+ |  tracing & such
+\*-----------------------------------------------------------------------*/
+
+void
+haltcpu(z80info *z80)
+{
+	z80->halt = FALSE;
+
+#ifdef SIGUSR1
+	/* asked for the BDOS and BIOS call counts so far */
+	if (z80->sig == SIGUSR1)
+	{
+		z80->sig = 0;
+		callstatsave(z80, z80->callstatsfile);
+	}
+#endif
+
+	/* we were interrupted by a Unix signal */
+	if (z80->sig)
+	{
+		if (z80->sig != SIGINT)
+			printf("\r\nCaught signal %d.\r\n", z80->sig);
+
+		z80->sig = 0;
+		monitor(z80);
+		return;
+	}
+
+	/* we are tracing execution of the z80 */
+	if (z80->trace)
+	{
+		/* re-enable tracing */
+		z80->event = TRUE;
+		z80->halt = TRUE;
+		dumptrace(z80);
+
+		if (z80->step)
+			monitor(z80);
+	}
+
+	/* a CP/M syscall - done here so tracing still works */
+	if (z80->syscall)
+	{
+		z80->syscall = FALSE;
+		dobios(z80, z80->biosfn);
+	}
+}
+
+word
+read_mem(z80info *z80, word addr)
+{
+#ifdef MEM_BREAK
+	if (z80->membrk[addr] & M_BREAKPOINT)
+	{
+		fprintf(stderr, "\r\nBreak at 0x%X\r\n", addr);
+	}
+	else if (z80->membrk[addr] & M_READ_PROTECT)
+	{
+		fprintf(stderr,
+			"\r\nAttempt to read protected memory at 0x%X\r\n",
+			addr);
+	}
+	else if (z80->membrk[addr] & M_MEM_MAPPED_IO)
+	{
+		fprintf(stderr,
+			"\r\nAttempt to perform mem-mapped input at 0x%X\r\n",
+			addr);
+		/* fake some sort of I/O here and return its value */
+	}
+
+	tracesave(z80, "memory read break");
+	dumptrace(z80);
+	monitor(z80);
+#endif	/* MEM_BREAK */
+
+	return z80->mem[addr];
+}
+
+word
+write_mem(z80info *z80, word addr, byte val)
+{
+#ifdef MEM_BREAK
+	if (z80->membrk[addr] & M_BREAKPOINT)
+	{
+		fprintf(stderr, "\r\nBreak at 0x%X\r\n", addr);
+	}
+	else if (z80->membrk[addr] & M_WRITE_PROTECT)
+	{
+		fprintf(stderr,
+			"\r\nAttempt to write to protected memory at 0x%X\r\n",
+			addr);
+	}
+	else if (z80->membrk[addr] & M_MEM_MAPPED_IO)
+	{
+		fprintf(stderr,
+			"\r\nAttempt to perform mem-mapped output at 0x%X\r\n",
+			addr);
+		/* fake some sort of I/O here and set mem to its value, */
+		/* then return */
+	}
+
+	tracesave(z80, "memory write break");
+	dumptrace(z80);
+	monitor(z80);
+#endif	/* MEM_BREAK */
+
+	return z80->mem[addr] = val;
+}
+
+void
+undefinstr(z80info *z80, byte instr)
+{
+	printf("\r\nIllegal instruction 0x%.2X at PC=0x%.4X\r\n",
+		instr, PC - 1);
+	tracesave(z80, "illegal instruction");
+	monitor(z80);
+}
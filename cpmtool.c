@@ -3,6 +3,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
 
 #define SECTOR_SIZE 128
 
@@ -71,20 +80,20 @@ struct cpm_dpb dpb_hd = {
 	             60, 61, 62, 63 }
 };
 
-/* Pointer to drive parameter block */
-struct cpm_dpb *dpb = &dpb_fd;
+#define DISK_MAGIC "CPMDISK\032"
+#define DISK_MAGIC_LEN 8
 
 /* Starting sector of directory */
 #define SECTOR_DIR 0
 
 /* Number of directory sectors */
-#define SECTOR_DIR_SIZE ((dpb->drm + 1) * 32 / SECTOR_SIZE)
+#define SECTOR_DIR_SIZE ((dk->dpb->drm + 1) * 32 / SECTOR_SIZE)
 
 /* Sectors per block */
-#define SECTORS_PER_BLOCK (1 << dpb->bsh)
+#define SECTORS_PER_BLOCK (1 << dk->dpb->bsh)
 
 /* True for a big disk: use two bytes for allocation map entries */
-#define BIG_DISK (dpb->dsm > 255)
+#define BIG_DISK (dk->dpb->dsm > 255)
 
 /* Max sectors for one extent */
 #define SECTORS_PER_EXTENT ((BIG_DISK ? 8 : 16) * SECTORS_PER_BLOCK)
@@ -93,10 +102,10 @@ struct cpm_dpb *dpb = &dpb_fd;
 #define BLOCKS_PER_EXTENT (BIG_DISK ? 8 : 16)
 
 /* Compute extent number of a directory entry */
-#define EXTENT_NO(d) (((0x1f & (d)->ex) + 32 * (d)->s2) / (dpb->exm + 1))
+#define EXTENT_NO(d) (((0x1f & (d)->ex) + 32 * (d)->s2) / (dk->dpb->exm + 1))
 
 /* Compute record count of a directory entry */
-#define RC(d) (128 * ((d)->ex & dpb->exm) + (d)->rc)
+#define RC(d) (128 * ((d)->ex & dk->dpb->exm) + (d)->rc)
 
 
 /* Directory entry size */
@@ -137,6 +146,63 @@ struct dirent {
 	unsigned char al[16];	/* Allocation map: 0 means free, otherwise block number */
 };
 
+/* Everything about one open disk image.  Functions take it as "dk",
+ * which the macros above use for the geometry. */
+
+struct disk
+{
+        char *name; /* Path to the image */
+        FILE *disk;
+        int readonly; /* Opened to read only (no writes are made) */
+        FILE *log; /* Where problems found in the directory are reported */
+        long problems; /* Number of them */
+
+        /* Pointer to drive parameter block */
+        struct cpm_dpb *dpb;
+
+        /* Geometry from an image header: the first sector of the first reserved
+         * track holds DISK_MAGIC followed by a CP/M 2.2 DPB.  No skew. */
+        struct cpm_dpb dpb_img;
+
+        /* Physical sector in its track of each logical one (deskew) */
+        int *phys_sect;
+        int contig; /* Set if there is no skew, so each block is in one piece */
+
+        /* The image, where it can be mapped into memory: sectors are copied
+         * straight in and out of it.  Otherwise stdio is used. */
+        unsigned char *image;
+        long image_len;
+
+        /* The directory (see load_dir) */
+        unsigned char *dir_buf; /* SECTOR_DIR_SIZE sectors */
+        unsigned char *dir_dirty; /* Set for each sector of it changed */
+        int dir_entries;
+
+        /* Hash chains of the entries in use, oldest first */
+        int *dir_hash; /* First entry for each hash, or -1 */
+        int *dir_next; /* Next entry with the same hash, or -1 */
+        int dir_hash_size; /* A power of 2 */
+
+        /* get allocation map (index by block number) */
+        unsigned short *alloc_map; /* 0xFFFF is free, 0xFFFE allocated for directory, otherwise entry no. */
+
+        /* Free blocks are also kept as a bitmap (bit set for free), so a search
+         * can skip a word of used ones at a time.  Allocation starts where the
+         * last one left off. */
+        unsigned long *free_map;
+        int free_blocks; /* Bits set in free_map */
+        int next_fit; /* Where to start looking for free space */
+
+        /* Listing */
+        struct name **names;
+        int name_n;
+
+        char namebuf[50]; /* For getname() */
+        char lowbuf[50]; /* For lower_name() */
+};
+
+#define MAP_BITS (8 * (int)sizeof(unsigned long))
+
 /* Extent number is (32*s2 + ex) / (exm+1)
  * Record count is (ex & exm)*128 + rc
  * Basically non-zero exm means extra rc bits are stuffed into the extent number
@@ -144,28 +210,211 @@ struct dirent {
  * 128 records in a single extent.
  */
 
-FILE *disk;
+/* Set up sector access once the geometry is known */
+
+int map_image(struct disk *dk)
+{
+        int x;
+        dk->phys_sect = (int *)malloc(sizeof(int) * dk->dpb->spt);
+        if (!dk->phys_sect) {
+                printf("Not enough memory\n");
+                return -1;
+        }
+        dk->contig = 1;
+        for (x = 0; x != dk->dpb->spt; ++x) {
+                dk->phys_sect[x] = (dk->dpb == &dk->dpb_img ? x : dk->dpb->skew[x]);
+                if (dk->phys_sect[x] != x)
+                        dk->contig = 0;
+        }
+#ifdef USE_MMAP
+        fflush(dk->disk);
+        fseek(dk->disk, 0, SEEK_END);
+        dk->image_len = ftell(dk->disk);
+        if (dk->image_len > 0) {
+                dk->image = (unsigned char *)mmap(NULL, dk->image_len, PROT_READ | (dk->readonly ? 0 : PROT_WRITE), MAP_SHARED, fileno(dk->disk), 0);
+                if (dk->image == (unsigned char *)MAP_FAILED)
+                        dk->image = NULL;
+        }
+#endif
+        return 0;
+}
+
+/* Make the image at least len bytes long, as writing past its end with
+ * stdio would */
+
+void grow_image(struct disk *dk, long len)
+{
+#ifdef USE_MMAP
+        if (!dk->image || len <= dk->image_len)
+                return;
+        munmap(dk->image, dk->image_len);
+        dk->image = NULL;
+        if (ftruncate(fileno(dk->disk), len))
+                return;
+        dk->image = (unsigned char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(dk->disk), 0);
+        if (dk->image == (unsigned char *)MAP_FAILED)
+                dk->image = NULL;
+        else
+                dk->image_len = len;
+#else
+        (void)len;
+#endif
+}
+
+/* Offset of sector in the image.  Skip reserved tracks.  Deskew. */
+
+long sect_ofs(struct disk *dk, int sect)
+{
+        return ((long)(sect / dk->dpb->spt + dk->dpb->off) * dk->dpb->spt + dk->phys_sect[sect % dk->dpb->spt]) * SECTOR_SIZE;
+}
+
+/* Get sector.  One past the end of the image reads as formatted. */
+
+void getsect(struct disk *dk, unsigned char *buf, int sect)
+{
+        long ofs = sect_ofs(dk, sect);
+        if (dk->image) {
+                if (ofs + SECTOR_SIZE <= dk->image_len)
+                        memcpy(buf, dk->image + ofs, SECTOR_SIZE);
+                else
+                        memset(buf, 0xE5, SECTOR_SIZE);
+                return;
+        }
+        fseek(dk->disk, ofs, SEEK_SET);
+        fread((char *)buf, SECTOR_SIZE, 1, dk->disk);
+}
+
+void putsect(struct disk *dk, unsigned char *buf, int sect)
+{
+        long ofs = sect_ofs(dk, sect);
+        grow_image(dk, ofs + SECTOR_SIZE);
+        if (dk->image) {
+                memcpy(dk->image + ofs, buf, SECTOR_SIZE);
+                return;
+        }
+        fseek(dk->disk, ofs, SEEK_SET);
+        fwrite((char *)buf, SECTOR_SIZE, 1, dk->disk);
+}
+
+/* Get or put the first sects sectors of block blk: in one copy if the
+ * block is in one piece */
+
+void getblock(struct disk *dk, unsigned char *buf, int blk, int sects)
+{
+        long ofs = sect_ofs(dk, blk << dk->dpb->bsh);
+        int x;
+        if (dk->image && dk->contig && ofs + (long)sects * SECTOR_SIZE <= dk->image_len) {
+                memcpy(buf, dk->image + ofs, (long)sects * SECTOR_SIZE);
+                return;
+        }
+        for (x = 0; x != sects; ++x)
+                getsect(dk, buf + x * SECTOR_SIZE, (blk << dk->dpb->bsh) + x);
+}
+
+void putblock(struct disk *dk, unsigned char *buf, int blk, int sects)
+{
+        long ofs = sect_ofs(dk, blk << dk->dpb->bsh);
+        int x;
+        if (dk->contig)
+                grow_image(dk, ofs + (long)sects * SECTOR_SIZE);
+        if (dk->image && dk->contig) {
+                memcpy(dk->image + ofs, buf, (long)sects * SECTOR_SIZE);
+                return;
+        }
+        for (x = 0; x != sects; ++x)
+                putsect(dk, buf + x * SECTOR_SIZE, (blk << dk->dpb->bsh) + x);
+}
+
+/* The directory is read in once and indexed by (name, extent number).
+ * Changes are made to the copy in memory, and only the sectors they
+ * touch are written back, by flush_dir(). */
+
+#define DIR_ENTRY(n) ((struct dirent *)(dk->dir_buf + (n) * ENTRY_SIZE))
+
+char *getname(struct disk *dk, struct dirent *d);
+
+unsigned hash_name(struct disk *dk, char *name, int ex)
+{
+        unsigned h = ex;
+        while (*name)
+                h = h * 31 + (unsigned char)*name++;
+        return h & (dk->dir_hash_size - 1);
+}
+
+/* Add entry n to its chain, at the end so a lookup finds the first one
+ * in the directory as a scan would */
+
+void index_entry(struct disk *dk, int n)
+{
+        struct dirent *d = DIR_ENTRY(n);
+        int *p = &dk->dir_hash[hash_name(dk, getname(dk, d), EXTENT_NO(d))];
+        while (*p != -1)
+                p = &dk->dir_next[*p];
+        *p = n;
+        dk->dir_next[n] = -1;
+}
+
+void unindex_entry(struct disk *dk, int n)
+{
+        struct dirent *d = DIR_ENTRY(n);
+        int *p = &dk->dir_hash[hash_name(dk, getname(dk, d), EXTENT_NO(d))];
+        while (*p != n)
+                p = &dk->dir_next[*p];
+        *p = dk->dir_next[n];
+}
+
+int load_dir(struct disk *dk)
+{
+        int x;
+        dk->dir_entries = SECTOR_DIR_SIZE * (SECTOR_SIZE / ENTRY_SIZE);
+        for (dk->dir_hash_size = 1; dk->dir_hash_size < 2 * dk->dir_entries; dk->dir_hash_size *= 2)
+                ;
+        dk->dir_buf = (unsigned char *)malloc(SECTOR_DIR_SIZE * SECTOR_SIZE);
+        dk->dir_dirty = (unsigned char *)calloc(SECTOR_DIR_SIZE, 1);
+        dk->dir_hash = (int *)malloc(sizeof(int) * dk->dir_hash_size);
+        dk->dir_next = (int *)malloc(sizeof(int) * dk->dir_entries);
+        if (!dk->dir_buf || !dk->dir_dirty || !dk->dir_hash || !dk->dir_next) {
+                printf("Not enough memory for directory\n");
+                return -1;
+        }
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                getsect(dk, dk->dir_buf + x * SECTOR_SIZE, x + SECTOR_DIR);
+        for (x = 0; x != dk->dir_hash_size; ++x)
+                dk->dir_hash[x] = -1;
+        for (x = 0; x != dk->dir_entries; ++x)
+                if (DIR_ENTRY(x)->uu < 0x20)
+                        index_entry(dk, x);
+        return 0;
+}
+
+/* Entry number of name's extent ex, or -1 */
 
-/* Get sector.  Skip reserved tracks.  Deskew. */
+int find_entry(struct disk *dk, char *name, int ex)
+{
+        int n;
+        for (n = dk->dir_hash[hash_name(dk, name, ex)]; n != -1; n = dk->dir_next[n])
+                if (EXTENT_NO(DIR_ENTRY(n)) == ex && !strcmp(getname(dk, DIR_ENTRY(n)), name))
+                        return n;
+        return -1;
+}
 
-void getsect(unsigned char *buf, int sect)
+void dirty_entry(struct disk *dk, int n)
 {
-	int track = sect / dpb->spt;
-	int sector = sect % dpb->spt;
-	sector = dpb->skew[sector]; /* De-interleave sectors */
-	track += dpb->off; /* Skip over reserved tracks */
-        fseek(disk, (track * dpb->spt + sector) * SECTOR_SIZE, SEEK_SET);
-        fread((char *)buf, SECTOR_SIZE, 1, disk);
+        dk->dir_dirty[n / (SECTOR_SIZE / ENTRY_SIZE)] = 1;
 }
 
-void putsect(unsigned char *buf, int sect)
+/* Write back the directory sectors which changed */
+
+void flush_dir(struct disk *dk)
 {
-	int track = sect / dpb->spt;
-	int sector = sect % dpb->spt;
-	sector = dpb->skew[sector]; /* De-interleave sectors */
-	track += dpb->off; /* Skip over reserved tracks */
-        fseek(disk, (track * dpb->spt + sector) * SECTOR_SIZE, SEEK_SET);
-        fwrite((char *)buf, SECTOR_SIZE, 1, disk);
+        int x;
+        if (!dk->dir_dirty) /* Not open */
+                return;
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                if (dk->dir_dirty[x]) {
+                        putsect(dk, dk->dir_buf + x * SECTOR_SIZE, x + SECTOR_DIR);
+                        dk->dir_dirty[x] = 0;
+                }
 }
 
 int lower(int c)
@@ -178,9 +427,9 @@ int lower(int c)
 
 /* Convert file name from directory into UNIX zero-terminated C string name */
 
-char *getname(struct dirent *d)
+char *getname(struct disk *dk, struct dirent *d)
 {
-        static char s[50];
+        char *s = dk->namebuf;
         int p = 0;
         int r;
         int i;
@@ -261,121 +510,178 @@ struct name
         int size;
 };
 
-struct name *names[1024];
-int name_n;
 
 int comp(struct name **l, struct name **r)
 {
         return strcmp((*l)->name, (*r)->name);
 }
 
+int comp_str(char **l, char **r)
+{
+        return strcmp(*l, *r);
+}
+
 /* Return list of free directory entries (extents) for a file */
 
-int alloc_extents(int *list, int extents)
+int alloc_extents(struct disk *dk, int *list, int extents)
 {
-        unsigned char buf[SECTOR_SIZE];
         int x;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                getsect(buf, x);
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (d->uu == 0xE5) {
-                                *list++ = x * (SECTOR_SIZE / ENTRY_SIZE) + (y / ENTRY_SIZE);
-                                if (!--extents)
-                                        return 0;
-                        }
+        for (x = 0; x != dk->dir_entries; ++x)
+                if (DIR_ENTRY(x)->uu == 0xE5) {
+                        *list++ = x;
+                        if (!--extents)
+                                return 0;
                 }
-        }
         return -1;
 }
 
 /* get allocation map (index by block number) */
 
-unsigned short *alloc_map; /* 0xFFFF is free, 0xFFFE allocated for directory, otherwise entry no. */
+#ifdef __GNUC__
+#define ctz(w) __builtin_ctzl(w)
+#define popcount(w) __builtin_popcountl(w)
+#else
+int ctz(unsigned long w)
+{
+        int n = 0;
+        while (!(w & 1)) {
+                w >>= 1;
+                ++n;
+        }
+        return n;
+}
+
+int popcount(unsigned long w)
+{
+        int n = 0;
+        while (w) {
+                w &= w - 1;
+                ++n;
+        }
+        return n;
+}
+#endif
+
+/* Blocks reserved for the directory: those marked in AL0/AL1, but at
+ * least enough to hold it (a part block is a whole one) */
 
-void get_map()
+int dir_blocks(struct disk *dk)
+{
+        int n = popcount(((unsigned long)dk->dpb->al0 << 8) | dk->dpb->al1);
+        int need = ((dk->dpb->drm + 1) * ENTRY_SIZE + (SECTOR_SIZE << dk->dpb->bsh) - 1) / (SECTOR_SIZE << dk->dpb->bsh);
+        return n > need ? n : need;
+}
+
+void set_used(struct disk *dk, int blk, int entry_no)
+{
+        dk->alloc_map[blk] = entry_no;
+        dk->free_map[blk / MAP_BITS] &= ~(1UL << (blk % MAP_BITS));
+        --dk->free_blocks;
+}
+
+void set_free(struct disk *dk, int blk)
+{
+        dk->alloc_map[blk] = 0xFFFF;
+        dk->free_map[blk / MAP_BITS] |= (1UL << (blk % MAP_BITS));
+        ++dk->free_blocks;
+}
+
+/* First block at or after blk which is free (or used if used is set),
+ * or dsm + 1 if there are none */
+
+int next_block(struct disk *dk, int blk, int used)
+{
+        int w = blk / MAP_BITS;
+        int words = (dk->dpb->dsm + MAP_BITS) / MAP_BITS;
+        unsigned long flip = used ? ~0UL : 0;
+        unsigned long bits;
+        if (blk > dk->dpb->dsm)
+                return dk->dpb->dsm + 1;
+        bits = (dk->free_map[w] ^ flip) & (~0UL << (blk % MAP_BITS));
+        while (!bits) {
+                if (++w == words)
+                        return dk->dpb->dsm + 1;
+                bits = dk->free_map[w] ^ flip;
+        }
+        blk = w * MAP_BITS + ctz(bits);
+        return blk > dk->dpb->dsm ? dk->dpb->dsm + 1 : blk;
+}
+
+void get_map(struct disk *dk)
 {
-        unsigned char buf[SECTOR_SIZE];
         int x;
         int entry_no;
-        if (!alloc_map) {
-                alloc_map = malloc(sizeof(alloc_map[0]) * (dpb->dsm + 1));
+        if (!dk->alloc_map) {
+                dk->alloc_map = malloc(sizeof(dk->alloc_map[0]) * (dk->dpb->dsm + 1));
+                dk->free_map = calloc((dk->dpb->dsm + MAP_BITS) / MAP_BITS, sizeof(unsigned long));
                 /* Initialize to all free */
-                for (x = 0; x != dpb->dsm + 1; ++x)
-                        alloc_map[x] = 0xFFFF;
+                dk->free_blocks = 0;
+                for (x = 0; x != dk->dpb->dsm + 1; ++x)
+                        set_free(dk, x);
                 /* Reserve space for directory */
-                for (x = 0; x != (dpb->drm + 1) / ((SECTOR_SIZE << dpb->bsh) / ENTRY_SIZE); ++x)
-                        alloc_map[x] = 0xFFFE;
-        }
-        entry_no = 0;
-        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
-                int y;
-                /* fprintf(stderr, "sector %d\n", x); */
-                getsect(buf, x + SECTOR_DIR);
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (d->uu < 0x20) { /* d->uu != 0xe5 (date stamp is 0x21) */
-                                int z;
-                                /* 
-                                char *s = getname(d);
-                                printf("%d %s\n", entry_no, s); */
-                                for (z = 0; z != 16; ++z) {
-                                        int blk;
-                                        if (BIG_DISK) {
-                                                blk = d->al[z] + (256 * d->al[z + 1]);
-                                                ++z;
-                                        } else {
-                                                blk = d->al[z];
-                                        }
-                                        if (blk) {
-                                                if (blk >= dpb->dsm + 1) {
-                                                        fprintf(stderr, "Entry %d: Found block number (%d) exceeding device size\n", entry_no, blk);
-                                                } else if (alloc_map[blk] != 0xFFFF) {
-                                                        fprintf(stderr, "Entry %d: Found doubly allocated block number (%d) by entry %d\n", entry_no, blk, alloc_map[blk]);
-                                                } else {
-                                                        /* Record directory entry number */
-                                                        /* printf("setting %d\n", d->al[z]); */
-                                                        alloc_map[blk] = entry_no;
-                                                }
+                for (x = 0; x != dir_blocks(dk); ++x)
+                        set_used(dk, x, 0xFFFE);
+        }
+        for (entry_no = 0; entry_no != dk->dir_entries; ++entry_no) {
+                struct dirent *d = DIR_ENTRY(entry_no);
+                if (d->uu < 0x20) { /* d->uu != 0xe5 (date stamp is 0x21) */
+                        int z;
+                        /* 
+                        char *s = getname(d);
+                        printf("%d %s\n", entry_no, s); */
+                        for (z = 0; z != 16; ++z) {
+                                int blk;
+                                if (BIG_DISK) {
+                                        blk = d->al[z] + (256 * d->al[z + 1]);
+                                        ++z;
+                                } else {
+                                        blk = d->al[z];
+                                }
+                                if (blk) {
+                                        if (blk >= dk->dpb->dsm + 1) {
+                                                fprintf(dk->log, "Entry %d: Found block number (%d) exceeding device size\n", entry_no, blk);
+                                                ++dk->problems;
+                                        } else if (dk->alloc_map[blk] != 0xFFFF) {
+                                                fprintf(dk->log, "Entry %d: Found doubly allocated block number (%d) by entry %d\n", entry_no, blk, dk->alloc_map[blk]);
+                                                ++dk->problems;
                                         } else {
-                                                break;
+                                                /* Record directory entry number */
+                                                /* printf("setting %d\n", d->al[z]); */
+                                                set_used(dk, blk, entry_no);
                                         }
+                                } else {
+                                        break;
                                 }
                         }
-                        ++entry_no;
                 }
         }
 }
 
-/* Allocate a block.  Returns block number or -1 for out of space.  */
+/* Count free blocks */
 
-int alloc_block(int entry_no)
+int amount_free(struct disk *dk)
 {
-        int x;
-        if (!alloc_map)
-                get_map();
-        for (x = 0; x != (dpb->dsm + 1); ++x)
-                if (alloc_map[x] == 0xFFFF) {
-                        alloc_map[x] = entry_no;
-                        return x;
-                }
-        return -1;
+        if (!dk->alloc_map)
+                get_map(dk);
+        return dk->free_blocks;
 }
 
-/* Count free blocks */
+/* Give back the blocks of directory entry n */
 
-int amount_free(void)
+void free_entry(struct disk *dk, int n)
 {
-        int count = 0;
-        int x;
-        if (!alloc_map)
-                get_map();
-        for (x = 0; x != (dpb->dsm + 1); ++x)
-                if (alloc_map[x] == 0xFFFF) {
-                        ++count;
+        struct dirent *d = DIR_ENTRY(n);
+        int z, blk;
+        for (z = 0; z != 16; ++z) {
+                if (BIG_DISK) {
+                        blk = d->al[z] + (256 * d->al[z + 1]);
+                        ++z;
+                } else {
+                        blk = d->al[z];
                 }
-        return count;
+                if (blk && blk <= dk->dpb->dsm && dk->alloc_map[blk] == n)
+                        set_free(dk, blk);
+        }
 }
 
 /* Get directory entry with specific name and extent number
@@ -383,30 +689,26 @@ int amount_free(void)
  * Returns 0 if found, -1 if not found.
  */
 
-int find_file(struct dirent *dir, char *filename, int ex, int del)
+int find_file(struct disk *dk, struct dirent *dir, char *filename, int ex, int del)
 {
-        unsigned char buf[SECTOR_SIZE];
         int x;
         int flg = -1;
-        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
-                int y;
-                getsect(buf, x + SECTOR_DIR);
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (d->uu < 0x20 && (del || ex == EXTENT_NO(d))) {
-                                char *s = getname(d);
-                                if (!strcmp(s, filename)) {
-                                        if (del) {
-                                                d->uu = 0xe5;
-                                                flg = 0;
-                                                putsect(buf, x + SECTOR_DIR);
-                                        } else {
-                                                memcpy(dir, d, ENTRY_SIZE);
-                                                flg = 0;
-                                                return 0;
-                                        }
-                                }
-                        }
+        if (!del) {
+                x = find_entry(dk, filename, ex);
+                if (x == -1)
+                        return -1;
+                memcpy(dir, DIR_ENTRY(x), ENTRY_SIZE);
+                return 0;
+        }
+        for (x = 0; x != dk->dir_entries; ++x) {
+                struct dirent *d = DIR_ENTRY(x);
+                if (d->uu < 0x20 && !strcmp(getname(dk, d), filename)) {
+                        if (dk->alloc_map)
+                                free_entry(dk, x);
+                        unindex_entry(dk, x);
+                        d->uu = 0xe5;
+                        dirty_entry(dk, x);
+                        flg = 0;
                 }
         }
         return flg;
@@ -414,28 +716,33 @@ int find_file(struct dirent *dir, char *filename, int ex, int del)
 
 /* Read a file: provide with first extent */
 
-int read_file(char *filename, struct dirent *dir, FILE *f)
+int read_file(struct disk *dk, char *filename, struct dirent *dir, FILE *f)
 {
         int rtn = 0;
-        unsigned char buf[SECTOR_SIZE];
+        unsigned char *buf = (unsigned char *)malloc(SECTOR_SIZE << dk->dpb->bsh);
         int exno = 0; /* Extent number */
         for (;;) {
                 int recno; /* Record number within extent */
-                for (recno = 0; recno != RC(dir) && recno != SECTORS_PER_EXTENT; ++recno) {
+                int recs = RC(dir); /* Records in extent */
+                if (recs > SECTORS_PER_EXTENT)
+                        recs = SECTORS_PER_EXTENT;
+                for (recno = 0; recno < recs; recno += SECTORS_PER_BLOCK) {
                         int blkno; /* Block number within extent */
-                        int recblk; /* Record number within block */
+                        int n; /* Records in this block */
                         int blk; /* Current block */
-                        blkno = (recno >> dpb->bsh);
-                        recblk = (recno & dpb->blm);
+                        blkno = (recno >> dk->dpb->bsh);
+                        n = recs - recno;
+                        if (n > SECTORS_PER_BLOCK)
+                                n = SECTORS_PER_BLOCK;
                         if (BIG_DISK)
                                 blk = dir->al[blkno * 2] + 256 * dir->al[blkno * 2 + 1];
                         else
                                 blk = dir->al[blkno];
                         if (blk) {
-                                getsect(buf, (blk << dpb->bsh) + recblk);
-                                fwrite(buf, SECTOR_SIZE, 1, f);
+                                getblock(dk, buf, blk, n);
+                                fwrite(buf, SECTOR_SIZE, n, f);
                         } else {
-                                fprintf(stderr, "allocation map ran out before cr count reached!\n");
+                                fprintf(dk->log, "allocation map ran out before cr count reached!\n");
                                 rtn = -1;
                                 break;
                         }
@@ -444,7 +751,7 @@ int read_file(char *filename, struct dirent *dir, FILE *f)
                         break;
                 } else {
                         ++exno;
-                        if (find_file(dir, filename, exno, 0)) {
+                        if (find_file(dk, dir, filename, exno, 0)) {
                                 /* fprintf(stderr, "can't find next extent!\n");
                                 rtn = -1; */
                                 /* This is normal for case where file is maximum extent size! */
@@ -452,39 +759,40 @@ int read_file(char *filename, struct dirent *dir, FILE *f)
                         }
                 }
         }
+        free(buf);
         return rtn;
 }
 
 /* cat a file */
 
-void cat(char *name)
+int cat(struct disk *dk, char *name)
 {
         struct dirent dir[1];
-        if (find_file(dir, name, 0, 0)) {
+        if (find_file(dk, dir, name, 0, 0)) {
                 printf("File '%s' not found\n", name);
-                exit(-1);
+                return -1;
         } else {
                 /* printf("Found file.  Sector of rib is %d\n", sector); */
-                read_file(name, dir, stdout);
+                return read_file(dk, name, dir, stdout);
         }
 }
 /* get a file from the disk */
 
-int get_file(char *atari_name, char *local_name)
+int get_file(struct disk *dk, char *atari_name, char *local_name)
 {
         struct dirent dir[1];
-        if (find_file(dir, atari_name, 0, 0)) {
+        if (find_file(dk, dir, atari_name, 0, 0)) {
                 printf("File '%s' not found\n", atari_name);
                 return -1;
         } else {
-                FILE *f = fopen(local_name, "w");
+                FILE *f = strcmp(local_name, "-") ? fopen(local_name, "w") : stdout;
                 if (!f) {
                         printf("Couldn't open local file '%s'\n", local_name);
                         return -1;
                 }
                 /* printf("Found file.  Sector of rib is %d\n", sector); */
-                read_file(atari_name, dir, f);
-                if (fclose(f)) {
+                read_file(dk, atari_name, dir, f);
+                if (f == stdout ? fflush(f) : fclose(f)) {
                         printf("Couldn't close local file '%s'\n", local_name);
                         return -1;
                 }
@@ -494,10 +802,10 @@ int get_file(char *atari_name, char *local_name)
 
 /* Delete file name */
 
-int rm(char *name, int ignore)
+int rm(struct disk *dk, char *name, int ignore)
 {
         struct dirent dir[1];
-        if (!find_file(dir, name, 0, 1)) {
+        if (!find_file(dk, dir, name, 0, 1)) {
                 return 0;
         } else {
                 if (!ignore)
@@ -508,42 +816,75 @@ int rm(char *name, int ignore)
 
 /* Free command */
 
-int do_free(void)
+int do_free(struct disk *dk)
 {
-        int amount = amount_free() * SECTORS_PER_BLOCK;
+        int amount = amount_free(dk) * SECTORS_PER_BLOCK;
         printf("%d free sectors, %d free bytes\n", amount, amount * SECTOR_SIZE);
         return 0;
 }
 
-/* Pre-allocate space for file */
+/* Find the first run of at least want free blocks from next_fit on,
+ * going round to the start of the disk.  Returns the first block, or
+ * -1 if there is no run that long. */
 
-int alloc_space(int *list, int blocks)
+int find_run(struct disk *dk, int want)
 {
-        while (blocks) {
-                int x = alloc_block(0xFFFD);
-                if (x == -1) {
-                        printf("Not enough space\n");
-                        return -1;
-                } else {
-                        *list++ = x;
+        int pass, blk, end;
+        for (pass = 0; pass != 2; ++pass) {
+                blk = pass ? 0 : dk->next_fit;
+                while ((blk = next_block(dk, blk, 0)) <= dk->dpb->dsm) {
+                        end = next_block(dk, blk, 1);
+                        if (end - blk >= want)
+                                return blk;
+                        blk = end;
                 }
+        }
+        return -1;
+}
+
+/* Pre-allocate space for file: in one run of blocks if there is one,
+ * otherwise in as few pieces as next fit gives */
+
+int alloc_space(struct disk *dk, int *list, int blocks)
+{
+        int blk;
+        if (!dk->alloc_map)
+                get_map(dk);
+        if (blocks > dk->free_blocks) {
+                printf("Not enough space\n");
+                return -1;
+        }
+        blk = find_run(dk, blocks);
+        if (blk == -1)
+                blk = dk->next_fit;
+        while (blocks) {
+                blk = next_block(dk, blk, 0);
+                if (blk > dk->dpb->dsm)
+                        blk = next_block(dk, 0, 0);
+                set_used(dk, blk, 0xFFFD);
+                *list++ = blk++;
                 --blocks;
         }
+        dk->next_fit = blk;
         return 0;
 }
 
+/* Give back the blocks of list */
+
+void free_space(struct disk *dk, int *list, int blocks)
+{
+        while (blocks--)
+                set_free(dk, *list++);
+}
+
 /* Write a directory entry */
 
-int write_dir(char *name, int extentno, int extent, int rc, int *al)
+int write_dir(struct disk *dk, char *name, int extentno, int extent, int rc, int *al)
 {
         int z, i;
-        struct dirent d[1];
-        unsigned char buf[SECTOR_SIZE];
-        int sect = extent / (SECTOR_SIZE / ENTRY_SIZE);
-        int ofst = extent % (SECTOR_SIZE / ENTRY_SIZE);
-        getsect(buf, sect);
+        struct dirent *d = DIR_ENTRY(extent);
         putname(d, name);
-        extentno *= (dpb->exm + 1);
+        extentno *= (dk->dpb->exm + 1);
         while (rc > 128) {
                 rc -= 128;
                 ++extentno;
@@ -554,137 +895,151 @@ int write_dir(char *name, int extentno, int extent, int rc, int *al)
         d->s2 = (extentno / 32);
         d->rc = rc;
         for (i = z = 0; z != 16; ++z) {
+                if (dk->alloc_map && al[i])
+                        dk->alloc_map[al[i]] = extent; /* Now owned by the entry */
                 if (BIG_DISK) {
                         d->al[z++] = al[i];
-                        d->al[z] = (al[i] >> 8);
+                        d->al[z] = (al[i++] >> 8);
                 } else {
                         d->al[z] = al[i++];
                 }
         }
         /* printf("%s uu=%d s1=%d s2=%d ex=%d rc=%d\n", getname(d), d->uu, d->s1, d->s2, d->ex, d->rc); */
-        memcpy(buf + ofst * ENTRY_SIZE, d, ENTRY_SIZE);
-        putsect(buf, sect);
+        index_entry(dk, extent);
+        dirty_entry(dk, extent);
         return 0;
 }
 
-/* Write a file */
+/* Count free directory entries */
+
+int free_entries(struct disk *dk)
+{
+        int x, n = 0;
+        for (x = 0; x != dk->dir_entries; ++x)
+                if (DIR_ENTRY(x)->uu == 0xE5)
+                        ++n;
+        return n;
+}
+
+/* Write a file from f, a block at a time.  sects is its size in sectors
+ * if that is known, so that the space for it can be checked and found
+ * in one run first, or -1 if it is not (a pipe). */
 
-int write_file(char *name, unsigned char *buf, long sects)
+int write_file(struct disk *dk, char *name, FILE *f, long sects)
 {
-        int x, z;
-        int *blk_list;
-        int *extent_list;
+        unsigned char *buf; /* One block */
         long blks; /* Number of blocks needed for this file */
-        long extents; /* Number of extents needed for this file */
+        size_t len;
         int rc; /* Counter for current extent */
-        int secno; /* Sector number within extent */
         int extent_blkno; /* Block number within extent */
         int extentno; /* Extent number of file */
-        int blkno; /* Block number */
+        int entry; /* Directory entry of current extent */
+        int blk;
+        int n; /* Sectors in current block */
+        int z;
         int al[16]; /* Allocation map for current extent */
+        int rtn = 0;
 
+        if (!dk->alloc_map)
+                get_map(dk);
 
-        /* Compute number of blocks needed for file */
-        blks = (sects + SECTORS_PER_BLOCK - 1) / SECTORS_PER_BLOCK;
-
-        /* Compute number of extents needed for file */
-        extents = ((blks * SECTORS_PER_BLOCK) + SECTORS_PER_EXTENT - 1) / SECTORS_PER_EXTENT;
-        /* Force at least one extent for case of empty file */
-        if (!extents)
-                extents = 1;
-
-        /* Allocate space for file */
-        blk_list = (int *)malloc(sizeof(int) * blks);
-        if (alloc_space(blk_list, blks))
-                return -1;
-
-        /* Allocate extents for file */
-        extent_list = (int *)malloc(sizeof(int) * extents);
-        if (alloc_extents(extent_list, extents))
-                return -1;
+        if (sects >= 0) {
+                /* Compute number of blocks needed for file */
+                blks = (sects + SECTORS_PER_BLOCK - 1) / SECTORS_PER_BLOCK;
+                if (blks > dk->free_blocks) {
+                        printf("Not enough space\n");
+                        return -1;
+                }
+                /* Extents needed, at least one for an empty file */
+                if ((blks ? (blks + BLOCKS_PER_EXTENT - 1) / BLOCKS_PER_EXTENT : 1) > free_entries(dk))
+                        return -1;
+                /* Start it where it fits in one piece, and make room for it in
+                   the image in one go */
+                blk = find_run(dk, blks);
+                if (blk != -1 && blks) {
+                        dk->next_fit = blk;
+                        n = sects - (blks - 1) * SECTORS_PER_BLOCK;
+                        if (dk->contig)
+                                grow_image(dk, sect_ofs(dk, (blk + blks - 1) << dk->dpb->bsh) + n * SECTOR_SIZE);
+                }
+        }
 
-        /* Write file */
+        buf = (unsigned char *)malloc(SECTOR_SIZE << dk->dpb->bsh);
         for (z = 0; z != 16; ++z)
                 al[z] = 0;
-        blkno = 0;
         extent_blkno = 0;
         extentno = 0;
-        secno = 0;
         rc = 0;
-        for (x = 0; x != sects; ++x) {
-                al[extent_blkno] = blk_list[blkno];
-                putsect(buf + x * SECTOR_SIZE, (blk_list[blkno] << dpb->bsh) + secno);
-                ++rc;
-                if (++secno == SECTORS_PER_BLOCK) {
-                        secno = 0;
-                        ++blkno;
-                        
-                        if (++extent_blkno == BLOCKS_PER_EXTENT) {
-                                /* Write current extent */
-                                write_dir(name, extentno, extent_list[extentno], rc, al);
-                                ++extentno;
-                                rc = 0;
-                                for (z = 0; z != 16; ++z)
-                                        al[z] = 0;
-                                extent_blkno = 0;
+        while ((len = fread(buf, 1, SECTOR_SIZE << dk->dpb->bsh, f)) != 0) {
+                n = (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+                /* Fill with ^Zs to end of sector */
+                memset(buf + len, 0x1a, n * SECTOR_SIZE - len);
+                if (alloc_space(dk, &blk, 1)) {
+                        rtn = -1;
+                        break;
+                }
+                al[extent_blkno++] = blk;
+                putblock(dk, buf, blk, n);
+                rc += n;
+                if (extent_blkno == BLOCKS_PER_EXTENT) {
+                        /* Write current extent */
+                        if (alloc_extents(dk, &entry, 1)) {
+                                rtn = -1;
+                                break;
                         }
+                        write_dir(dk, name, extentno, entry, rc, al);
+                        ++extentno;
+                        rc = 0;
+                        for (z = 0; z != 16; ++z)
+                                al[z] = 0;
+                        extent_blkno = 0;
                 }
+                if (len != (size_t)(SECTOR_SIZE << dk->dpb->bsh))
+                        break;
+        }
+        if (ferror(f)) {
+                printf("Couldn't read file\n");
+                rtn = -1;
         }
-        if (rc || !extentno) {
+        if (!rtn && (rc || !extentno)) {
                 /* Write final extent */
-                write_dir(name, extentno, extent_list[extentno], rc, al);
+                if (alloc_extents(dk, &entry, 1))
+                        rtn = -1;
+                else
+                        write_dir(dk, name, extentno, entry, rc, al);
         }
-        
-        return 0;
+        if (rtn) {
+                /* Give back what it had taken */
+                free_space(dk, al, extent_blkno);
+                rm(dk, name, 1);
+        }
+        free(buf);
+        return rtn;
 }
 
-/* Put a file on the disk */
+/* Put a file on the disk: local_name "-" is stdin */
 
-int put_file(char *local_name, char *atari_name)
+int put_file(struct disk *dk, char *local_name, char *atari_name)
 {
-        FILE *f = fopen(local_name, "r");
-        long x, size; /* File size in bytes */
-        long up; /* Size in bytes rounded up to sectors */
-        unsigned char *buf;
+        FILE *f = strcmp(local_name, "-") ? fopen(local_name, "r") : stdin;
+        struct stat st;
+        long sects = -1; /* File size in sectors, if known */
         int rtn;
         if (!f) {
                 printf("Couldn't open '%s'\n", local_name);
                 return -1;
         }
-        if (fseek(f, 0, SEEK_END)) {
-                printf("Couldn't get file size of '%s'\n", local_name);
-                fclose(f);
-                return -1;
-        }
-        size = ftell(f);
-        if (size < 0)  {
-                printf("Couldn't get file size of '%s'\n", local_name);
-                fclose(f);
-                return -1;
-        }
-        rewind(f);
-        /* Round up to a multiple of (SECTOR_SIZE) */
-        up = size + (SECTOR_SIZE) - 1;
-        up -= up % (SECTOR_SIZE);
-
-        buf = (unsigned char *)malloc(up);
-        if (fread(buf, 1, size, f) != (size_t)size) {
-                printf("Couldn't read file '%s'\n", local_name);
-                fclose(f);
-                free(buf);
-                return -1;
-        }
-        fclose(f);
-
-        /* Fill with ^Zs to end of sector */
-        for (x = size; x != up; ++x)
-                buf[x] = 0x1a;
+        if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode))
+                sects = (st.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
 
         /* Delete existing file */
-        rm(atari_name, 1);
+        rm(dk, atari_name, 1);
 
         /* Allocate space and write file */
-        rtn = write_file(atari_name, buf, up / SECTOR_SIZE);
+        rtn = write_file(dk, atari_name, f, sects);
+
+        if (f != stdin)
+                fclose(f);
 
         if (rtn) {
                 printf("Couldn't write file\n");
@@ -696,7 +1051,7 @@ int put_file(char *local_name, char *atari_name)
 
 /* Get file size in sectors */
 
-int get_info(struct dirent *dir, char *name)
+int get_info(struct disk *dk, struct dirent *dir, char *name)
 {
         int rtn = 0;
         int count = 0;
@@ -709,7 +1064,7 @@ int get_info(struct dirent *dir, char *name)
                 for (recno = 0; recno != RC(dir) && recno != SECTORS_PER_EXTENT; ++recno) {
                         int blkno; /* Block number within extent */
                         int blk; /* Current block */
-                        blkno = (recno >> dpb->bsh);
+                        blkno = (recno >> dk->dpb->bsh);
                         if (BIG_DISK)
                                 blk = dir->al[blkno * 2] + 256 * dir->al[blkno * 2 + 1];
                         else
@@ -718,7 +1073,7 @@ int get_info(struct dirent *dir, char *name)
                                 ++count;
                                 ++cnt;
                         } else {
-                                fprintf(stderr,"allocation map ran out before rc count reached! %d\n", recno);
+                                fprintf(dk->log,"allocation map ran out before rc count reached! %d\n", recno);
                                 rtn = -1;
                                 break;
                         }
@@ -729,7 +1084,7 @@ int get_info(struct dirent *dir, char *name)
                         break;
                 } else {
                         ++exno;
-                        if (find_file(dir, name, exno, 0)) {
+                        if (find_file(dk, dir, name, exno, 0)) {
                                 /* fprintf(stderr, "%s: can't find next extent (%d)!\n", name, exno);
                                 rtn = -1; */
                                 break;
@@ -742,91 +1097,94 @@ int get_info(struct dirent *dir, char *name)
                 return count;
 }
 
-void atari_dir(int all, int full, int single)
+void atari_dir(struct disk *dk, int all, int full, int single)
 {
-        unsigned char buf[SECTOR_SIZE];
         struct dirent dir[1];
         int x, y;
         int rows;
         int cols = (80 / 13);
-        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
-                int y;
-                getsect(buf, x + SECTOR_DIR);
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
-                        if (d->uu < 0x20 && EXTENT_NO(d) == 0) {
-                                struct name *nam;
-                                char *s = getname(d);
-                                nam = (struct name *)malloc(sizeof(struct name));
-                                nam->name = strdup(s);
-                                if (d->t[0] & 0x80)
-                                        nam->locked = 1;
-                                else
-                                        nam->locked = 0;
-                                if (d->t[1] & 0x80)
-                                        nam->is_sys = 1;
-                                else
-                                        nam->is_sys = 0;
-                                nam->sector = 0;
-                                nam->sects = 0;
-                                nam->load_start = -1;
-                                nam->load_size = -1;
-                                nam->init = -1;
-                                nam->run = -1;
-                                nam->size = -1;
-                                memcpy(dir, d, ENTRY_SIZE);
-                                nam->sects = get_info(dir, nam->name);
-                                nam->size = nam->sects * SECTOR_SIZE;
-
-                                if ((all || !nam->is_sys))
-                                        names[name_n++] = nam;
-                        }
+        /* Forget any earlier listing (in a batch) */
+        for (x = 0; x != dk->name_n; ++x) {
+                free(dk->names[x]->name);
+                free(dk->names[x]);
+        }
+        dk->name_n = 0;
+        if (!dk->names)
+                dk->names = (struct name **)malloc(sizeof(struct name *) * dk->dir_entries);
+        for (x = 0; x != dk->dir_entries; ++x) {
+                struct dirent *d = DIR_ENTRY(x);
+                if (d->uu < 0x20 && EXTENT_NO(d) == 0) {
+                        struct name *nam;
+                        char *s = getname(dk, d);
+                        nam = (struct name *)malloc(sizeof(struct name));
+                        nam->name = strdup(s);
+                        if (d->t[0] & 0x80)
+                                nam->locked = 1;
+                        else
+                                nam->locked = 0;
+                        if (d->t[1] & 0x80)
+                                nam->is_sys = 1;
+                        else
+                                nam->is_sys = 0;
+                        nam->sector = 0;
+                        nam->sects = 0;
+                        nam->load_start = -1;
+                        nam->load_size = -1;
+                        nam->init = -1;
+                        nam->run = -1;
+                        nam->size = -1;
+                        memcpy(dir, d, ENTRY_SIZE);
+                        nam->sects = get_info(dk, dir, nam->name);
+                        nam->size = nam->sects * SECTOR_SIZE;
+
+                        if ((all || !nam->is_sys))
+                                dk->names[dk->name_n++] = nam;
                 }
         }
-        qsort(names, name_n, sizeof(struct name *), (int (*)(const void *, const void *))comp);
+        qsort(dk->names, dk->name_n, sizeof(struct name *), (int (*)(const void *, const void *))comp);
 
         if (full) {
                 int totals = 0;
                 int total_bytes = 0;
                 printf("\n");
-                for (x = 0; x != name_n; ++x) {
-                        if (names[x]->load_start != -1)
+                for (x = 0; x != dk->name_n; ++x) {
+                        if (dk->names[x]->load_start != -1)
                                 printf("-r%c%c%c %6d (%3d) %-13s (load_start=$%x load_end=$%x)\n",
-                                       (names[x]->locked ? '-' : 'w'),
-                                       (names[x]->is_cm ? 'x' : '-'),
-                                       (names[x]->is_sys ? 's' : '-'),
-                                       names[x]->size, names[x]->sects, names[x]->name, names[x]->load_start, names[x]->load_start + names[x]->load_size - 1);
+                                       (dk->names[x]->locked ? '-' : 'w'),
+                                       (dk->names[x]->is_cm ? 'x' : '-'),
+                                       (dk->names[x]->is_sys ? 's' : '-'),
+                                       dk->names[x]->size, dk->names[x]->sects, dk->names[x]->name, dk->names[x]->load_start, dk->names[x]->load_start + dk->names[x]->load_size - 1);
                         else
                                 printf("-r%c%c%c %6d (%3d) %-13s\n",
-                                       (names[x]->locked ? '-' : 'w'),
-                                       (names[x]->is_cm ? 'x' : '-'),
-                                       (names[x]->is_sys ? 's' : '-'),
-                                       names[x]->size, names[x]->sects, names[x]->name);
-                        totals += names[x]->sects;
-                        total_bytes += names[x]->size;
-                }
-                printf("\n%d entries\n", name_n);
+                                       (dk->names[x]->locked ? '-' : 'w'),
+                                       (dk->names[x]->is_cm ? 'x' : '-'),
+                                       (dk->names[x]->is_sys ? 's' : '-'),
+                                       dk->names[x]->size, dk->names[x]->sects, dk->names[x]->name);
+                        totals += dk->names[x]->sects;
+                        total_bytes += dk->names[x]->size;
+                }
+                printf("\n%d entries\n", dk->name_n);
                 printf("\n%d sectors, %d bytes\n", totals, total_bytes);
                 printf("\n");
-                do_free();
+                do_free(dk);
                 printf("\n");
         } else if (single) {
                 int x;
-                for (x = 0; x != name_n; ++x) {
-                        printf("%s\n", names[x]->name);
+                for (x = 0; x != dk->name_n; ++x) {
+                        printf("%s\n", dk->names[x]->name);
                 }
         } else {
 
                 /* Rows of 12 names each ordered like ls */
 
-                rows = (name_n + cols - 1) / cols;
+                rows = (dk->name_n + cols - 1) / cols;
 
                 for (y = 0; y != rows; ++y) {
                         for (x = 0; x != cols; ++x) {
                                 int n = y + x * rows;
                                 /* printf("%11d  ", n); */
-                                if (n < name_n)
-                                        printf("%-12s  ", names[n]->name);
+                                if (n < dk->name_n)
+                                        printf("%-12s  ", dk->names[n]->name);
                                 else
                                         printf("             ");
                         }
@@ -835,84 +1193,1010 @@ void atari_dir(int all, int full, int single)
         }
 }
 
-int mkfs()
+/* Use the geometry in the image header if there is one */
+
+int read_header(struct disk *dk)
 {
         unsigned char buf[SECTOR_SIZE];
-        int tracks, x, n;
-        for (x = 0; x != SECTOR_SIZE; ++x)
-	        buf[x] = 0xe5;
-        tracks = dpb->off + (((dpb->dsm + 1) << dpb->bsh) + dpb->spt - 1) / dpb->spt;
-        n = tracks * dpb->spt;
-        printf("%d tracks\n", tracks);
-        printf("%d sectors\n", n);
-        for (x = 0; x != n; ++x)
-                fwrite((char *)buf, SECTOR_SIZE, 1, disk);
-        return 0;
+        unsigned char *p = buf + DISK_MAGIC_LEN;
+        fseek(dk->disk, 0, SEEK_SET);
+        if (fread((char *)buf, SECTOR_SIZE, 1, dk->disk) != 1 || memcmp(buf, DISK_MAGIC, DISK_MAGIC_LEN))
+                return 0;
+        dk->dpb_img.spt = p[CPM_WORD_DPB_SPT] + (p[CPM_WORD_DPB_SPT + 1] << 8);
+        dk->dpb_img.bsh = p[CPM_BYTE_DPB_BSH];
+        dk->dpb_img.blm = p[CPM_BYTE_DPB_BLM];
+        dk->dpb_img.exm = p[CPM_BYTE_DPB_EXM];
+        dk->dpb_img.dsm = p[CPM_WORD_DPB_DSM] + (p[CPM_WORD_DPB_DSM + 1] << 8);
+        dk->dpb_img.drm = p[CPM_WORD_DPB_DRM] + (p[CPM_WORD_DPB_DRM + 1] << 8);
+        dk->dpb_img.al0 = p[CPM_BYTE_DPB_AL0];
+        dk->dpb_img.al1 = p[CPM_BYTE_DPB_AL1];
+        dk->dpb_img.cks = p[CPM_WORD_DPB_CKS];
+        dk->dpb_img.off = p[CPM_WORD_DPB_OFF] + (p[CPM_WORD_DPB_OFF + 1] << 8);
+        if (dk->dpb_img.spt == 0 || dk->dpb_img.off == 0 || dk->dpb_img.bsh < 3 || dk->dpb_img.bsh > 7) {
+                fprintf(dk->log, "ignoring bad disk header\n");
+                return 0;
+        }
+        dk->dpb = &dk->dpb_img;
+        return 1;
 }
 
-int main(int argc, char *argv[])
+/* Geometry for mkfs: fd, hd, or sectors/track, block size, blocks,
+ * directory entries and reserved tracks separated by commas, as in a
+ * cpm --disks file.  The last is given in an image header.  The limits
+ * are those cpm checks, so that cpm can use the image: blocks are
+ * limited by the room for cpm's allocation vector. */
+
+#define MAX_BLOCKS 33888
+
+int set_dpb(struct disk *dk, char *s)
 {
-        int all = 0;
-        int full = 0;
-        int single = 0;
-	int x;
-	long size;
-	char *disk_name;
-	dpb = &dpb_fd;
-	x = 1;
-	if (x == argc || !strcmp(argv[x], "--help") || !strcmp(argv[x], "-h")) {
-                printf("\nCP/M disk image tool\n");
-                printf("\n");
-                printf("Syntax: cpmtool path-to-disk-image [command] [args]\n");
-                printf("\n");
-                printf("  Commands: (default is ls)\n\n");
-                printf("      ls [-la1]                     Directory listing\n");
-                printf("                  -l for long\n");
-                printf("                  -a to show system files\n");
-                printf("                  -1 to show a single name per line\n\n");
-                printf("      cat cpm-name                  Type file to console\n\n");
-                printf("      get cpm-name [local-name]     Copy file from diskette to local-name\n\n");
-                printf("      put local-name [cpm-name]     Copy file from local-name to diskette\n\n");
-                printf("      free                          Print amount of free space\n\n");
-                printf("      rm cpm-name                   Delete a file\n\n");
-                printf("      mkfs                          Format disk\n\n");
+        unsigned long spt, bs, blocks, entries, off;
+        int bsh, dirblks, x;
+        char c;
+        if (!strcmp(s, "fd")) {
+                dk->dpb = &dpb_fd;
+                return 0;
+        }
+        if (!strcmp(s, "hd")) {
+                dk->dpb = &dpb_hd;
+                return 0;
+        }
+        if (sscanf(s, "%lu,%lu,%lu,%lu,%lu%c", &spt, &bs, &blocks, &entries, &off, &c) != 5) {
+                printf("Geometry should be fd, hd or sectors/track,blocksize,blocks,direntries,reservedtracks\n");
                 return -1;
-	}
-	disk_name = argv[x++];
+        }
+        for (bsh = 3; bsh != 8 && (SECTOR_SIZE << bsh) != (long)bs; ++bsh)
+                ;
+        dirblks = (entries * ENTRY_SIZE + bs - 1) / bs;
+        if (spt < 1 || spt > 0xFFFF) {
+                printf("Bad number of sectors per track\n");
+        } else if (bsh == 8) {
+                printf("Block size must be 1024, 2048, 4096, 8192 or 16384\n");
+        } else if (blocks < 2 || blocks > MAX_BLOCKS) {
+                printf("Number of blocks must be 2 to %d\n", MAX_BLOCKS);
+        } else if (bsh == 3 && blocks > 256) {
+                printf("1K blocks are only allowed on drives of up to 256 blocks\n");
+        } else if (entries < 4 || entries > 4096 || entries % 4) {
+                printf("Directory entries must be a multiple of 4 up to 4096\n");
+        } else if (dirblks > 16 || dirblks >= (long)blocks) {
+                printf("Directory does not fit in 16 blocks\n");
+        } else if (off < 1 || off > 0xFFFF) {
+                printf("There must be a reserved track for the header\n");
+        } else {
+                memset(&dk->dpb_img, 0, sizeof(dk->dpb_img));
+                dk->dpb_img.spt = spt;
+                dk->dpb_img.bsh = bsh;
+                dk->dpb_img.blm = (1 << bsh) - 1;
+                dk->dpb_img.exm = (1 << (bsh - (blocks > 256 ? 4 : 3))) - 1;
+                dk->dpb_img.dsm = blocks - 1;
+                dk->dpb_img.drm = entries - 1;
+                for (x = 0; x != dirblks; ++x)
+                        if (x < 8)
+                                dk->dpb_img.al0 |= (0x80 >> x);
+                        else
+                                dk->dpb_img.al1 |= (0x80 >> (x - 8));
+                dk->dpb_img.off = off;
+                dk->dpb = &dk->dpb_img;
+                return 0;
+        }
+        return -1;
+}
 
-	if (x != argc && !strcmp(argv[x], "mkfs")) {
-	        disk = fopen(disk_name, "w");
-	        if (!disk) {
-	                printf("Couldn't open '%s'\n", disk_name);
-	                return -1;
-	        }
-	        mkfs();
-	        fclose(disk);
-	        return 0;
-	}
+/* Format the disk: every sector 0xE5, written a chunk at a time.  If
+ * sparse, only the reserved tracks and the directory are written, and the
+ * rest of the image is left as a hole (it reads as zeros, which is fine
+ * for data).  A geometry from set_dpb() is written into the first
+ * reserved sector. */
 
-	disk = fopen(disk_name, "r+");
-	if (!disk) {
-	        printf("Couldn't open '%s'\n", disk_name);
-	        return -1;
-	}
-	if (fseek(disk, 0, SEEK_END)) {
-	        printf("Couldn't seek disk?\n");
-	        return -1;
-	}
-	size = ftell(disk);
-	if (size == 128 * 77 * 26) { /* Single sided floppy */
-	        dpb = &dpb_fd;
-	} else {
-	        fprintf(stderr, "assuming hard drive\n");
-	        dpb = &dpb_hd;
-	}
+#define MKFS_CHUNK 65536
 
-	/* Directory options */
-	dir:
-	while (x != argc && argv[x][0] == '-') {
-	        int y;
-	        for (y = 1;argv[x][y];++y) {
+int mkfs(struct disk *dk, int sparse)
+{
+        unsigned char *buf = (unsigned char *)malloc(MKFS_CHUNK);
+        long len, ofs, n;
+        int tracks;
+        int rtn = 0;
+        memset(buf, 0xE5, MKFS_CHUNK);
+        tracks = dk->dpb->off + (((dk->dpb->dsm + 1) << dk->dpb->bsh) + dk->dpb->spt - 1) / dk->dpb->spt;
+        len = (long)tracks * dk->dpb->spt * SECTOR_SIZE;
+        printf("%d tracks\n", tracks);
+        printf("%ld sectors\n", len / SECTOR_SIZE);
+        n = len;
+        if (sparse) {
+                /* Up to the end of the track the directory ends in */
+                n = dk->dpb->off + (SECTOR_DIR_SIZE + dk->dpb->spt - 1) / dk->dpb->spt;
+                n *= (long)dk->dpb->spt * SECTOR_SIZE;
+        }
+        if (dk->dpb == &dk->dpb_img) {
+                unsigned char *p = buf + DISK_MAGIC_LEN;
+                memset(buf, 0, SECTOR_SIZE);
+                memcpy(buf, DISK_MAGIC, DISK_MAGIC_LEN);
+                p[CPM_WORD_DPB_SPT] = dk->dpb->spt;
+                p[CPM_WORD_DPB_SPT + 1] = (dk->dpb->spt >> 8);
+                p[CPM_BYTE_DPB_BSH] = dk->dpb->bsh;
+                p[CPM_BYTE_DPB_BLM] = dk->dpb->blm;
+                p[CPM_BYTE_DPB_EXM] = dk->dpb->exm;
+                p[CPM_WORD_DPB_DSM] = dk->dpb->dsm;
+                p[CPM_WORD_DPB_DSM + 1] = (dk->dpb->dsm >> 8);
+                p[CPM_WORD_DPB_DRM] = dk->dpb->drm;
+                p[CPM_WORD_DPB_DRM + 1] = (dk->dpb->drm >> 8);
+                p[CPM_BYTE_DPB_AL0] = dk->dpb->al0;
+                p[CPM_BYTE_DPB_AL1] = dk->dpb->al1;
+                p[CPM_WORD_DPB_OFF] = dk->dpb->off;
+                p[CPM_WORD_DPB_OFF + 1] = (dk->dpb->off >> 8);
+        }
+        for (ofs = 0; ofs < n && !rtn; ofs += MKFS_CHUNK) {
+                long amount = (n - ofs < MKFS_CHUNK ? n - ofs : MKFS_CHUNK);
+                if (fwrite((char *)buf, amount, 1, dk->disk) != 1)
+                        rtn = -1;
+                if (!ofs)
+                        memset(buf, 0xE5, SECTOR_SIZE);
+        }
+        if (!rtn && n != len && (fflush(dk->disk) || ftruncate(fileno(dk->disk), len)))
+                rtn = -1;
+        free(buf);
+        return rtn;
+}
+
+/* Does CP/M name match pattern, with * and ? wildcards? */
+
+int wild(char *s)
+{
+        return strchr(s, '*') || strchr(s, '?');
+}
+
+int match_part(char *pat, char *pat_end, char *name, char *name_end)
+{
+        for (; pat != pat_end; ++pat, ++name) {
+                if (*pat == '*') {
+                        do {
+                                if (match_part(pat + 1, pat_end, name, name_end))
+                                        return 1;
+                        } while (name++ != name_end);
+                        return 0;
+                } else if (name == name_end || (*pat != '?' && lower(*pat) != *name)) {
+                        return 0;
+                }
+        }
+        return name == name_end;
+}
+
+/* A pattern with a '.' matches the name and type separately, as CP/M
+ * does, so that "*.*" and "*." match a name with no type. */
+
+int match(char *pat, char *name)
+{
+        char *pat_dot = strchr(pat, '.');
+        char *name_dot = strchr(name, '.');
+        char *name_end = name + strlen(name);
+        if (!pat_dot)
+                return match_part(pat, pat + strlen(pat), name, name_end);
+        if (!name_dot)
+                name_dot = name_end;
+        return match_part(pat, pat_dot, name, name_dot) &&
+               match_part(pat_dot + 1, pat_dot + strlen(pat_dot), name_dot + (*name_dot == '.'), name_end);
+}
+
+/* Names of the files matching pattern, sorted, or NULL if none */
+
+char **find_files(struct disk *dk, char *pat, int *n)
+{
+        char **list = (char **)malloc(sizeof(char *) * dk->dir_entries);
+        int x;
+        *n = 0;
+        for (x = 0; x != dk->dir_entries; ++x) {
+                struct dirent *d = DIR_ENTRY(x);
+                if (d->uu < 0x20 && EXTENT_NO(d) == 0 && match(pat, getname(dk, d)))
+                        list[(*n)++] = strdup(getname(dk, d));
+        }
+        if (!*n) {
+                free(list);
+                return NULL;
+        }
+        qsort(list, *n, sizeof(char *), (int (*)(const void *, const void *))comp_str);
+        return list;
+}
+
+void free_list(char **list, int n)
+{
+        while (n--)
+                free(list[n]);
+        free(list);
+}
+
+/* Can a name from the disk be used as a local file name in a directory?
+ * It comes from the image, so it must not lead out of it. */
+
+int safe_name(char *name)
+{
+        return *name && !strchr(name, '/') && strcmp(name, ".") && strcmp(name, "..");
+}
+
+/* Get each file matching pattern into directory dir */
+
+int get_files(struct disk *dk, char *pat, char *dir)
+{
+        char **list;
+        char *local;
+        int n, x;
+        int rtn = 0;
+        list = find_files(dk, pat, &n);
+        if (!list) {
+                printf("No files match '%s'\n", pat);
+                return -1;
+        }
+        for (x = 0; x != n; ++x) {
+                if (!safe_name(list[x])) {
+                        printf("Skipping unsafe name '%s'\n", list[x]);
+                        rtn = -1;
+                        continue;
+                }
+                local = (char *)malloc(strlen(dir) + strlen(list[x]) + 2);
+                sprintf(local, "%s/%s", dir, list[x]);
+                printf("%s\n", list[x]);
+                if (get_file(dk, list[x], local))
+                        rtn = -1;
+                free(local);
+        }
+        free_list(list, n);
+        return rtn;
+}
+
+/* Put local file as atari_name, or under its own name if that is NULL */
+
+int put_one(struct disk *dk, char *local_name, char *atari_name)
+{
+        char *base;
+        if (strrchr(local_name, '/'))
+                base = strrchr(local_name, '/') + 1;
+        else
+                base = local_name;
+        if (!strcmp(local_name, "-")) {
+                if (!atari_name) {
+                        printf("Missing cpm-name to put stdin as\n");
+                        return -1;
+                }
+                base = atari_name;
+        }
+        printf("%s\n", base);
+        return put_file(dk, local_name, atari_name ? atari_name : base);
+}
+
+/* Put the local files matching a wildcard */
+
+int put_glob(struct disk *dk, char *pat)
+{
+        glob_t g;
+        size_t x;
+        int rtn = 0;
+        if (glob(pat, 0, NULL, &g)) {
+                printf("No files match '%s'\n", pat);
+                return -1;
+        }
+        for (x = 0; x != g.gl_pathc; ++x)
+                if (put_one(dk, g.gl_pathv[x], NULL))
+                        rtn = -1;
+        globfree(&g);
+        return rtn;
+}
+
+/* Delete the files matching pattern */
+
+int rm_files(struct disk *dk, char *pat)
+{
+        char **list;
+        int n, x;
+        if (!wild(pat))
+                return rm(dk, pat, 0);
+        list = find_files(dk, pat, &n);
+        if (!list) {
+                printf("No files match '%s'\n", pat);
+                return -1;
+        }
+        for (x = 0; x != n; ++x)
+                rm(dk, list[x], 1);
+        free_list(list, n);
+        return 0;
+}
+
+/* Blocks of a file in order, and its size in sectors, or NULL if it is
+ * not there or its allocation runs out early */
+
+int *file_blocks(struct disk *dk, char *name, long *nblks, long *sects)
+{
+        int *list = NULL;
+        long size = 0;
+        int ex, n, recno, recs, blk;
+        int found = 0;
+        *nblks = *sects = 0;
+        for (ex = 0; (n = find_entry(dk, name, ex)) != -1; ++ex) {
+                struct dirent *d = DIR_ENTRY(n);
+                int *l;
+                found = 1;
+                recs = RC(d);
+                if (recs > SECTORS_PER_EXTENT)
+                        recs = SECTORS_PER_EXTENT;
+                for (recno = 0; recno < recs; recno += SECTORS_PER_BLOCK) {
+                        int blkno = (recno >> dk->dpb->bsh);
+                        if (BIG_DISK)
+                                blk = d->al[blkno * 2] + 256 * d->al[blkno * 2 + 1];
+                        else
+                                blk = d->al[blkno];
+                        if (!blk || blk > dk->dpb->dsm) {
+                                free(list);
+                                return NULL;
+                        }
+                        if (*nblks == size) {
+                                size = size ? size * 2 : 64;
+                                l = (int *)realloc(list, sizeof(int) * size);
+                                if (!l) {
+                                        free(list);
+                                        return NULL;
+                                }
+                                list = l;
+                        }
+                        list[(*nblks)++] = blk;
+                }
+                *sects += recs;
+                if (recs != SECTORS_PER_EXTENT)
+                        break;
+        }
+        if (!found)
+                return NULL;
+        if (!list)
+                list = (int *)malloc(sizeof(int));
+        return list;
+}
+
+/* Compare local file f with the file of blocks list (sects sectors long)
+ * block by block, padding f with ^Zs as put does.  If update is set,
+ * blocks which differ are written from f.  Returns the number of blocks
+ * which differ. */
+
+long compare_blocks(struct disk *dk, FILE *f, int *list, long nblks, long sects, int update)
+{
+        unsigned char *mine = (unsigned char *)malloc(SECTOR_SIZE << dk->dpb->bsh);
+        unsigned char *theirs = (unsigned char *)malloc(SECTOR_SIZE << dk->dpb->bsh);
+        long x, differ = 0;
+        int n;
+        size_t len;
+        for (x = 0; x != nblks; ++x) {
+                n = sects - x * SECTORS_PER_BLOCK;
+                if (n > SECTORS_PER_BLOCK)
+                        n = SECTORS_PER_BLOCK;
+                len = fread(theirs, 1, n * SECTOR_SIZE, f);
+                memset(theirs + len, 0x1a, n * SECTOR_SIZE - len);
+                getblock(dk, mine, list[x], n);
+                if (memcmp(mine, theirs, n * SECTOR_SIZE)) {
+                        ++differ;
+                        if (update)
+                                putblock(dk, theirs, list[x], n);
+                        else
+                                break;
+                }
+        }
+        free(mine);
+        free(theirs);
+        return differ;
+}
+
+/* Name as getname() gives it */
+
+char *lower_name(struct disk *dk, char *name)
+{
+        char *s = dk->lowbuf;
+        int x;
+        for (x = 0; name[x] && x != sizeof(dk->lowbuf) - 1; ++x)
+                s[x] = lower(name[x]);
+        s[x] = 0;
+        return s;
+}
+
+/* Can host name be a CP/M name as it is? */
+
+int cpm_name(struct disk *dk, char *name)
+{
+        struct dirent d[1];
+        char *s = name;
+        char *c;
+        putname(d, name);
+        for (c = getname(dk, d); *s; ++s, ++c)
+                if (lower(*s) != *c)
+                        return 0;
+        return !*c;
+}
+
+/* Copy the files in local directory dir which are not the same on the
+ * disk.  A file of the same size is updated a block at a time. */
+
+int sync_in(struct disk *dk, char *dir)
+{
+        glob_t g;
+        size_t x;
+        char *pat = (char *)malloc(strlen(dir) + 3);
+        int rtn = 0;
+        long same = 0, copied = 0;
+        sprintf(pat, "%s/*", dir);
+        if (glob(pat, 0, NULL, &g)) {
+                printf("No files in '%s'\n", dir);
+                free(pat);
+                return -1;
+        }
+        free(pat);
+        for (x = 0; x != g.gl_pathc; ++x) {
+                char *path = g.gl_pathv[x];
+                char *name = strrchr(path, '/') + 1;
+                struct stat st;
+                int *list;
+                long nblks, sects;
+                if (stat(path, &st) || !S_ISREG(st.st_mode))
+                        continue;
+                if (!cpm_name(dk, name)) {
+                        printf("Skipping '%s': not a CP/M name\n", path);
+                        continue;
+                }
+                list = file_blocks(dk, lower_name(dk, name), &nblks, &sects);
+                if (list && sects == (st.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE) {
+                        FILE *f = fopen(path, "r");
+                        long differ;
+                        if (!f) {
+                                printf("Couldn't open '%s'\n", path);
+                                rtn = -1;
+                        } else {
+                                differ = compare_blocks(dk, f, list, nblks, sects, 1);
+                                fclose(f);
+                                if (differ) {
+                                        printf("%s: %ld of %ld blocks\n", name, differ, nblks);
+                                        ++copied;
+                                } else {
+                                        ++same;
+                                }
+                        }
+                } else {
+                        printf("%s\n", name);
+                        if (put_file(dk, path, lower_name(dk, name)))
+                                rtn = -1;
+                        ++copied;
+                }
+                free(list);
+        }
+        globfree(&g);
+        printf("%ld copied, %ld the same\n", copied, same);
+        return rtn;
+}
+
+/* Copy the files on the disk which are not the same in local directory
+ * dir */
+
+int sync_out(struct disk *dk, char *dir)
+{
+        char **files;
+        int n, x;
+        int rtn = 0;
+        long same = 0, copied = 0;
+        files = find_files(dk, "*", &n);
+        for (x = 0; x != n; ++x) {
+                char *path;
+                struct stat st;
+                int *list;
+                long nblks, sects;
+                int differ = 1;
+                if (!safe_name(files[x])) {
+                        printf("Skipping unsafe name '%s'\n", files[x]);
+                        rtn = -1;
+                        continue;
+                }
+                path = (char *)malloc(strlen(dir) + strlen(files[x]) + 2);
+                sprintf(path, "%s/%s", dir, files[x]);
+                list = file_blocks(dk, files[x], &nblks, &sects);
+                if (list && !stat(path, &st) && S_ISREG(st.st_mode) && st.st_size == sects * SECTOR_SIZE) {
+                        FILE *f = fopen(path, "r");
+                        if (f) {
+                                differ = compare_blocks(dk, f, list, nblks, sects, 0) != 0;
+                                fclose(f);
+                        }
+                }
+                if (differ) {
+                        printf("%s\n", files[x]);
+                        if (get_file(dk, files[x], path))
+                                rtn = -1;
+                        ++copied;
+                } else {
+                        ++same;
+                }
+                free(list);
+                free(path);
+        }
+        if (files)
+                free_list(files, n);
+        printf("%ld copied, %ld the same\n", copied, same);
+        return rtn;
+}
+
+/* Block z of an entry's allocation list */
+
+int entry_block(struct disk *dk, struct dirent *d, int z)
+{
+        if (BIG_DISK)
+                return d->al[z * 2] + 256 * d->al[z * 2 + 1];
+        else
+                return d->al[z];
+}
+
+void set_entry_block(struct disk *dk, struct dirent *d, int z, int blk)
+{
+        if (BIG_DISK) {
+                d->al[z * 2] = blk;
+                d->al[z * 2 + 1] = (blk >> 8);
+        } else {
+                d->al[z] = blk;
+        }
+}
+
+/* Set the record count of an entry: the low bits of ex say how many
+ * logical extents before the last are full */
+
+void set_rc(struct disk *dk, struct dirent *d, int recs)
+{
+        int lx = recs ? (recs - 1) / 128 : 0;
+        d->ex = (d->ex & ~dk->dpb->exm) | lx;
+        d->rc = recs - 128 * lx;
+}
+
+/* Can't be typed at the CCP */
+
+int bad_name(struct dirent *d)
+{
+        int x;
+        if ((d->f[0] & 0x7F) == ' ')
+                return 1;
+        for (x = 0; x != 11; ++x) {
+                int c = (x < 8 ? d->f[x] : d->t[x - 8]) & 0x7F;
+                if (c < ' ' || c == 0x7F || strchr("*?.,:;<=>[]|", c))
+                        return 1;
+        }
+        return 0;
+}
+
+/* Like find_entry(), but in one user area */
+
+int find_user_entry(struct disk *dk, char *name, int user, int ex)
+{
+        int n;
+        for (n = dk->dir_hash[hash_name(dk, name, ex)]; n != -1; n = dk->dir_next[n])
+                if (DIR_ENTRY(n)->uu == user && EXTENT_NO(DIR_ENTRY(n)) == ex && !strcmp(getname(dk, DIR_ENTRY(n)), name))
+                        return n;
+        return -1;
+}
+
+void delete_entry(struct disk *dk, int n)
+{
+        if (DIR_ENTRY(n)->uu < 0x20)
+                unindex_entry(dk, n);
+        DIR_ENTRY(n)->uu = 0xE5;
+        dirty_entry(dk, n);
+}
+
+struct fsck_stats {
+        int files;
+        int used; /* Blocks in files */
+        int orphaned; /* Blocks in extents no file reaches */
+        int problems;
+        int repaired;
+        int bad_names; /* Problems which are only names */
+};
+
+/* Check the directory in memory, reporting each problem to dk->log:
+ *   entries with a bad user number or name,
+ *   record counts past the blocks allocated, or blocks past the record
+ *   count,
+ *   blocks off the disk or used twice,
+ *   extents which can't be reached from extent 0 by way of full
+ *   extents, as read_file() goes, and the blocks they hold.
+ * With repair, an entry is cut short at its first bad block, blocks past
+ * its record count are let go, and entries with a bad user number or
+ * which can't be reached are deleted.  Names are left alone. */
+
+void fsck(struct disk *dk, int repair, struct fsck_stats *st)
+{
+        int *owner = (int *)malloc(sizeof(int) * (dk->dpb->dsm + 1)); /* -1 free, -2 directory, else entry no. */
+        unsigned char *reached = (unsigned char *)calloc(dk->dir_entries, 1);
+        int *good = (int *)malloc(sizeof(int) * dk->dir_entries); /* Records left after any repair */
+        char name[50];
+        int n, x, z;
+        memset(st, 0, sizeof(*st));
+        for (x = 0; x != dk->dpb->dsm + 1; ++x)
+                owner[x] = -1;
+        for (x = 0; x != dir_blocks(dk); ++x)
+                owner[x] = -2;
+
+        /* Each entry by itself */
+        for (n = 0; n != dk->dir_entries; ++n) {
+                struct dirent *d = DIR_ENTRY(n);
+                int recs, needed, cut, extra;
+                if (d->uu == 0xE5 || d->uu == 0x20 || d->uu == 0x21) /* Free, label or date stamps */
+                        continue;
+                if (d->uu > 0x21) {
+                        fprintf(dk->log, "Entry %d: bad user number %d\n", n, d->uu);
+                        ++st->problems;
+                        if (repair) {
+                                delete_entry(dk, n);
+                                ++st->repaired;
+                        }
+                        continue;
+                }
+                strcpy(name, getname(dk, d));
+                if (bad_name(d)) {
+                        fprintf(dk->log, "Entry %d: bad file name '%s'\n", n, name);
+                        ++st->problems;
+                        ++st->bad_names;
+                }
+                recs = RC(d);
+                needed = (recs + SECTORS_PER_BLOCK - 1) >> dk->dpb->bsh;
+                if (needed > BLOCKS_PER_EXTENT)
+                        needed = BLOCKS_PER_EXTENT;
+                good[n] = recs;
+                cut = -1;
+                for (z = 0; z != needed; ++z) {
+                        int blk = entry_block(dk, d, z);
+                        if (!blk) {
+                                fprintf(dk->log, "Entry %d (%s): record count %d is past its %d blocks\n", n, name, recs, z);
+                        } else if (blk > dk->dpb->dsm) {
+                                fprintf(dk->log, "Entry %d (%s): block %d is off the disk\n", n, name, blk);
+                        } else if (owner[blk] == -2) {
+                                fprintf(dk->log, "Entry %d (%s): block %d is in the directory\n", n, name, blk);
+                        } else if (owner[blk] != -1) {
+                                fprintf(dk->log, "Entry %d (%s): block %d is also used by entry %d\n", n, name, blk, owner[blk]);
+                        } else {
+                                owner[blk] = n;
+                                ++st->used;
+                                continue;
+                        }
+                        cut = z;
+                        good[n] = z << dk->dpb->bsh;
+                        ++st->problems;
+                        if (repair) {
+                                set_rc(dk, d, z << dk->dpb->bsh);
+                                dirty_entry(dk, n);
+                                ++st->repaired;
+                        }
+                        break;
+                }
+                if (cut == -1 && recs > SECTORS_PER_EXTENT) {
+                        fprintf(dk->log, "Entry %d (%s): record count %d is more than an extent holds\n", n, name, recs);
+                        good[n] = SECTORS_PER_EXTENT;
+                        ++st->problems;
+                        if (repair) {
+                                set_rc(dk, d, SECTORS_PER_EXTENT);
+                                dirty_entry(dk, n);
+                                ++st->repaired;
+                        }
+                }
+                /* Blocks after the cut or the record count */
+                for (z = (cut == -1 ? needed : cut), extra = 0; z != BLOCKS_PER_EXTENT; ++z)
+                        if (entry_block(dk, d, z)) {
+                                ++extra;
+                                if (repair) {
+                                        set_entry_block(dk, d, z, 0);
+                                        dirty_entry(dk, n);
+                                }
+                        }
+                if (extra && cut == -1) {
+                        fprintf(dk->log, "Entry %d (%s): %d blocks past record count %d\n", n, name, extra, recs);
+                        ++st->problems;
+                        if (repair)
+                                ++st->repaired;
+                }
+        }
+
+        /* Follow each file's extents */
+        for (n = 0; n != dk->dir_entries; ++n) {
+                struct dirent *d = DIR_ENTRY(n);
+                int m, ex;
+                if (d->uu >= 0x20 || EXTENT_NO(d) != 0)
+                        continue;
+                strcpy(name, getname(dk, d));
+                if (find_user_entry(dk, name, d->uu, 0) != n)
+                        continue; /* A second extent 0 */
+                ++st->files;
+                for (m = n, ex = 0; m != -1 && good[m] == SECTORS_PER_EXTENT; m = find_user_entry(dk, name, d->uu, ++ex))
+                        reached[m] = 1;
+                if (m != -1)
+                        reached[m] = 1;
+        }
+
+        /* What they don't reach */
+        for (n = 0; n != dk->dir_entries; ++n) {
+                struct dirent *d = DIR_ENTRY(n);
+                int blks = 0;
+                int first;
+                if (d->uu >= 0x20 || reached[n])
+                        continue;
+                strcpy(name, getname(dk, d));
+                for (z = 0; z != BLOCKS_PER_EXTENT; ++z) {
+                        int blk = entry_block(dk, d, z);
+                        if (blk && blk <= dk->dpb->dsm && owner[blk] == n) {
+                                ++blks;
+                                --st->used;
+                        }
+                }
+                first = find_user_entry(dk, name, d->uu, EXTENT_NO(d));
+                if (first != n)
+                        fprintf(dk->log, "Entry %d (%s extent %d): same as entry %d, orphaning %d blocks\n", n, name, EXTENT_NO(d), first, blks);
+                else
+                        fprintf(dk->log, "Entry %d (%s extent %d): can't be reached from extent 0, orphaning %d blocks\n", n, name, EXTENT_NO(d), blks);
+                st->orphaned += blks;
+                ++st->problems;
+                if (repair) {
+                        delete_entry(dk, n);
+                        ++st->repaired;
+                }
+        }
+
+        dk->problems += st->problems - st->repaired;
+        if (repair && st->repaired && dk->alloc_map) {
+                /* Work it out again when next needed */
+                free(dk->alloc_map);
+                free(dk->free_map);
+                dk->alloc_map = NULL;
+                dk->free_map = NULL;
+        }
+        free(owner);
+        free(reached);
+        free(good);
+}
+
+int open_disk(struct disk *dk, char *name, int readonly);
+void close_disk(struct disk *dk);
+
+/* Sector sect of the image being built in memory, growing it (as
+ * formatted) if it is past the end */
+
+unsigned char *new_sect(struct disk *dk, unsigned char **buf, long *len, int sect)
+{
+        long ofs = sect_ofs(dk, sect);
+        if (ofs + SECTOR_SIZE > *len) {
+                *buf = (unsigned char *)realloc(*buf, ofs + SECTOR_SIZE);
+                memset(*buf + *len, 0xE5, ofs + SECTOR_SIZE - *len);
+                *len = ofs + SECTOR_SIZE;
+        }
+        return *buf + ofs;
+}
+
+/* Rewrite the image with each file in one run of blocks, in the order
+ * the files are in the directory, and the directory entries packed at
+ * its start.  CP/M 3 date stamps (every fourth entry) go with their
+ * entries.  The new image is made in memory, written to a temporary
+ * file next to the old one, and renamed over it, so the image is never
+ * left half done.  The directory must be clean (see fsck).  Old data
+ * sectors of zeros are left alone rather than formatted, and zeros are
+ * written as holes, so a --sparse image stays sparse. */
+
+#define HOLE_CHUNK 4096
+
+/* Write an image, seeking over chunks of zeros instead of writing them */
+
+int write_sparse(FILE *f, unsigned char *buf, long len)
+{
+        long ofs, n, x;
+        for (ofs = 0; ofs < len; ofs += n) {
+                n = (len - ofs < HOLE_CHUNK ? len - ofs : HOLE_CHUNK);
+                for (x = 0; x != n && !buf[ofs + x]; ++x)
+                        ;
+                if (x == n ? fseek(f, ofs + n, SEEK_SET) : fwrite(buf + ofs, n, 1, f) != 1)
+                        return -1;
+        }
+        if (fflush(f) || ftruncate(fileno(f), len))
+                return -1;
+        return 0;
+}
+
+int defrag(struct disk *dk)
+{
+        struct fsck_stats st[1];
+        struct stat sb;
+        unsigned char *buf;
+        unsigned char *dir; /* New directory */
+        int *order; /* Entries in their new order */
+        int first = dir_blocks(dk); /* First data block */
+        char name[50];
+        char *tmp;
+        long len;
+        int stamps = 0;
+        int n, m, x, z, ex;
+        int count = 0; /* Entries in order */
+        int blk; /* Next new block */
+        int files = 0;
+        int nonempty = 0; /* Files with any blocks */
+        int runs = 0; /* Runs of blocks before */
+        int prev = -1;
+        int fd;
+        FILE *f;
+
+        fsck(dk, 0, st);
+        if (st->problems != st->bad_names) {
+                printf("Run fsck --repair first\n");
+                return -1;
+        }
+
+        /* Files in directory order, each followed by its extents */
+        order = (int *)malloc(sizeof(int) * dk->dir_entries);
+        for (n = 0; n != dk->dir_entries; ++n) {
+                struct dirent *d = DIR_ENTRY(n);
+                if (d->uu == 0x21 && n % 4 == 3)
+                        stamps = 1;
+                if (d->uu == 0x20)
+                        order[count++] = n; /* Label */
+                if (d->uu >= 0x20 || EXTENT_NO(d) != 0)
+                        continue;
+                strcpy(name, getname(dk, d));
+                for (m = n, ex = 0; m != -1; m = find_user_entry(dk, name, d->uu, ++ex)) {
+                        order[count++] = m;
+                        if (RC(DIR_ENTRY(m)) != SECTORS_PER_EXTENT)
+                                break;
+                }
+        }
+        if (count > dk->dir_entries - (stamps ? dk->dir_entries / 4 : 0)) {
+                printf("Date stamps are not every fourth entry\n");
+                free(order);
+                return -1;
+        }
+
+        /* Start with a copy of the old image, data area formatted */
+        fflush(dk->disk);
+        fseek(dk->disk, 0, SEEK_END);
+        len = ftell(dk->disk);
+        buf = (unsigned char *)malloc(len ? len : 1);
+        dir = (unsigned char *)malloc(SECTOR_DIR_SIZE * SECTOR_SIZE);
+        if (!buf || !dir || fseek(dk->disk, 0, SEEK_SET) || (len && fread(buf, len, 1, dk->disk) != 1)) {
+                printf("Couldn't read image\n");
+                free(buf);
+                free(dir);
+                free(order);
+                return -1;
+        }
+        for (x = first << dk->dpb->bsh; x != (dk->dpb->dsm + 1) << dk->dpb->bsh; ++x) {
+                unsigned char *p = buf + sect_ofs(dk, x);
+                if (sect_ofs(dk, x) + SECTOR_SIZE > len)
+                        continue;
+                for (z = 0; z != SECTOR_SIZE && !p[z]; ++z)
+                        ;
+                if (z != SECTOR_SIZE)
+                        memset(p, 0xE5, SECTOR_SIZE);
+        }
+
+        /* Lay out the entries */
+        memset(dir, 0xE5, SECTOR_DIR_SIZE * SECTOR_SIZE);
+        if (stamps)
+                for (n = 3; n < dk->dir_entries; n += 4) {
+                        memset(dir + n * ENTRY_SIZE, 0, ENTRY_SIZE);
+                        dir[n * ENTRY_SIZE] = 0x21;
+                }
+        blk = first;
+        for (x = 0, n = 0; x != count; ++x, ++n) {
+                struct dirent *d = (struct dirent *)(dir + n * ENTRY_SIZE);
+                int old = order[x];
+                if (stamps && n % 4 == 3)
+                        d = (struct dirent *)(dir + ++n * ENTRY_SIZE);
+                memcpy(d, DIR_ENTRY(old), ENTRY_SIZE);
+                if (d->uu < 0x20 && EXTENT_NO(d) == 0) {
+                        ++files;
+                        if (d->al[0] || d->al[1])
+                                ++nonempty;
+                        prev = -1;
+                }
+                if (stamps && DIR_ENTRY(old | 3)->uu == 0x21)
+                        memcpy(dir + (n | 3) * ENTRY_SIZE + 1 + 10 * (n % 4), dk->dir_buf + (old | 3) * ENTRY_SIZE + 1 + 10 * (old % 4), 10);
+                if (d->uu >= 0x20)
+                        continue;
+                for (z = 0; z != BLOCKS_PER_EXTENT; ++z) {
+                        int from = entry_block(dk, DIR_ENTRY(old), z);
+                        if (!from)
+                                break;
+                        if (from != prev + 1)
+                                ++runs;
+                        prev = from;
+                        for (m = 0; m != SECTORS_PER_BLOCK; ++m)
+                                getsect(dk, new_sect(dk, &buf, &len, (blk << dk->dpb->bsh) + m), (from << dk->dpb->bsh) + m);
+                        set_entry_block(dk, d, z, blk++);
+                }
+        }
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                memcpy(new_sect(dk, &buf, &len, x + SECTOR_DIR), dir + x * SECTOR_SIZE, SECTOR_SIZE);
+
+        /* Replace the image */
+        tmp = (char *)malloc(strlen(dk->name) + 8);
+        sprintf(tmp, "%s.XXXXXX", dk->name);
+        fd = mkstemp(tmp);
+        f = (fd == -1 ? NULL : fdopen(fd, "w"));
+        m = (!f || write_sparse(f, buf, len) || fsync(fd) ||
+             (!stat(dk->name, &sb) && fchmod(fd, sb.st_mode & 07777)));
+        if (f ? fclose(f) : (fd != -1 && close(fd)))
+                m = 1;
+        if (!m && rename(tmp, dk->name))
+                m = 1;
+        if (m) {
+                printf("Couldn't write '%s'\n", tmp);
+                if (fd != -1)
+                        unlink(tmp);
+        } else {
+                printf("%d files, %d blocks: %d runs before, %d now\n", files, blk - first, runs, nonempty);
+        }
+        free(tmp);
+        free(buf);
+        free(dir);
+        free(order);
+        if (m)
+                return -1;
+
+        /* Open the new image */
+        tmp = dk->name;
+        f = dk->log;
+        close_disk(dk);
+        memset(dk, 0, sizeof(*dk));
+        dk->log = f;
+        if (open_disk(dk, tmp, 0)) {
+                /* The new image is in place: just stop using it */
+                printf("Couldn't open '%s'\n", tmp);
+                close_disk(dk);
+                memset(dk, 0, sizeof(*dk));
+                dk->log = f;
+                return -1;
+        }
+        return 0;
+}
+
+int do_command(struct disk *dk, int argc, char *argv[]);
+
+/* Run the commands in file f, one per line.  Returns -1 if any failed. */
+
+int batch(struct disk *dk, FILE *f)
+{
+        char line[1024];
+        char *args[64];
+        int n, line_no = 0;
+        int rtn = 0;
+        while (fgets(line, sizeof(line), f)) {
+                ++line_no;
+                n = 0;
+                args[n] = strtok(line, " \t\r\n");
+                while (args[n] && n != 63)
+                        args[++n] = strtok(NULL, " \t\r\n");
+                if (!n || args[0][0] == '#')
+                        continue;
+                if (!strcmp(args[0], "batch")) {
+                        printf("Line %d: batch can not be nested\n", line_no);
+                        rtn = -1;
+                } else if (do_command(dk, n, args)) {
+                        printf("Line %d: '%s' failed\n", line_no, args[0]);
+                        /* Keep what the lines before it did */
+                        flush_dir(dk);
+                        rtn = -1;
+                }
+        }
+        return rtn;
+}
+
+/* Do one command on the open image */
+
+int do_command(struct disk *dk, int argc, char *argv[])
+{
+        int all = 0;
+        int full = 0;
+        int single = 0;
+        int x = 0;
+        int rtn;
+
+        if (!dk->dir_buf) {
+                printf("The disk is not open\n");
+                return -1;
+        }
+
+	/* Directory options */
+	dir:
+	while (x != argc && argv[x][0] == '-') {
+	        int y;
+	        for (y = 1;argv[x][y];++y) {
 	                int opt = argv[x][y];
 	                switch (opt) {
 	                        case 'l': full = 1; break;
@@ -926,23 +2210,37 @@ int main(int argc, char *argv[])
 
 	if (x == argc) {
 	        /* Just print a directory listing */
-	        atari_dir(all, full, single);
+	        atari_dir(dk, all, full, single);
 	        return 0;
         } else if (!strcmp(argv[x], "ls")) {
                 ++x;
                 goto dir;
         } else if (!strcmp(argv[x], "free")) {
-                return do_free();
-/*        } else if (!strcmp(argv[x], "check")) {
-                return do_check(); */
+                return do_free(dk);
+        } else if (!strcmp(argv[x], "fsck") || !strcmp(argv[x], "check")) {
+                struct fsck_stats st[1];
+                FILE *log = dk->log;
+                int repair = 0;
+                if (!strcmp(argv[x], "fsck") && x + 1 != argc) {
+                        if (strcmp(argv[x + 1], "--repair")) {
+                                printf("Unknown option '%s'\n", argv[x + 1]);
+                                return -1;
+                        }
+                        repair = 1;
+                }
+                dk->log = stdout;
+                fsck(dk, repair, st);
+                dk->log = log;
+                printf("%d files, %d blocks used, %d orphaned\n", st->files, st->used, st->orphaned);
+                printf("%d problems, %d repaired\n", st->problems, st->repaired);
+                return st->problems != st->repaired ? -1 : 0;
 	} else if (!strcmp(argv[x], "cat")) {
 	        ++x;
 	        if (x == argc) {
 	                printf("Missing file name to cat\n");
 	                return -1;
 	        } else {
-	                cat(argv[x++]);
-	                return 0;
+	                return cat(dk, argv[x++]);
 	        }
 	} else if (!strcmp(argv[x], "get")) {
                 char *local_name;
@@ -953,40 +2251,444 @@ int main(int argc, char *argv[])
                         return -1;
                 }
                 atari_name = argv[x];
+                if (wild(atari_name))
+                        return get_files(dk, atari_name, x + 1 != argc ? argv[x + 1] : ".");
                 local_name = atari_name;
                 if (x + 1 != argc)
                         local_name = argv[++x];
-                return get_file(atari_name, local_name);
+                return get_file(dk, atari_name, local_name);
         } else if (!strcmp(argv[x], "put")) {
-                char *local_name;
-                char *atari_name;
                 ++x;
                 if (x == argc) {
                         printf("Missing file name to put\n");
                         return -1;
                 }
-                local_name = argv[x];
-                if (strrchr(local_name, '/'))
-                        atari_name = strrchr(local_name, '/') + 1;
-                else
-                        atari_name = local_name;
-                printf("%s\n", atari_name);
-                if (x + 1 != argc)
-                        atari_name = argv[++x];
-                return put_file(local_name, atari_name);
+                if (argc - x > 2) {
+                        /* Several files, each under its own name */
+                        for (rtn = 0; x != argc; ++x)
+                                if (put_one(dk, argv[x], NULL))
+                                        rtn = -1;
+                        return rtn;
+                }
+                if (x + 1 == argc && wild(argv[x]))
+                        return put_glob(dk, argv[x]);
+                return put_one(dk, argv[x], x + 1 != argc ? argv[x + 1] : NULL);
         } else if (!strcmp(argv[x], "rm")) {
-                char *name;
                 ++x;
                 if (x == argc) {
                         printf("Missing name to delete\n");
                         return -1;
-                } else {
-                        name = argv[x];
                 }
-                return rm(name, 0);
+                for (rtn = 0; x != argc; ++x)
+                        if (rm_files(dk, argv[x]))
+                                rtn = -1;
+                return rtn;
+        } else if (!strcmp(argv[x], "sync-in") || !strcmp(argv[x], "sync-out")) {
+                if (x + 1 == argc) {
+                        printf("Missing directory to %s\n", argv[x]);
+                        return -1;
+                }
+                if (!strcmp(argv[x], "sync-in"))
+                        return sync_in(dk, argv[x + 1]);
+                else
+                        return sync_out(dk, argv[x + 1]);
+        } else if (!strcmp(argv[x], "defrag")) {
+                return defrag(dk);
+        } else if (!strcmp(argv[x], "batch")) {
+                FILE *f = stdin;
+                ++x;
+                if (x != argc && strcmp(argv[x], "-")) {
+                        f = fopen(argv[x], "r");
+                        if (!f) {
+                                printf("Couldn't open '%s'\n", argv[x]);
+                                return -1;
+                        }
+                }
+                rtn = batch(dk, f);
+                if (f != stdin)
+                        fclose(f);
+                return rtn;
 	} else {
 	        printf("Unknown command '%s'\n", argv[x]);
 	        return -1;
 	}
 	return 0;
 }
+
+/* Open disk image name, work out its geometry and read its directory.
+ * dk->log should be set. */
+
+int open_disk(struct disk *dk, char *name, int readonly)
+{
+        long size;
+        dk->name = name;
+        dk->readonly = readonly;
+        dk->dpb = &dpb_fd;
+        dk->disk = fopen(name, readonly ? "r" : "r+");
+        if (!dk->disk)
+                return -1;
+        if (fseek(dk->disk, 0, SEEK_END))
+                return -1;
+        size = ftell(dk->disk);
+        if (read_header(dk)) { /* Geometry given by the image */
+                ;
+        } else if (size == 128 * 77 * 26) { /* Single sided floppy */
+                dk->dpb = &dpb_fd;
+        } else {
+                fprintf(dk->log, "assuming hard drive\n");
+                dk->dpb = &dpb_hd;
+        }
+        if (map_image(dk) || load_dir(dk))
+                return -1;
+        return 0;
+}
+
+/* Let go of everything open_disk() and the commands got */
+
+void close_disk(struct disk *dk)
+{
+        int x;
+#ifdef USE_MMAP
+        if (dk->image)
+                munmap(dk->image, dk->image_len);
+#endif
+        if (dk->disk)
+                fclose(dk->disk);
+        for (x = 0; x != dk->name_n; ++x) {
+                free(dk->names[x]->name);
+                free(dk->names[x]);
+        }
+        free(dk->names);
+        free(dk->phys_sect);
+        free(dk->dir_buf);
+        free(dk->dir_dirty);
+        free(dk->dir_hash);
+        free(dk->dir_next);
+        free(dk->alloc_map);
+        free(dk->free_map);
+}
+
+/* --jobs: run a command which only reads on each of many images, with up
+ * to N threads taking the next image in turn.  Each image gets its own
+ * struct disk, so nothing is shared but the list and stdout.  The result
+ * for each is printed as one line of JSON. */
+
+struct jobs {
+        pthread_mutex_t lock; /* For next, failed and stdout */
+        char *cmd;
+        char *out_dir; /* For extract */
+        char **images;
+        int n;
+        int next; /* Next image to do */
+        int failed; /* Set if any image couldn't be opened or had problems */
+};
+
+/* Write s as a JSON string */
+
+void json_str(FILE *f, char *s)
+{
+        putc('"', f);
+        for (; *s; ++s) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\')
+                        fprintf(f, "\\%c", c);
+                else if (c < 0x20 || c >= 0x7f)
+                        fprintf(f, "\\u%04x", c);
+                else
+                        putc(c, f);
+        }
+        putc('"', f);
+}
+
+/* Files with their sizes and attributes */
+
+void json_ls(struct disk *dk, FILE *f)
+{
+        char **list;
+        int n, x;
+        list = find_files(dk, "*", &n);
+        fprintf(f, ", \"files\": [");
+        for (x = 0; x != n; ++x) {
+                struct dirent dir[1];
+                int sects;
+                memcpy(dir, DIR_ENTRY(find_entry(dk, list[x], 0)), ENTRY_SIZE);
+                fprintf(f, "%s{\"name\": ", x ? ", " : "");
+                json_str(f, list[x]);
+                fprintf(f, ", \"sys\": %s, \"ro\": %s", (dir->t[1] & 0x80) ? "true" : "false", (dir->t[0] & 0x80) ? "true" : "false");
+                sects = get_info(dk, dir, list[x]);
+                if (sects < 0)
+                        ++dk->problems;
+                else
+                        fprintf(f, ", \"size\": %ld", (long)sects * SECTOR_SIZE);
+                fprintf(f, "}");
+        }
+        fprintf(f, "]");
+        if (list)
+                free_list(list, n);
+}
+
+/* Every file into out_dir/image-name */
+
+void json_extract(struct disk *dk, FILE *f, char *out_dir, char *image)
+{
+        char **list;
+        char *base = strrchr(image, '/') ? strrchr(image, '/') + 1 : image;
+        char *dir = (char *)malloc(strlen(out_dir) + strlen(base) + 2);
+        long bytes = 0;
+        int n, x;
+        int files = 0;
+        sprintf(dir, "%s/%s", out_dir, base);
+        if (mkdir(dir, 0777) && errno != EEXIST) {
+                fprintf(dk->log, "Couldn't make directory '%s'\n", dir);
+                ++dk->problems;
+                free(dir);
+                return;
+        }
+        list = find_files(dk, "*", &n);
+        for (x = 0; x != n; ++x) {
+                struct dirent ent[1];
+                char *path;
+                FILE *l;
+                if (!safe_name(list[x])) {
+                        fprintf(dk->log, "Skipping unsafe name '%s'\n", list[x]);
+                        ++dk->problems;
+                        continue;
+                }
+                path = (char *)malloc(strlen(dir) + strlen(list[x]) + 2);
+                sprintf(path, "%s/%s", dir, list[x]);
+                if (!find_file(dk, ent, list[x], 0, 0) && (l = fopen(path, "w"))) {
+                        if (read_file(dk, list[x], ent, l))
+                                ++dk->problems;
+                        bytes += ftell(l);
+                        if (fclose(l)) {
+                                fprintf(dk->log, "Couldn't close local file '%s'\n", path);
+                                ++dk->problems;
+                        } else {
+                                ++files;
+                        }
+                } else {
+                        fprintf(dk->log, "Couldn't open local file '%s'\n", path);
+                        ++dk->problems;
+                }
+                free(path);
+        }
+        if (list)
+                free_list(list, n);
+        fprintf(f, ", \"dir\": ");
+        json_str(f, dir);
+        fprintf(f, ", \"files\": %d, \"bytes\": %ld", files, bytes);
+        free(dir);
+}
+
+/* Run the command on one image.  Returns the line to print, and sets
+ * *failed. */
+
+char *run_job(struct jobs *j, char *image, int *failed)
+{
+        struct disk dk[1];
+        char *line = NULL;
+        char *msgs = NULL;
+        size_t line_len = 0;
+        size_t msgs_len = 0;
+        FILE *f = open_memstream(&line, &line_len);
+        char *s, *e;
+        int x;
+        memset(dk, 0, sizeof(dk));
+        dk->log = open_memstream(&msgs, &msgs_len);
+        fprintf(f, "{\"image\": ");
+        json_str(f, image);
+        *failed = 0;
+        if (open_disk(dk, image, 1)) {
+                fprintf(f, ", \"error\": \"couldn't open\"");
+                *failed = 1;
+        } else if (!strcmp(j->cmd, "ls")) {
+                json_ls(dk, f);
+        } else if (!strcmp(j->cmd, "free")) {
+                x = amount_free(dk);
+                fprintf(f, ", \"free_blocks\": %d, \"free_bytes\": %ld", x, (long)x * (SECTOR_SIZE << dk->dpb->bsh));
+        } else if (!strcmp(j->cmd, "check")) {
+                struct fsck_stats st[1];
+                fsck(dk, 0, st);
+                fprintf(f, ", \"files\": %d, \"blocks_used\": %d, \"blocks_orphaned\": %d", st->files, st->used, st->orphaned);
+        } else {
+                json_extract(dk, f, j->out_dir, image);
+        }
+        fclose(dk->log);
+        fprintf(f, ", \"problems\": %ld, \"messages\": [", dk->problems);
+        for (s = msgs, x = 0; (e = strchr(s, '\n')); s = e + 1, ++x) {
+                *e = 0;
+                if (x)
+                        fprintf(f, ", ");
+                json_str(f, s);
+        }
+        fprintf(f, "]}\n");
+        fclose(f);
+        free(msgs);
+        if (dk->problems)
+                *failed = 1;
+        close_disk(dk);
+        return line;
+}
+
+void *job_thread(void *arg)
+{
+        struct jobs *j = (struct jobs *)arg;
+        for (;;) {
+                char *line;
+                int failed;
+                int x;
+                pthread_mutex_lock(&j->lock);
+                x = j->next++;
+                pthread_mutex_unlock(&j->lock);
+                if (x >= j->n)
+                        break;
+                line = run_job(j, j->images[x], &failed);
+                pthread_mutex_lock(&j->lock);
+                fputs(line, stdout);
+                fflush(stdout);
+                if (failed)
+                        j->failed = 1;
+                pthread_mutex_unlock(&j->lock);
+                free(line);
+        }
+        return NULL;
+}
+
+int jobs(int argc, char *argv[])
+{
+        struct jobs j[1];
+        pthread_t *threads;
+        int n = 0;
+        int x;
+        memset(j, 0, sizeof(j));
+        if (argc >= 2) {
+                n = atoi(argv[0]);
+                j->cmd = argv[1];
+                argc -= 2;
+                argv += 2;
+        }
+        if (j->cmd && !strcmp(j->cmd, "extract") && argc) {
+                j->out_dir = argv[0];
+                --argc;
+                ++argv;
+        } else if (j->cmd && strcmp(j->cmd, "ls") && strcmp(j->cmd, "free") && strcmp(j->cmd, "check")) {
+                printf("Command '%s' can't be run with --jobs\n", j->cmd);
+                return -1;
+        }
+        if (!j->cmd || !argc) {
+                printf("Syntax: cpmtool --jobs N ls|free|check|extract local-dir path-to-disk-image...\n");
+                return -1;
+        }
+        j->images = argv;
+        j->n = argc;
+        if (n < 1)
+                n = 1;
+        if (n > argc)
+                n = argc;
+        pthread_mutex_init(&j->lock, NULL);
+        threads = (pthread_t *)malloc(sizeof(pthread_t) * n);
+        for (x = 0; x != n; ++x)
+                if (pthread_create(&threads[x], NULL, job_thread, j))
+                        break;
+        if (!x) /* Do them here */
+                job_thread(j);
+        n = x;
+        for (x = 0; x != n; ++x)
+                pthread_join(threads[x], NULL);
+        free(threads);
+        pthread_mutex_destroy(&j->lock);
+        return j->failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int x;
+	char *disk_name;
+	struct disk dk[1];
+	memset(dk, 0, sizeof(dk));
+	dk->log = stderr;
+	dk->dpb = &dpb_fd;
+	x = 1;
+	if (x != argc && !strcmp(argv[x], "--jobs"))
+	        return jobs(argc - x - 1, argv + x + 1);
+	if (x == argc || !strcmp(argv[x], "--help") || !strcmp(argv[x], "-h")) {
+                printf("\nCP/M disk image tool\n");
+                printf("\n");
+                printf("Syntax: cpmtool path-to-disk-image [command] [args]\n");
+                printf("        cpmtool --jobs N command [local-dir] path-to-disk-image...\n");
+                printf("\n");
+                printf("  Commands: (default is ls)\n\n");
+                printf("      ls [-la1]                     Directory listing\n");
+                printf("                  -l for long\n");
+                printf("                  -a to show system files\n");
+                printf("                  -1 to show a single name per line\n\n");
+                printf("      cat cpm-name                  Type file to console\n\n");
+                printf("      get cpm-name [local-name]     Copy file from diskette to local-name\n");
+                printf("      get pattern [local-dir]\n\n");
+                printf("      put local-name [cpm-name]     Copy file from local-name to diskette\n");
+                printf("      put local-name...\n\n");
+                printf("  local-name - is stdin for put and stdout for get.\n\n");
+                printf("      free                          Print amount of free space\n\n");
+                printf("      rm cpm-name...                Delete files\n\n");
+                printf("      sync-in local-dir             Copy the files in local-dir which differ\n");
+                printf("                                    from those on the diskette\n\n");
+                printf("      sync-out local-dir            Copy the files on the diskette which differ\n");
+                printf("                                    from those in local-dir\n\n");
+                printf("      batch [script]                Run the commands in script (or stdin),\n");
+                printf("                                    one per line, writing the directory once\n\n");
+                printf("      fsck [--repair]               Check the directory, and repair it\n\n");
+                printf("      check                         Check the directory only\n\n");
+                printf("      defrag                        Put each file in one run of blocks\n\n");
+                printf("      mkfs [--dpb geometry] [--sparse]\n");
+                printf("                                    Format disk: geometry is fd (default),\n");
+                printf("                                    hd, or sectors/track,blocksize,blocks,\n");
+                printf("                                    direntries,reservedtracks, kept in a\n");
+                printf("                                    header.  --sparse writes only the\n");
+                printf("                                    reserved tracks and the directory\n\n");
+                printf("  get and rm take CP/M names with * and ? wildcards.  get with a wildcard\n");
+                printf("  copies each match into local-dir (default the current directory).\n");
+                printf("  put with more than two names, or a quoted wildcard, copies each file\n");
+                printf("  under its own name.\n\n");
+                printf("  --jobs runs ls, free, check or extract local-dir on each image, N at a\n");
+                printf("  time, printing a line of JSON for each.  extract gets every file into\n");
+                printf("  local-dir/image-name.\n\n");
+                return -1;
+	}
+	disk_name = argv[x++];
+
+	if (x != argc && !strcmp(argv[x], "mkfs")) {
+	        int sparse = 0;
+	        for (++x; x != argc; ++x) {
+	                if (!strcmp(argv[x], "--sparse")) {
+	                        sparse = 1;
+	                } else if (!strcmp(argv[x], "--dpb") && x + 1 != argc) {
+	                        if (set_dpb(dk, argv[++x]))
+	                                return -1;
+	                } else {
+	                        printf("Unknown option '%s'\n", argv[x]);
+	                        return -1;
+	                }
+	        }
+	        dk->disk = fopen(disk_name, "w");
+	        if (!dk->disk) {
+	                printf("Couldn't open '%s'\n", disk_name);
+	                return -1;
+	        }
+	        x = mkfs(dk, sparse);
+	        if (fclose(dk->disk) || x) {
+	                printf("Couldn't write '%s'\n", disk_name);
+	                return -1;
+	        }
+	        return 0;
+	}
+
+	if (open_disk(dk, disk_name, 0)) {
+	        printf("Couldn't open '%s'\n", disk_name);
+	        return -1;
+	}
+
+	x = do_command(dk, argc - x, argv + x);
+	flush_dir(dk);
+	close_disk(dk);
+	return x;
+}
@@ -9,6 +9,7 @@
 #define __DEFS_H_
 
 #include <stdio.h>
+#include <time.h>
 
 /* the current version of the z80 emulator */
 #define VERSION "3.1"
@@ -30,6 +31,13 @@
 #	define UNIX	/* cannot use "unix" since DJGPP defines it as well */
 #endif
 
+/* no mmap() for disk images and snapshots */
+#if defined macintosh || defined DJGPP || defined _WIN32
+#	ifndef NO_MMAP
+#		define NO_MMAP
+#	endif
+#endif
+
 
 /* some headers define macros this way */
 #ifdef BYTE_ORDER
@@ -125,6 +133,123 @@ typedef unsigned long longword;
 /* max number of the BIOS drive tables */
 #define MAXDISCS	16
 
+/* geometry of a disk drive and where its BIOS tables are (see bios.c) */
+typedef struct dgeom
+{
+    long spt;		/* 128-byte sectors per track */
+    int bsh;		/* block shift factor: 3 (1K) to 7 (16K) */
+    long dsm;		/* number of blocks - 1 */
+    long drm;		/* number of directory entries - 1 */
+    long off;		/* reserved tracks */
+    int skew;		/* translate sectors through sectorxlat[] */
+    long tracks;	/* tracks on the drive */
+    word dph, dpb, alv;
+} dgeom;
+
+/* state of the console (see vt.c) */
+#define KFIFO_SIZE	4
+
+typedef struct console
+{
+    int last;			/* character read ahead by constat() */
+    int stuff[KFIFO_SIZE];	/* characters pushed back by kget() */
+    int stuff_ptr;
+    int state;			/* vt52() escape sequence state */
+    int x, y;			/* vt52() cursor motion */
+    int batch;			/* flush output only to wait for input */
+    int written;		/* output since the last flush */
+
+    /* an embedded machine that does nothing but poll for input that is
+       not there is stopped as if it were waiting for it */
+    unsigned long lastpoll;	/* icount at the last empty constat() */
+    int idlepolls;		/* empty polls in a row close together */
+    int idle;			/* stopped for that reason */
+
+    /* in the library, input is fed into and output drained from these
+       buffers instead of using the terminal */
+    int embedded;
+    unsigned char *in;
+    long inpos, inlen, insize;
+    unsigned char *out;
+    long outlen, outsize;
+} console;
+
+/* a host file opened by the BDOS emulation (see bdos.c) */
+#define BDOSFILES	100
+#define BDOSPATHLEN	50
+
+typedef struct bdosfile
+{
+    FILE *fp;
+    unsigned where;		/* address of its FCB */
+    char name[12];		/* CP/M name from the FCB */
+    char path[BDOSPATHLEN];	/* so that a snapshot can reopen it */
+} bdosfile;
+
+/* host files opened through the BIOS unix calls (see bios.c) */
+#define CPM_FILES	4
+
+
+/* The last instructions executed, kept by trace.c.  Each entry is the
+   state before the instruction, and the address of the last byte of
+   memory it wrote (if the flag says it wrote any). */
+
+#define TRACESIZE	65536L	/* instructions kept by default */
+#define TRACEMAGIC	"CPMTRC\032"	/* file: magic, version, count, */
+#define TRACEMAGICLEN	7	/* why it was saved, entries */
+#define TRACEVERSION	1
+#define TRACEENTLEN	27	/* bytes in a file entry */
+#define TR_WROTE	0x01
+
+typedef struct tracent
+{
+    unsigned long icount;
+    word pc, af, bc, de, hl, ix, iy, sp;
+    byte op[4];
+    word wrote;
+    byte flags;
+} tracent;
+
+typedef struct tracering
+{
+    const char *file;		/* where it is saved */
+    long size, next, count;
+    tracent ent[1];		/* really "size" */
+} tracering;
+
+/* Counts of the BDOS and BIOS calls made (callstats.c), with the host
+   time they took in a histogram of powers of two nanoseconds, and the
+   host I/O they did */
+
+#define BDOSCALLS	256
+#define BIOSCALLS	24	/* the entries in bios()'s table */
+#define CALLHIST	32
+
+#define CALL_BDOS	1
+#define CALL_BIOS	2
+
+typedef struct callstat
+{
+    unsigned long count;
+    double secs;
+    double max;			/* the longest call */
+    unsigned long hist[CALLHIST];
+    unsigned long iocalls;	/* host I/O calls */
+    unsigned long iobytes;	/* and the bytes they moved */
+} callstat;
+
+/* The tables of opcode forms counted with -DOPCODE_STATS (opstats.c):
+   a form is its table * 256 + the opcode byte */
+
+#define OP_MAIN		0
+#define OP_CB		1
+#define OP_ED		2
+#define OP_DD		3
+#define OP_FD		4
+#define OP_DDCB		5
+#define OP_FDCB		6
+#define OP_TABLES	7
+#define OP_FORMS	(OP_TABLES * 256)
 
 typedef struct z80info
 {
@@ -151,6 +276,58 @@ typedef struct z80info
     int sig;		/* caught a signal */
     int syscall;	/* CP/M syscall to be done */
     int biosfn;		/* BIOS function be done */
+    boolean blocked;	/* stopped to wait for console input */
+    boolean finished;	/* CP/M has exited */
+    unsigned long icount;	/* instructions executed */
+#ifdef OPCODE_STATS
+    unsigned long opcount[OP_FORMS];	/* executions of each form */
+    unsigned long optimed[OP_FORMS];	/* of them, how many were timed */
+    double opns[OP_FORMS];		/* and the host time they took */
+    int opform;			/* form of the instruction being executed */
+    long opevery, opleft;	/* time one instruction in opevery */
+    boolean optiming;
+    double opstart, opoverhead;	/* in ns */
+    const char *opfile;		/* where the counts are saved */
+#endif
+    callstat bdosstat[BDOSCALLS];	/* BDOS and BIOS calls made */
+    callstat biosstat[BIOSCALLS];
+    unsigned long iocalls, iobytes;	/* host I/O done, for them */
+    const char *callstatsfile;	/* where they are saved, or NULL */
+    struct profile *prof;	/* PC samples and call counts (profile.c) */
+    long profleft;		/* instructions to the next sample */
+    tracering *ring;		/* last instructions (see trace.c) or NULL */
+    long wrote;			/* memory the last instruction wrote, or -1 */
+    struct recorder *rec;	/* recording or replaying (see record.c) */
+    boolean replay;		/* replaying */
+    void (*monitor)(struct z80info *z80); /* user-level commands or NULL */
+    FILE *logfile;	/* console output is copied here */
+    int bdos_return;	/* SP a traced BDOS call returns with */
+
+    /* options */
+    int nobdos;			/* real BDOS on disk images, not emulated */
+    int strace;			/* trace the program's BDOS calls */
+    int trace_bdos;		/* trace the BDOS emulation */
+    int exec;			/* exit when the command is done */
+    int restricted_mode;	/* refuse to change directory */
+    int nommap;			/* track cache instead of mmap() for images */
+    const char *overlaydir;	/* copy-on-write overlays for the images */
+    const char *savestatefile;	/* snapshot at the first wait for input */
+    dgeom confgeom[MAXDISCS];	/* drive geometry from diskconfig() */
+    int confset[MAXDISCS];
+
+    console con;
+
+    /* these are for the BDOS emulation */
+    bdosfile stfps[BDOSFILES];
+    int storedfps;
+    unsigned short usercode;
+    void *dp;			/* DIR * of the current directory search */
+    unsigned sfn;
+    time_t dpbtime;		/* when DPB0 was last filled in */
+    const char *stuff_cmd;	/* command typed in at the first prompt */
+    int silent_exit;		/* exit at the next warm boot */
+    char cmdline[259];		/* line being read by rdcmdline() */
+    int cmdpos;			/* where it is up to, 0 if not reading */
 
     /* these are for the CP/M BIOS */
     int	drive;
@@ -159,6 +336,18 @@ typedef struct z80info
     word sector;
     FILE *drives[MAXDISCS];
     long drivelen[MAXDISCS];
+    byte *drivemap[MAXDISCS];	/* disk image mapped into memory */
+    long drivemaplen[MAXDISCS];
+    struct dcache *dcache;	/* track cache for images not mapped */
+    struct overlay *overlay[MAXDISCS];	/* copy-on-write overlays */
+    dgeom geom[MAXDISCS];
+    word dirbuf, timebuf;	/* BIOS tables shared by all drives */
+    FILE *cpm_file[CPM_FILES];
+    FILE *listfp;		/* the "list" device */
+
+    /* the CCP and BDOS as loaded by the first warm boot */
+    byte sysimage[0x1600];
+    boolean syscached;
 
     /* 64k bytes - may be allocated separately if desired */
     byte mem[0x10000L];
@@ -190,7 +379,8 @@ typedef struct z80info
 		read_mem(z80, addr) :	\
 		z80->mem[(word)(addr)])
 #    define SETMEM(addr, val)	\
-		(z80->membrk[(word)(addr)] ?	\
+		(z80->wrote = (word)(addr),	\
+		z80->membrk[(word)(addr)] ?	\
 		write_mem(z80, addr, val) :	\
 		(z80->mem[(word)(addr)] = (byte)(val)))
 
@@ -202,7 +392,25 @@ typedef struct z80info
 
 #else
 #    define MEM(addr) z80->mem[(word)(addr)]
-#    define SETMEM(addr, val) (z80->mem[(word)(addr)] = (byte)(val))
+#    define SETMEM(addr, val)	\
+		(z80->wrote = (word)(addr),	\
+		z80->mem[(word)(addr)] = (byte)(val))
+#endif
+
+
+/* count host I/O, for callstat */
+
+#define IOSTAT(calls, bytes)	\
+		(z80->iocalls += (calls), z80->iobytes += (bytes))
+
+
+/* count an opcode form */
+
+#ifdef OPCODE_STATS
+#    define OPSTAT(table, op)	\
+		(z80->opform = ((table) << 8) | (op), z80->opcount[z80->opform]++)
+#else
+#    define OPSTAT(table, op)
 #endif
 
 
@@ -263,11 +471,7 @@ extern void delete_z80info(z80info *z80);
 
 extern boolean z80_emulator(z80info *z80, int count);
 
-extern int nobdos;
-
-/* main.c */
-extern void resetterm(void);
-extern void setterm(void);
+/* cpmio.c */
 extern boolean input(z80info *z80, byte haddr, byte laddr, byte *val);
 extern void output(z80info *z80, byte haddr, byte laddr, byte data);
 extern void haltcpu(z80info *z80);
@@ -275,13 +479,72 @@ extern word read_mem(z80info *z80, word addr);
 extern word write_mem(z80info *z80, word addr, byte val);
 extern void undefinstr(z80info *z80, byte instr);
 extern boolean loadfile(z80info *z80, const char *fname);
+extern void dumptrace(z80info *z80);
+extern void monitor(z80info *z80);
+
+/* vt.c */
+extern void resetterm(void);
+extern void setterm(void);
+extern void initterm(void);
 
 /* bios.c */
+extern int diskconfig(z80info *z80, const char *file);
 extern void bios(z80info *z80, unsigned int fn);
+extern const char *bios_decode(unsigned int fn);
 extern void sysreset(z80info *z80);
 extern void warmboot(z80info *z80);
 extern void finish(z80info *z80);
-extern void command(z80info *z80);
+extern void diskstats(z80info *z80, FILE *fp);
+extern void biosresume(z80info *z80);
+extern void biosclose(z80info *z80);
+
+/* in snapshot.c */
+extern int savestate(z80info *z80, const char *file, word pc);
+extern int loadstate(z80info *z80, const char *file);
+extern void inputwait(z80info *z80, word pc);
+
+/* record.c */
+extern int recordstart(z80info *z80, const char *file);
+extern int replaystart(z80info *z80, const char *file);
+extern int recordend(z80info *z80);
+extern void replayoutput(z80info *z80);
+extern int reckey(z80info *z80, int c);
+extern int recstat(z80info *z80, int ready);
+extern void rectime(z80info *z80, byte *t);
+extern void recstatfs(z80info *z80, unsigned long *total,
+		unsigned long *avail);
+extern void recfile(z80info *z80, const char *path);
+extern const char *replaypath(z80info *z80, const char *name, char *buf,
+		size_t size);
+extern const char *replaydir(z80info *z80);
+extern void recimage(z80info *z80, int drive, const char *path);
+
+/* trace.c */
+extern int traceon(z80info *z80, const char *file, long size);
+extern void traceinsn(z80info *z80);
+extern int tracesave(z80info *z80, const char *why);
+
+/* profile.c */
+extern int profon(z80info *z80, long every);
+extern void profoff(z80info *z80);
+extern int profsymbols(z80info *z80, const char *file);
+extern void profsample(z80info *z80);
+extern void profcall(z80info *z80, int kind, int fn, word site, double secs);
+extern void profreport(z80info *z80, FILE *fp);
+
+/* callstats.c */
+extern void dobdos(z80info *z80);
+extern void dobios(z80info *z80, unsigned fn);
+extern void callstats(z80info *z80, FILE *fp);
+extern int callstatsave(z80info *z80, const char *file);
+
+/* opstats.c */
+extern int opstatson(z80info *z80, const char *file, long every);
+extern int opstatsave(z80info *z80);
+#ifdef OPCODE_STATS
+extern void opsample(z80info *z80);
+extern void opstop(z80info *z80);
+#endif
 
 /* disassem.c */
 extern int disassemlen(void);
@@ -290,13 +553,14 @@ extern int disassem(z80info *z80, word start, FILE *fp);
 /* bdos */
 #define BDOS_HOOK 0xDC06
 void check_BDOS_hook(z80info *z80);
-extern int silent_exit;
-extern char *stuff_cmd;
-extern int exec;
-extern int trace_bdos;
-extern int strace;
 char *bdos_decode(int n);
 int bdos_fcb(int n);
 void bdos_fcb_dump(z80info *z80);
+void bdos_closeall(z80info *z80);
+
+/* most space the BDOS open file table takes in a snapshot */
+#define FILETABLESIZE	8192
+long bdos_savefiles(z80info *z80, byte *buf, long max);
+int bdos_loadfiles(z80info *z80, const byte *buf, long len);
 
 #endif /* __DEFS_H_ */
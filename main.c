@@ -1,7 +1,6 @@
 /*-----------------------------------------------------------------------*\
- |  main.c  --  main driver program for the z80 emulator  --  all I/O    |
- |  to the Unix world is done from this file  --  "z80.c" calls various  |
- |  functions within this file                                           |
+ |  main.c  --  main driver program for the z80 emulator  --  runs one  |
+ |  machine on the terminal, with the user-level commands available     |
  |                                                                       |
  |  Copyright 1986-1988 by Parag Patel.  All Rights Reserved.            |
  |  Copyright 1994-1995 by CodeGen, Inc.  All Rights Reserved.           |
@@ -25,46 +24,8 @@
 #	ifdef THINK_C
 #		include <console.h>
 #	endif
-#elif defined DJGPP
-#	include <pc.h>
-#elif defined _WIN32
-#
-#else	/* UNIX */
-#	include <unistd.h>
-#	include <sys/ioctl.h>
-#	if defined POSIX_TTY
-#		include <sys/termios.h>
-#	elif defined BeBox
-#		include <termios.h>
-#	else
-#		include <termio.h>
-#	endif
-#endif
-
-
-extern int errno;
-
-
-/* globally visible vars */
-static FILE *logfile = NULL;
-
-
-#ifndef _WIN32
-#  if defined UNIX || defined BeBox
-#    ifdef POSIX_TTY
-#	   define termio termios
-#    endif
-static struct termio rawterm, oldterm;	/* for raw terminal I/O */
-#  endif
 #endif
 
-#ifdef _WIN32
-static int have_term = 0;   /* no terminal in Win32 */
-#else
-static int have_term = 1;   /* FALSE if terminal initialization failed */
-#endif
-
-static void dumptrace(z80info *z80);
 
 
 char *jgets(char *s, int len, FILE *f)
@@ -79,94 +40,12 @@ char *jgets(char *s, int len, FILE *f)
 	return rtn;
 }
 
-/*-----------------------------------------------------------------------*\
- |  resetterm  --  reset terminal characteristics to original settings
-\*-----------------------------------------------------------------------*/
-
-void
-resetterm(void)
-{
-#ifndef _WIN32
-    if (have_term)
-		tcsetattr(fileno(stdin), TCSADRAIN, &oldterm);
-#endif
-}
-
-
-
-/*-----------------------------------------------------------------------*\
- |  setterm  --  set terminal characteristics to raw mode
-\*-----------------------------------------------------------------------*/
-
-void
-setterm(void)
-{
-#ifndef _WIN32
-    if (have_term)
-		tcsetattr(fileno(stdin), TCSADRAIN, &rawterm);
-#endif
-}
-
-
-
-/*-----------------------------------------------------------------------*\
- |  initterm  --  initialize terminal stuff  --  called once on startup
- |  and then after returning from a sub-shell
-\*-----------------------------------------------------------------------*/
-
-static void
-initterm(void)
-{
-#ifdef _WIN32
-		fprintf(stderr, "Sorry, terminal not found, using cooked mode.\n");
-		have_term = 0;
-#else
-	if (tcgetattr(fileno(stdin), &oldterm))
-	{
-		fprintf(stderr, "Sorry, terminal not found, using cooked mode.\n");
-		have_term = 0;
-	}
-        else {
-	rawterm = oldterm;
-	rawterm.c_iflag &= ~(ICRNL | IXON | IXOFF | INLCR | ICRNL);
-	rawterm.c_lflag &= ~(ICANON | ECHO);
-	rawterm.c_cc[VINTR] = -1;
-	rawterm.c_cc[VSUSP] = -1;
-	rawterm.c_cc[VQUIT] = -1;
-	rawterm.c_cc[VERASE] = -1;
-	rawterm.c_cc[VKILL] = -1;
-	tcsetattr(fileno(stdin), TCSADRAIN, &rawterm);
-  }
-
-#if 0
-	/* rawterm.c_lflag &= ~(ISIG | ICANON | ECHO); */
-	rawterm.c_lflag &= ~(ICANON | ECHO);
-#ifdef IENQAK
-	rawterm.c_iflag &= ~(IENQAK | IXON | IXOFF | INLCR | ICRNL);
-#else
-	rawterm.c_iflag &= ~(IXON | IXOFF | INLCR | ICRNL);
-#endif
-	rawterm.c_oflag &= ~OPOST;
-	rawterm.c_cc[VINTR] = INTR_CHAR;
-	rawterm.c_cc[VSUSP] = -1;
-	rawterm.c_cc[VQUIT] = -1;
-	rawterm.c_cc[VERASE] = -1;
-	rawterm.c_cc[VKILL] = -1;
-	rawterm.c_cc[VMIN] = 1;		/* MIN number of chars */
-	rawterm.c_cc[VTIME] = 0;	/* TIME timeout value */
-#endif
-#endif
-}
-
-
-
-
 /*-----------------------------------------------------------------------*\
  |  command  --  called when user-level commands are needed by the z80
  |  for some reason or another
 \*-----------------------------------------------------------------------*/
 
-void
+static void
 command(z80info *z80)
 {
 	unsigned int i, j, t, e;
@@ -195,17 +74,20 @@ loop:	/* "infinite" loop */
 		printf("   Q(uit)  T(race on/off)  S(tep trace)  D(ump regs)\n");
 		printf("   E(xamine memory)  P(oke memory)  R(egister modify)\n");
 		printf("   L(oad binary)  C(ontinue running - <CR> if Step)\n");
-		printf("   G(o) B(oot CP/M)  Z(80 disassembled dump)\n");
+		printf("   G(o) B(oot CP/M, reloading bdos.hex/ccp.hex)\n");
+		printf("   Z(80 disassembled dump)\n");
 		printf("   W(write memory to file)  X,Y(-set/clear breakpoint)\n");
-		printf("   O(output to \"logfile\")\n\n");
+		printf("   O(output to \"z80->logfile\")  I(/O statistics)\n");
+		printf("   F(reeze: save a snapshot)  H(istory: save the trace)\n");
+		printf("   U(sage: profile report)\n\n");
 		printf("   !(fork shell)  ?(command list)  V(ersion)\n\n");
 		break;
 
 	case 'o':
-		if (logfile != NULL)
+		if (z80->logfile != NULL)
 		{
-			fclose(logfile);
-			logfile = NULL;
+			fclose(z80->logfile);
+			z80->logfile = NULL;
 			printf("    Logging off.\n");
 		}
 		else
@@ -219,16 +101,52 @@ loop:	/* "infinite" loop */
 			if (*s == '\0')
 				break;
 
-			logfile = fopen(s, "w");
+			z80->logfile = fopen(s, "w");
 
-			if (logfile == NULL)
-				printf("Cannot open logfile!\n");
+			if (z80->logfile == NULL)
+				printf("Cannot open z80->logfile!\n");
 			else
 				printf("    Logging on.\n");
 		}
 
 		break;
 
+	case 'f':				/* save a snapshot */
+		printf("    Snapshot file name? ");
+		jgets(str, sizeof(str), stdin);
+
+		for (s = str; isspace(*(unsigned char *)s); s++)
+			;
+
+		if (*s == '\0')
+			break;
+
+		if (savestate(z80, s, PC) == 0)
+			printf("    Saved.\n");
+
+		break;
+
+	case 'h':				/* save the trace ring */
+		if (z80->ring == NULL)
+			printf("    No trace: start with --trace-ring\n");
+		else
+			tracesave(z80, "monitor command");
+
+		break;
+
+	case 'u':				/* profile report */
+		if (z80->prof == NULL)
+			printf("    Not profiling: start with --profile\n");
+		else
+			profreport(z80, stdout);
+
+		break;
+
+	case 'i':				/* I/O statistics */
+		diskstats(z80, stdout);
+		callstats(z80, stdout);
+		break;
+
 	case '!':				/* fork a shell */
 		system("exec ${SHELL:-/bin/sh}");
 		initterm();
@@ -236,8 +154,10 @@ loop:	/* "infinite" loop */
 		break;
 
 	case 'q':				/* quit */
-		if (logfile != NULL)
-			fclose(logfile);
+		if (z80->logfile != NULL)
+			fclose(z80->logfile);
+
+		recordend(z80);
 
 		exit(0);
 		break;
@@ -517,487 +437,27 @@ loop:	/* "infinite" loop */
 
 
 
-/*-----------------------------------------------------------------------*\
- |  dumptrace  --  dump the z80 registers in an easy-to-trace format
- |  --  note that the dump takes exactly one line so that changes in
- |  register values are easier to spot  --  disassembles the z80 code
-\*-----------------------------------------------------------------------*/
-
-static void
-dumptrace(z80info *z80)
-{
-	printf("a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
-			A, F, BC, DE, HL);
-	printf("ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
-			IX, IY, SP, PC, z80->mem[PC]);
-	disassem(z80, PC, stdout);
-	printf("\r\n");
-
-	if (logfile)
-	{
-		fprintf(logfile, "a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
-				A, F, BC, DE, HL);
-		fprintf(logfile, "ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
-				IX, IY, SP, PC, z80->mem[PC]);
-		disassem(z80, PC, logfile);
-		fprintf(logfile, "\r\n");
-	}
-}
-
-
-
-#define HEXVAL(c)	(('0' <= (c) && (c) <= '9') ? (c) - '0' :\
-			(('a' <= (c) && (c) <= 'f') ? (c) - 'a' + 10 :\
-			(('A' <= (c) && (c) <= 'F') ? (c) - 'A' + 10 :\
-				-1 )))
-
-static int
-gethex(FILE *fp)
-{
-	int i, j;
-
-	i = getc(fp);
-	j = getc(fp);
-
-	if (i < 0 || j < 0)
-		return -1;
-
-	i = HEXVAL(i);
-	j = HEXVAL(j);
-
-	if (i < 0 || j < 0)
-		return -1;
-
-	return (i << 4) | j;
-}
-
-
-static int
-loadhex(z80info *z80, FILE *fp)
-{
-	int start = TRUE;
-	int len, line, i;
-	word addr, check, t;
-
-	for (line = 1; getc(fp) >= 0; line++)		/* should be a ':' */
-	{
-		if ((len = gethex(fp)) <= 0)
-			break;
-
-		check = len;
-
-		if ((i = gethex(fp)) < 0)
-			break;
-
-		addr = (word)i;
-		check += addr;
-
-		if ((i = gethex(fp)) < 0)
-			break;
-
-		t = (word)i;
-		check += t;
-		addr = (addr << 8) | t;
-
-		if (start)
-			PC = addr, start = FALSE;
-
-		if ((i = gethex(fp)) < 0)		/* ??? */
-			break;
-
-		check += (word)i;
-
-		while (len-- > 0)
-		{
-			if ((i = gethex(fp)) < 0)
-				break;
-
-			t = (word)i;
-			check += t;
-			z80->mem[addr] = t;
-			addr++;
-		}
-
-		if ((i = gethex(fp)) < 0)		/* checksum */
-			break;
-
-		t = (word)i;
-
-		if ((t + check) & 0xFF)
-		{
-			fprintf(stderr, "%d: Checksum error: %.2X != 0!\r\n",
-					line, (t + check) & 0xFF);
-			return FALSE;
-		}
-
-		if (getc(fp) < 0)		/* should be a '\n' */
-			break;
-	}
-
-	return TRUE;
-}
-
-
-
-/*-----------------------------------------------------------------------*\
- |  getword  --  return a 16-bit word from the specified file
-\*-----------------------------------------------------------------------*/
-
-static int
-getword(FILE *file)
-{
-	int w;
-
-	w = getc(file) << 8;
-	w |= getc(file);
-	return w;
-}
-
-
-
-/*-----------------------------------------------------------------------*\
- |  loadpisces  --  load the specified file (assumed to be in Pisces+
- |  format) into the z80 memory for subsequent execution
-\*-----------------------------------------------------------------------*/
-
-static int
-loadpisces(z80info *z80, FILE *file)
-{
-	int numbytes, i;
-	unsigned short loadaddr;
-
-	/* ignore the 1st 12 words in the file - the 13th word is the starting
-	   PC value - the 14th is also ignored */
-	for (i = 0; i < 12; i++)
-		getword(file);
-
-	PC = getword(file);
-	getword(file);
-
-	/* read in each block of words into the z80 memory - each block
-	   specifies the number of bytes in the block and the address to load
-	   the data into */
-	while (getword(file) != EOF)
-	{
-		numbytes = getword(file);
-		loadaddr = getword(file);
-		getword(file);
-
-		for (; numbytes > 0; numbytes -= 2)
-		{
-			z80->mem[loadaddr] = getc(file);
-			loadaddr++;
-			z80->mem[loadaddr] = getc(file);
-			loadaddr++;
-		}
-	}
-
-	return TRUE;
-}
+/* the machine interrupt() stops */
+static z80info *current = NULL;
 
 
+/* print the profile and save the opcode and call counts when the
+   program exits, however it does */
 static void
-suffix(char *str, const char *suff)
+report(void)
 {
-	while(*str != '\0' && *str != '.')
-		str++;
-
-	strcpy(str, suff);
-}
-
-
-boolean
-loadfile(z80info *z80, const char *fname)
-{
-	char buf[200];
-	FILE *fp;
-	int ret;
-
-	if ((fp = fopen(fname, "r")) != NULL)
-	{
-		ret = loadhex(z80, fp);
-		fclose(fp);
-		return ret;
-	}
-
-	strcpy(buf, fname);
-	suffix(buf, ".hex");
-
-	if ((fp = fopen(buf, "r")) != NULL)
-	{
-		ret = loadhex(z80, fp);
-		fclose(fp);
-		return ret;
-	}
-
-	strcpy(buf, fname);
-	suffix(buf, ".X");
-
-	if ((fp = fopen(buf, "r")) != NULL)
-	{
-		ret = loadpisces(z80, fp);
-		fclose(fp);
-		return ret;
-	}
-
-	return FALSE;
-}
-
-
-
-/* input  --  z80 input instruction  --  this function is called whenever
-   an input ports is referenced from the z80 to handle the real I/O  --
-   it returns a byte to the z80 just like the real I/O instruction  --
-   the arguments represent the data on the bus as it would be for a real
-   z80 - this routine is restarted later if there is no input pending,
-   and we must wait for some to occur */
-
-boolean
-input(z80info *z80, byte haddr, byte laddr, byte *val)
-{
-	unsigned int data;
-
-	/* just uses the lower 8-bits of the I/O address for now... */
-	switch (laddr)
-	{
-
-	/* return a character from the keyboard - wait for it if necessary  --
-	   return "last" if we have already read in something via 0x01 */
-	case 0x00:
-		if (1)
-		{
-#if defined macintosh
-			EventRecord ev;
-
-		again:
-			fflush(stdout);
-
-			while (!WaitNextEvent(keyDownMask | autoKeyMask,
-					&ev, 20, nil))
-				;
-
-			data = ev.message & charCodeMask;
-
-			if ((data == '.' && (ev.modifiers & cmdKey)) ||
-					data == INTR_CHAR)
-			{
-				command(z80);
-				goto again;
-			}
-			else if (data == 'q' && (ev.modifiers & cmdKey))
-				exit(0);
-#elif defined DJGPP
-			fflush(stdout);
-			data = getkey();
-
-			while (data == INTR_CHAR)
-			{
-				command(z80);
-				data = getkey();
-			}
-#else	/* TCGETA */
-			fflush(stdout);
-			data = kget(0);
-			/* data = getchar(); */
-
-			while ((data > 0x7f && errno == EINTR) ||
-					data == INTR_CHAR)
-			{
-				command(z80);
-				data = kget(0);
-				/* data = getchar(); */
-			}
-#endif
-		}
-
-		*val = data & 0x7F;
-		break;
-
-	/* return 0xFF if we have a character waiting to be read - save the
-	   character in "last" for 0x00 above */
-	case 0x01:
-#if defined macintosh
-		{
-			EventRecord ev;
-			*val = EventAvail(keyDownMask | autoKeyMask, &ev) ?
-					0xFF : 0;
-		}
-#elif defined DJGPP
-		*val = (kbhit()) ? 0xFF : 0;
-#else	/* UNIX or BeBox */
-		fflush(stdout);
-
-		if (constat())
-			*val = 0xFF;
-		else
-			*val = 0x00;
-
-#endif
-		break;
-
-	/* default - prompt the user for an input byte */
-	default:
-		resetterm();
-		printf("INPUT : addr = %X%X    DATA = ", haddr, laddr);
-		fflush(stdout);
-		scanf("%x", &data);
-		setterm();
-		*val = data;
-		break;
-	}
-
-	return TRUE;
-}
-
-
-/*-----------------------------------------------------------------------*\
- |  output  --  output the data at the specified I/O address
-\*-----------------------------------------------------------------------*/
-
-void
-output(z80info *z80, byte haddr, byte laddr, byte data)
-{
-	if (laddr == 0xFF) {
-		/* BIOS call - interrupt the z80 before the next instruction
-		   since we may have to mess with the PC & other stuff -
-		   otherwise we would do it right here */
-		z80->event = TRUE;
-		z80->halt = TRUE;
-		z80->syscall = TRUE;
-		z80->biosfn = data;
-
-		if (z80->trace)
-		{
-			printf("BIOS call %d\r\n", z80->biosfn);
-
-			if (logfile)
-				fprintf(logfile, "BIOS call %d\r\n",
-					z80->biosfn);
-		}
-	} else if (laddr == 0) {
-		/* output a character to the screen */
-		/* putchar(data); */
-		vt52(data);
-
-		if (logfile != NULL)
-			putc(data, logfile);
-	} else {
-		/* dump the data for our user */
-		printf("OUTPUT: addr = %X%X  DATA = %X\r\n", haddr, laddr,data);
-	}
-}
-
-
-
-/*-----------------------------------------------------------------------*\
- |  haltcpu  --  this is called after the z80 halts  --  it is used for
- |  tracing & such
-\*-----------------------------------------------------------------------*/
-
-void
-haltcpu(z80info *z80)
-{
-	z80->halt = FALSE;
-
-	/* we were interrupted by a Unix signal */
-	if (z80->sig)
-	{
-		if (z80->sig != SIGINT)
-			printf("\r\nCaught signal %d.\r\n", z80->sig);
-
-		z80->sig = 0;
-		command(z80);
+	if (current == NULL)
 		return;
-	}
 
-	/* we are tracing execution of the z80 */
-	if (z80->trace)
-	{
-		/* re-enable tracing */
-		z80->event = TRUE;
-		z80->halt = TRUE;
-		dumptrace(z80);
+	if (current->prof != NULL)
+		profreport(current, stderr);
 
-		if (z80->step)
-			command(z80);
-	}
+	opstatsave(current);
 
-	/* a CP/M syscall - done here so tracing still works */
-	if (z80->syscall)
-	{
-		z80->syscall = FALSE;
-		bios(z80, z80->biosfn);
-	}
+	if (current->callstatsfile != NULL)
+		callstatsave(current, current->callstatsfile);
 }
 
-word
-read_mem(z80info *z80, word addr)
-{
-#ifdef MEM_BREAK
-	if (z80->membrk[addr] & M_BREAKPOINT)
-	{
-		fprintf(stderr, "\r\nBreak at 0x%X\r\n", addr);
-	}
-	else if (z80->membrk[addr] & M_READ_PROTECT)
-	{
-		fprintf(stderr,
-			"\r\nAttempt to read protected memory at 0x%X\r\n",
-			addr);
-	}
-	else if (z80->membrk[addr] & M_MEM_MAPPED_IO)
-	{
-		fprintf(stderr,
-			"\r\nAttempt to perform mem-mapped input at 0x%X\r\n",
-			addr);
-		/* fake some sort of I/O here and return its value */
-	}
-
-	dumptrace(z80);
-	command(z80);
-#endif	/* MEM_BREAK */
-
-	return z80->mem[addr];
-}
-
-word
-write_mem(z80info *z80, word addr, byte val)
-{
-#ifdef MEM_BREAK
-	if (z80->membrk[addr] & M_BREAKPOINT)
-	{
-		fprintf(stderr, "\r\nBreak at 0x%X\r\n", addr);
-	}
-	else if (z80->membrk[addr] & M_WRITE_PROTECT)
-	{
-		fprintf(stderr,
-			"\r\nAttempt to write to protected memory at 0x%X\r\n",
-			addr);
-	}
-	else if (z80->membrk[addr] & M_MEM_MAPPED_IO)
-	{
-		fprintf(stderr,
-			"\r\nAttempt to perform mem-mapped output at 0x%X\r\n",
-			addr);
-		/* fake some sort of I/O here and set mem to its value, */
-		/* then return */
-	}
-
-	dumptrace(z80);
-	command(z80);
-#endif	/* MEM_BREAK */
-
-	return z80->mem[addr] = val;
-}
-
-void
-undefinstr(z80info *z80, byte instr)
-{
-	printf("\r\nIllegal instruction 0x%.2X at PC=0x%.4X\r\n",
-		instr, PC - 1);
-	command(z80);
-}
-
-
 
 /*-----------------------------------------------------------------------*\
  |  quit -- terminate this program after cleaning up -- this it is       |
@@ -1008,14 +468,15 @@ static void
 quit(int sig)
 {
 	printf("\r\nCaught signal %d.\r\n", sig);
+
+	if (current != NULL)
+		tracesave(current, "signal");
+
 	resetterm();
 	exit(2);
 }
 
 
-/* this is needed by both interrupt() and main() */
-static z80info *z80 = NULL;
-
 
 /*-----------------------------------------------------------------------*\
  |  interrupt  --  this is called when we get a usable signal from Unix
@@ -1025,11 +486,11 @@ static void
 interrupt(int s)
 {
 	/* we tell the z80 to stop when convenient, then reset & continue */
-	if (z80 != NULL)
+	if (current != NULL)
 	{
-	    z80->event = TRUE;
-	    z80->halt = TRUE;
-	    z80->sig = s;
+	    current->event = TRUE;
+	    current->halt = TRUE;
+	    current->sig = s;
 	}
 
 	signal(s, interrupt);
@@ -1045,21 +506,69 @@ main(int argc, const char *argv[])
 	int x;
 	char cmd[256];
 	int help = 0;
+	const char *loadstatefile = NULL;
+	const char *recordfile = NULL;
+	const char *replayfile = NULL;
+	const char *tracefile = NULL;
+	long tracesize = 0;
+	const char *symfile = NULL;
+	long every = 0;
+	const char *opfile = NULL;
+	long opevery = 0;
+	z80info *z80;
 
 	cmd[0] = 0;
 
+	z80 = new_z80info();
+
+	if (z80 == NULL)
+		return -1;
+
+	z80->monitor = command;
+
 	for (x = 1; x < argc; ++x) {
 		if (argv[x][0] == '-' && argv[x][1] == '-') {
 			if (!strcmp(argv[x], "--help")) {
 				help = 1;
 			} else if (!strcmp(argv[x], "--exec")) {
-				exec = 1;
+				z80->exec = 1;
 			} else if (!strcmp(argv[x], "--nobdos")) {
-				nobdos = 1;
+				z80->nobdos = 1;
 			} else if (!strcmp(argv[x], "--trace_bdos")) {
-				trace_bdos = 1;
+				z80->trace_bdos = 1;
 			} else if (!strcmp(argv[x], "--strace")) {
-				strace = 1;
+				z80->strace = 1;
+			} else if (!strcmp(argv[x], "--nommap")) {
+				z80->nommap = 1;
+			} else if (!strcmp(argv[x], "--overlay") && x + 1 < argc) {
+				z80->overlaydir = argv[++x];
+			} else if (!strcmp(argv[x], "--save-state") && x + 1 < argc) {
+				z80->savestatefile = argv[++x];
+			} else if (!strcmp(argv[x], "--load-state") && x + 1 < argc) {
+				loadstatefile = argv[++x];
+			} else if (!strcmp(argv[x], "--trace-ring") && x + 1 < argc) {
+				tracefile = argv[++x];
+			} else if (!strcmp(argv[x], "--trace-size") && x + 1 < argc) {
+				tracesize = atol(argv[++x]);
+			} else if (!strcmp(argv[x], "--profile") && x + 1 < argc) {
+				every = atol(argv[++x]);
+			} else if (!strcmp(argv[x], "--symbols") && x + 1 < argc) {
+				symfile = argv[++x];
+			} else if (!strcmp(argv[x], "--opstats") && x + 1 < argc) {
+				opfile = argv[++x];
+			} else if (!strcmp(argv[x], "--opstats-time") && x + 1 < argc) {
+				opevery = atol(argv[++x]);
+			} else if (!strcmp(argv[x], "--callstats") && x + 1 < argc) {
+				z80->callstatsfile = argv[++x];
+			} else if (!strcmp(argv[x], "--record") && x + 1 < argc) {
+				recordfile = argv[++x];
+			} else if (!strcmp(argv[x], "--replay") && x + 1 < argc) {
+				replayfile = argv[++x];
+			} else if (!strcmp(argv[x], "--disks") && x + 1 < argc) {
+				if (diskconfig(z80, argv[++x]) != 0)
+					exit(1);
+			} else if (!strcmp(argv[x], "--batch_conout")) {
+				z80->con.batch = 1;
 			} else {
 				fprintf(stderr, "Unknown option %s\n", argv[x]);
 				exit(1);
@@ -1081,19 +590,92 @@ main(int argc, const char *argv[])
 		fprintf(stderr, "    --exec         Execute the command and exit\n");
 		fprintf(stderr, "    --nobdos       Do not emulate BDOS: only emulate BIOS\n");
 		fprintf(stderr, "                   Real disk images will be used.        \n");
+		fprintf(stderr, "    --nommap       Access disk images through a track cache\n");
+		fprintf(stderr, "                   instead of mapping them into memory\n");
+		fprintf(stderr, "    --disks file   Read drive geometries from file\n");
+		fprintf(stderr, "    --save-state file\n");
+		fprintf(stderr, "                   Save a snapshot the first time the\n");
+		fprintf(stderr, "                   program waits for console input\n");
+		fprintf(stderr, "    --load-state file\n");
+		fprintf(stderr, "                   Start from a snapshot instead of booting\n");
+		fprintf(stderr, "    --record file  Record what the session reads from\n");
+		fprintf(stderr, "                   outside, so that it can be replayed\n");
+		fprintf(stderr, "    --replay file  Replay a recorded session, without the\n");
+		fprintf(stderr, "                   terminal, and check it does the same\n");
+		fprintf(stderr, "    --overlay dir  Leave disk images untouched: keep the\n");
+		fprintf(stderr, "                   sectors written in overlay files in dir\n");
+		fprintf(stderr, "    --trace-ring file\n");
+		fprintf(stderr, "                   Keep the last instructions executed, and\n");
+		fprintf(stderr, "                   save them in file on a crash, breakpoint\n");
+		fprintf(stderr, "                   or the H command (see tracedump)\n");
+		fprintf(stderr, "    --trace-size n Keep n instructions (default 65536)\n");
+		fprintf(stderr, "    --profile n    Sample the PC every n instructions, and\n");
+		fprintf(stderr, "                   count and time BDOS and BIOS calls: the\n");
+		fprintf(stderr, "                   report is printed at exit or by U\n");
+		fprintf(stderr, "    --symbols file Name the hot spots from an L80 .SYM or\n");
+		fprintf(stderr, "                   M80 .PRN file\n");
+		fprintf(stderr, "    --callstats file\n");
+		fprintf(stderr, "                   Save the counts and times of the BDOS\n");
+		fprintf(stderr, "                   and BIOS calls at exit and on SIGUSR1\n");
+		fprintf(stderr, "    --opstats file Count each opcode form executed, and save\n");
+		fprintf(stderr, "                   the counts at exit as CSV (JSON if file\n");
+		fprintf(stderr, "                   ends in .json): needs -DOPCODE_STATS\n");
+		fprintf(stderr, "    --opstats-time n\n");
+		fprintf(stderr, "                   Also time one instruction in n\n");
 		fprintf(stderr, "    --trace_bdos   Trace BDOS calls\n");
+		fprintf(stderr, "    --batch_conout Buffer console output until input is\n");
+		fprintf(stderr, "                   needed instead of after every call\n");
 		fprintf(stderr, "\n");
 		exit(0);
 	}
 
 	if (cmd[0]) {
-		stuff_cmd = cmd;
+		z80->stuff_cmd = cmd;
 	}
 
-	z80 = new_z80info();
+	if (z80->con.batch)
+		setvbuf(stdout, NULL, _IOFBF, 16384);
 
-	if (z80 == NULL)
-		return -1;
+	current = z80;
+
+	if (tracefile != NULL && traceon(z80, tracefile, tracesize) != 0)
+		exit(1);
+
+	if (every > 0 && (profon(z80, every) != 0 ||
+				(symfile != NULL && profsymbols(z80, symfile) != 0)))
+		exit(1);
+
+	if (opfile != NULL && opstatson(z80, opfile, opevery) != 0)
+		exit(1);
+
+	atexit(report);
+
+	if (loadstatefile != NULL && loadstate(z80, loadstatefile) != 0)
+		exit(1);
+
+	if (replayfile != NULL)
+	{
+		/* no terminal: the input comes from the recording */
+		z80->con.embedded = TRUE;
+		z80->monitor = NULL;
+
+		if (replaystart(z80, replayfile) != 0)
+			exit(1);
+
+		if (loadstatefile == NULL)
+			sysreset(z80);
+
+		while (!z80->finished)
+		{
+			z80_emulator(z80, 100000);
+			replayoutput(z80);
+		}
+
+		exit(recordend(z80) ? 1 : 0);
+	}
+
+	if (recordfile != NULL && recordstart(z80, recordfile) != 0)
+		exit(1);
 
 	initterm();
 
@@ -1110,10 +692,14 @@ main(int argc, const char *argv[])
 #ifdef SIGINT
 	signal(SIGINT, interrupt);
 #endif
+#ifdef SIGUSR1
+	signal(SIGUSR1, interrupt);
+#endif
 
 	setterm();
 
-	sysreset(z80);
+	if (loadstatefile == NULL)
+		sysreset(z80);
 
 	while (1)
 	{
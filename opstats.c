@@ -0,0 +1,258 @@
+/*-----------------------------------------------------------------------*\
+ |  opstats.c  --  count how often each opcode form is executed, and    |
+ |  time a sample of them, in a build with -DOPCODE_STATS              |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+
+
+#ifdef OPCODE_STATS
+
+static double
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Save the counts in "file" at the end, timing one instruction in
+   "every" (none if 0).  The time it takes to read the clock is measured
+   first, to be taken off each timing. */
+
+int
+opstatson(z80info *z80, const char *file, long every)
+{
+	double t, best = 1e9;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+	{
+		t = nsnow();
+		t = nsnow() - t;
+
+		if (t < best)
+			best = t;
+	}
+
+	z80->opfile = file;
+	z80->opevery = every > 0 ? every : 0;
+	z80->opleft = z80->opevery;
+	z80->optiming = FALSE;
+	z80->opoverhead = best;
+	return 0;
+}
+
+/* Called before each instruction when timing: finishes the timing of
+   the last one, if it was being timed, and starts this one if it is its
+   turn */
+
+void
+opsample(z80info *z80)
+{
+	if (z80->optiming)
+		opstop(z80);
+
+	if (--z80->opleft <= 0)
+	{
+		z80->opleft = z80->opevery;
+		z80->optiming = TRUE;
+		z80->opstart = nsnow();
+	}
+}
+
+/* Stop timing: called after an instruction, or when the emulator is
+   about to do something else (a BDOS call, or return) */
+
+void
+opstop(z80info *z80)
+{
+	double ns;
+
+	if (!z80->optiming)
+		return;
+
+	ns = nsnow() - z80->opstart - z80->opoverhead;
+	z80->opns[z80->opform] += ns > 0 ? ns : 0;
+	z80->optimed[z80->opform]++;
+	z80->optiming = FALSE;
+}
+
+
+/* The prefix bytes of each table of opcode forms, and where the opcode
+   goes after them (the DDCB and FDCB forms have a displacement first) */
+
+static const struct
+{
+	const char *name;
+	byte prefix[2];
+	int len, at;
+} tables[OP_TABLES] =
+{
+	{ "",		{ 0, 0 },	0, 0 },
+	{ "CB",		{ 0xCB, 0 },	1, 1 },
+	{ "ED",		{ 0xED, 0 },	1, 1 },
+	{ "DD",		{ 0xDD, 0 },	1, 1 },
+	{ "FD",		{ 0xFD, 0 },	1, 1 },
+	{ "DD CB",	{ 0xDD, 0xCB },	2, 3 },
+	{ "FD CB",	{ 0xFD, 0xCB },	2, 3 }
+};
+
+/* The instruction for a form, with zeros for its operands */
+
+static void
+opname(z80info *scratch, int form, char *buf, size_t size)
+{
+	int table = form >> 8;
+	char *s = NULL;
+	size_t len = 0, i, n;
+	FILE *fp;
+
+	memset(scratch->mem, 0, 8);
+	memcpy(scratch->mem, tables[table].prefix, tables[table].len);
+	scratch->mem[tables[table].at] = form & 0xFF;
+	buf[0] = '\0';
+
+	if ((fp = open_memstream(&s, &len)) == NULL)
+		return;
+
+	disassem(scratch, 0, fp);
+	fclose(fp);
+
+	/* one space between the mnemonic and the operands */
+	for (i = 0, n = 0; i < len && n < size - 1; i++)
+		if (s[i] != ' ' || (n > 0 && buf[n - 1] != ' '))
+			buf[n++] = s[i];
+
+	while (n > 0 && buf[n - 1] == ' ')
+		n--;
+
+	buf[n] = '\0';
+	free(s);
+}
+
+/* Is this a prefix, counted again in the table it leads to? */
+
+static int
+isprefix(int form)
+{
+	int op = form & 0xFF;
+
+	switch (form >> 8)
+	{
+	case OP_MAIN:
+		return op == 0xCB || op == 0xDD || op == 0xED || op == 0xFD;
+	case OP_DD:
+	case OP_FD:
+		return op == 0xCB;
+	}
+
+	return FALSE;
+}
+
+/* Write the counts as CSV, or JSON if the file name ends in ".json" */
+
+int
+opstatsave(z80info *z80)
+{
+	const char *file = z80->opfile;
+	unsigned long total = 0;
+	z80info *scratch;
+	char name[40];
+	int form, json, first = TRUE;
+	FILE *fp;
+
+	if (file == NULL)
+		return 0;
+
+	json = strlen(file) > 5 && !strcmp(file + strlen(file) - 5, ".json");
+
+	if ((fp = fopen(file, "w")) == NULL)
+	{
+		fprintf(stderr, "Cannot create '%s'\n", file);
+		return -1;
+	}
+
+	if ((scratch = new_z80info()) == NULL)
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	for (form = 0; form < OP_FORMS; form++)
+		if (!isprefix(form))
+			total += z80->opcount[form];
+
+	if (total == 0)
+		total = 1;
+
+	if (json)
+		fprintf(fp, "[\n");
+	else
+		fprintf(fp, "prefix,opcode,instruction,count,share,timed,avg_ns\n");
+
+	for (form = 0; form < OP_FORMS; form++)
+	{
+		unsigned long count = z80->opcount[form];
+		unsigned long timed = z80->optimed[form];
+		double avg = timed ? z80->opns[form] / timed : 0;
+
+		if (count == 0 || isprefix(form))
+			continue;
+
+		opname(scratch, form, name, sizeof name);
+
+		if (json)
+			fprintf(fp, "%s  {\"prefix\": \"%s\", \"opcode\": \"%.2X\", "
+					"\"instruction\": \"%s\", \"count\": %lu, "
+					"\"share\": %.6f, \"timed\": %lu, \"avg_ns\": %.1f}",
+					first ? "" : ",\n", tables[form >> 8].name,
+					form & 0xFF, name, count, (double)count / total,
+					timed, avg);
+		else
+			fprintf(fp, "%s,%.2X,\"%s\",%lu,%.6f,%lu,%.1f\n",
+					tables[form >> 8].name, form & 0xFF, name, count,
+					(double)count / total, timed, avg);
+
+		first = FALSE;
+	}
+
+	if (json)
+		fprintf(fp, "\n]\n");
+
+	delete_z80info(scratch);
+
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "Cannot write '%s'\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+#else	/* OPCODE_STATS */
+
+int
+opstatson(z80info *z80, const char *file, long every)
+{
+	(void)z80;
+	(void)file;
+	(void)every;
+	fprintf(stderr, "Opcode counts need a build with -DOPCODE_STATS\n");
+	return -1;
+}
+
+int
+opstatsave(z80info *z80)
+{
+	(void)z80;
+	return 0;
+}
+
+#endif	/* OPCODE_STATS */
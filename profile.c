@@ -0,0 +1,415 @@
+/*-----------------------------------------------------------------------*\
+ |  profile.c  --  sample the PC into a histogram, count and time the   |
+ |  BDOS and BIOS calls by where they are made from, and report the    |
+ |  hot spots by address or by routine in an M80/L80 symbol file       |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "defs.h"
+
+
+#define PROFTOP		20	/* lines in each part of the report */
+#define PROFSITES	4096	/* BDOS and BIOS call sites kept */
+#define SYMLEN		16
+
+struct callsite
+{
+	byte kind;		/* CALL_BDOS, CALL_BIOS or 0 if unused */
+	byte fn;
+	word site;		/* return address of the call */
+	unsigned long count;
+	double secs;		/* host time spent in the emulation */
+};
+
+struct symbol
+{
+	word addr;
+	char name[SYMLEN];
+};
+
+struct profile
+{
+	long every;		/* instructions between samples */
+	unsigned long samples;
+	unsigned long hist[0x10000L];
+	struct callsite sites[PROFSITES];
+	long nsites;
+	struct symbol *syms;	/* sorted by address */
+	long nsyms;
+};
+
+
+/* Profile the machine from now on, taking a sample every "every"
+   instructions */
+
+int
+profon(z80info *z80, long every)
+{
+	struct profile *p = (struct profile *)calloc(1, sizeof *p);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "Cannot allocate memory for a profile\n");
+		return -1;
+	}
+
+	p->every = every > 0 ? every : 1;
+	z80->prof = p;
+	z80->profleft = p->every;
+	return 0;
+}
+
+void
+profoff(z80info *z80)
+{
+	if (z80->prof != NULL)
+		free(z80->prof->syms);
+
+	free(z80->prof);
+	z80->prof = NULL;
+}
+
+/* Called from the emulator when profleft runs out */
+
+void
+profsample(z80info *z80)
+{
+	struct profile *p = z80->prof;
+
+	p->hist[PC]++;
+	p->samples++;
+	z80->profleft = p->every;
+}
+
+/* Count a BDOS or BIOS call against the address it was called from,
+   with the host time it took (see callstats.c) */
+
+void
+profcall(z80info *z80, int kind, int fn, word site, double secs)
+{
+	struct profile *p = z80->prof;
+	struct callsite *s;
+	unsigned h = ((unsigned)site * 31 + fn * 7 + kind) % PROFSITES;
+
+	for (s = &p->sites[h]; s->kind != 0; s = &p->sites[h])
+	{
+		if (s->kind == kind && s->fn == fn && s->site == site)
+			break;
+
+		h = (h + 1) % PROFSITES;
+	}
+
+	if (s->kind == 0)
+	{
+		if (p->nsites == PROFSITES - 1)
+			return;		/* full: leave one free to stop the search */
+
+		s->kind = kind;
+		s->fn = fn;
+		s->site = site;
+		p->nsites++;
+	}
+
+	s->count++;
+	s->secs += secs;
+}
+
+
+/* Symbols */
+
+static int
+isaddr(const char *s)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (!isxdigit((unsigned char)s[i]))
+			return FALSE;
+
+	/* M80 marks relocatable addresses with ' and externals with " */
+	return s[4] == '\0' || (strchr("'\"*", s[4]) && s[5] == '\0');
+}
+
+static int
+symcmp(const void *a, const void *b)
+{
+	return (int)((const struct symbol *)a)->addr -
+		(int)((const struct symbol *)b)->addr;
+}
+
+/* Read the symbols from an L80 .SYM file (lines of address, name pairs)
+   or the symbol table at the end of an M80 .PRN listing (name, address
+   pairs after "Symbols:") */
+
+int
+profsymbols(z80info *z80, const char *file)
+{
+	struct profile *p = z80->prof;
+	char line[256], *tok[32];
+	int prn, insyms, ntok, i, namefirst;
+	long size = 0;
+	FILE *fp;
+
+	if (p == NULL)
+		return -1;
+
+	if ((fp = fopen(file, "r")) == NULL)
+	{
+		fprintf(stderr, "Cannot open symbol file '%s'\n", file);
+		return -1;
+	}
+
+	i = strlen(file);
+	prn = i > 4 && (!strcmp(file + i - 4, ".PRN") ||
+			!strcmp(file + i - 4, ".prn"));
+	insyms = !prn;
+
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		if (!insyms)
+		{
+			insyms = strncmp(line, "Symbols", 7) == 0;
+			continue;
+		}
+
+		for (ntok = 0, tok[0] = strtok(line, " \t\r\n\f\032");
+				tok[ntok] != NULL && ntok < 31;
+				tok[++ntok] = strtok(NULL, " \t\r\n\f\032"))
+			;
+
+		if (ntok < 2)
+			continue;
+
+		namefirst = !isaddr(tok[0]) && isaddr(tok[1]);
+
+		for (i = 0; i + 1 < ntok; i += 2)
+		{
+			const char *a = tok[i + namefirst], *n = tok[i + !namefirst];
+
+			if (!isaddr(a))
+				continue;
+
+			if (p->nsyms == size)
+			{
+				struct symbol *s;
+
+				size = size ? size * 2 : 256;
+				s = (struct symbol *)realloc(p->syms, size * sizeof *s);
+
+				if (s == NULL)
+				{
+					fclose(fp);
+					return -1;
+				}
+
+				p->syms = s;
+			}
+
+			p->syms[p->nsyms].addr = (word)strtoul(a, NULL, 16);
+			strncpy(p->syms[p->nsyms].name, n, SYMLEN - 1);
+			p->syms[p->nsyms].name[SYMLEN - 1] = '\0';
+			p->nsyms++;
+		}
+	}
+
+	fclose(fp);
+	qsort(p->syms, p->nsyms, sizeof *p->syms, symcmp);
+	return 0;
+}
+
+/* Where the program's symbols end: the CCP, the 2K below the BDOS
+   page that the word at 6 points into */
+
+static long
+symtop(z80info *z80)
+{
+	return (z80->mem[7] << 8) - 0x800L;
+}
+
+/* The symbol at or before addr, or NULL */
+
+static const struct symbol *
+findsym(z80info *z80, word addr)
+{
+	struct profile *p = z80->prof;
+	long lo = 0, hi = p->nsyms;
+
+	if (addr >= symtop(z80))
+		return NULL;
+
+	while (lo < hi)
+	{
+		long mid = (lo + hi) / 2;
+
+		if (p->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 ? &p->syms[lo - 1] : NULL;
+}
+
+static void
+putsym(FILE *fp, z80info *z80, word addr, int width)
+{
+	const struct symbol *s = findsym(z80, addr);
+	char buf[SYMLEN + 8];
+
+	if (s == NULL)
+		buf[0] = '\0';
+	else if (s->addr == addr)
+		sprintf(buf, "%s", s->name);
+	else
+		sprintf(buf, "%s+%X", s->name, addr - s->addr);
+
+	if (width > 0)
+		fprintf(fp, "%-*s", width, buf);
+	else if (buf[0] != '\0')
+		fprintf(fp, "  %s", buf);	/* last on the line */
+}
+
+
+/* Report */
+
+struct hit
+{
+	unsigned long count;
+	word addr;
+};
+
+static int
+histcmp(const void *a, const void *b)
+{
+	unsigned long x = ((const struct hit *)a)->count;
+	unsigned long y = ((const struct hit *)b)->count;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int
+sitecmp(const void *a, const void *b)
+{
+	double x = (*(struct callsite *const *)a)->secs;
+	double y = (*(struct callsite *const *)b)->secs;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+struct routine
+{
+	unsigned long samples;
+	const char *name;
+};
+
+static int
+routinecmp(const void *a, const void *b)
+{
+	unsigned long x = ((const struct routine *)a)->samples;
+	unsigned long y = ((const struct routine *)b)->samples;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void
+profreport(z80info *z80, FILE *fp)
+{
+	struct profile *p = z80->prof;
+	struct hit *hits;
+	struct callsite **sites;
+	unsigned long total;
+	long n, i, j;
+
+	if (p == NULL || (hits = (struct hit *)malloc(0x10000L * sizeof *hits)) == NULL)
+		return;
+
+	fprintf(fp, "\nProfile: %lu samples, one every %ld instructions\n",
+			p->samples, p->every);
+
+	total = p->samples ? p->samples : 1;
+
+	for (n = i = 0; i < 0x10000L; i++)
+		if (p->hist[i])
+		{
+			hits[n].count = p->hist[i];
+			hits[n++].addr = (word)i;
+		}
+
+	qsort(hits, n, sizeof *hits, histcmp);
+	fprintf(fp, "\n   samples      %%  addr  %-20s instruction\n",
+			p->nsyms ? "symbol" : "");
+
+	for (i = 0; i < n && i < PROFTOP; i++)
+	{
+		fprintf(fp, "%10lu %5.1f%%  %.4X  ", hits[i].count,
+				100.0 * hits[i].count / total, hits[i].addr);
+		putsym(fp, z80, hits[i].addr, 20);
+		fprintf(fp, " ");
+		disassem(z80, hits[i].addr, fp);
+		fprintf(fp, "\n");
+	}
+
+	/* by routine: each symbol has the addresses up to the next one */
+	if (p->nsyms > 0)
+	{
+		long top = symtop(z80);
+
+		struct routine *r = (struct routine *)malloc(p->nsyms * sizeof *r);
+
+		if (r != NULL)
+		{
+			for (i = 0; i < p->nsyms; i++)
+			{
+				long end = i + 1 < p->nsyms ? p->syms[i + 1].addr : top;
+
+				r[i].samples = 0;
+				r[i].name = p->syms[i].name;
+
+				for (j = p->syms[i].addr; j < end; j++)
+					r[i].samples += p->hist[j];
+			}
+
+			qsort(r, p->nsyms, sizeof *r, routinecmp);
+			fprintf(fp, "\n   samples      %%  routine\n");
+
+			for (i = 0; i < p->nsyms && i < PROFTOP && r[i].samples; i++)
+				fprintf(fp, "%10lu %5.1f%%  %s\n", r[i].samples,
+						100.0 * r[i].samples / total, r[i].name);
+
+			free(r);
+		}
+	}
+
+	/* calls, by host time */
+	if (p->nsites > 0 && (sites = (struct callsite **)
+				malloc(p->nsites * sizeof *sites)) != NULL)
+	{
+		for (n = i = 0; i < PROFSITES; i++)
+			if (p->sites[i].kind != 0)
+				sites[n++] = &p->sites[i];
+
+		qsort(sites, n, sizeof *sites, sitecmp);
+		fprintf(fp, "\n     calls   host ms  call                    from\n");
+
+		for (i = 0; i < n && i < PROFTOP; i++)
+		{
+			struct callsite *s = sites[i];
+			char call[40];
+
+			sprintf(call, "%s %d %.16s", s->kind == CALL_BDOS ? "BDOS" : "BIOS",
+					s->fn, s->kind == CALL_BDOS ? bdos_decode(s->fn) :
+					bios_decode(s->fn));
+			fprintf(fp, "%10lu %9.1f  %-23s %.4X", s->count,
+					s->secs * 1000, call, s->site);
+			putsym(fp, z80, s->site, 0);
+			fprintf(fp, "\n");
+		}
+
+		free(sites);
+	}
+
+	free(hits);
+}
@@ -0,0 +1,623 @@
+/*-----------------------------------------------------------------------*\
+ |  record.c  --  record everything from outside that a session depends |
+ |  on, so that it can be replayed exactly, and replay it.              |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "defs.h"
+#include "vt.h"
+
+/* A recording is a header, giving the options that change what the
+   guest sees, and then the events.  Each event is a type byte, the
+   number of instructions since the last event (so the instruction it
+   happened at) and what was read.  Numbers are unsigned LEB128. */
+
+#define RECMAGIC	"CPMREC\032"
+#define RECMAGICLEN	7
+#define RECVERSION	2
+
+#define R_NOBDOS	1	/* header flags */
+#define R_EXEC		2
+
+#define EV_KEY		1	/* kget(): character + 1 */
+#define EV_STAT		2	/* constat() found input: polls finding none
+				   are not recorded */
+#define EV_TIME		3	/* dotime(): the 5 bytes of the time buffer */
+#define EV_STATFS	4	/* BDOS disk parameters: total, avail in K */
+#define EV_FILE		5	/* file opened: name length, name, length, data */
+#define EV_IMAGE	6	/* disk image opened: drive, length, hash */
+#define EV_END		7	/* CP/M exited */
+
+struct recorder
+{
+	FILE *fp;		/* recording to */
+	byte *log;		/* replaying from */
+	long len, pos;
+	unsigned long last;	/* icount of the last event */
+	int ended;		/* no more events: diverged or used up */
+	int diverged;
+	unsigned long outhash;	/* of the console output of a replay */
+	clock_t start;
+	char *scratch;		/* a replay's host files are kept here */
+	char imaged[MAXDISCS];	/* the drive's image has been checked */
+};
+
+#define FNVBASIS	2166136261UL
+#define FNVPRIME	16777619UL
+
+static unsigned long
+fnv(unsigned long h, const byte *p, long len)
+{
+	while (len-- > 0)
+		h = ((h ^ *p++) * FNVPRIME) & 0xFFFFFFFFUL;
+
+	return h;
+}
+
+static void
+putnum(FILE *fp, unsigned long n)
+{
+	while (n >= 0x80)
+	{
+		putc((n & 0x7F) | 0x80, fp);
+		n >>= 7;
+	}
+
+	putc(n, fp);
+}
+
+static unsigned long
+getnum(struct recorder *r)
+{
+	unsigned long n = 0;
+	int shift = 0;
+
+	while (r->pos < r->len && shift < 32)
+	{
+		byte b = r->log[r->pos++];
+
+		n |= (unsigned long)(b & 0x7F) << shift;
+		shift += 7;
+
+		if (!(b & 0x80))
+			break;
+	}
+
+	return n;
+}
+
+/* Start an event */
+
+static void
+putev(z80info *z80, int type)
+{
+	struct recorder *r = z80->rec;
+
+	putc(type, r->fp);
+	putnum(r->fp, z80->icount - r->last);
+	r->last = z80->icount;
+}
+
+/* Stop replaying because the guest has not done what it did when it was
+   recorded, or has gone further */
+
+static void
+stop(z80info *z80, const char *why)
+{
+	struct recorder *r = z80->rec;
+
+	if (!r->ended)
+	{
+		r->ended = TRUE;
+		r->diverged = why != NULL;
+
+		if (why != NULL)
+			fprintf(stderr, "\r\nReplay diverged at instruction %lu: %s\r\n",
+					z80->icount, why);
+	}
+
+	finish(z80);
+}
+
+/* Take the next event when replaying, if it is of this type and happened
+   at this instruction, or return FALSE */
+
+static int
+nextev(z80info *z80, int type)
+{
+	struct recorder *r = z80->rec;
+	long pos = r->pos;
+
+	if (r->ended || pos >= r->len || r->log[pos] != type)
+		return FALSE;
+
+	r->pos++;
+
+	if (r->last + getnum(r) != z80->icount)
+	{
+		r->pos = pos;
+		return FALSE;
+	}
+
+	r->last = z80->icount;
+	return TRUE;
+}
+
+/* Take the next event, which must be of this type */
+
+static int
+needev(z80info *z80, int type)
+{
+	struct recorder *r = z80->rec;
+
+	if (nextev(z80, type))
+		return TRUE;
+
+	if (r->pos >= r->len)
+		stop(z80, NULL);	/* the end of the recording */
+	else if (r->log[r->pos] == EV_END)
+		stop(z80, "it has gone on after CP/M exited");
+	else
+		stop(z80, "it reads something else here");
+
+	return FALSE;
+}
+
+
+/* Record to file from now on */
+
+int
+recordstart(z80info *z80, const char *file)
+{
+	struct recorder *r = (struct recorder *)calloc(1, sizeof *r);
+	const char *cmd = z80->stuff_cmd ? z80->stuff_cmd : "";
+
+	if (r == NULL || (r->fp = fopen(file, "wb")) == NULL)
+	{
+		fprintf(stderr, "Cannot create recording '%s'\n", file);
+		free(r);
+		return -1;
+	}
+
+	fwrite(RECMAGIC, 1, RECMAGICLEN, r->fp);
+	putc(RECVERSION, r->fp);
+	putc((z80->nobdos ? R_NOBDOS : 0) | (z80->exec ? R_EXEC : 0), r->fp);
+	fwrite(cmd, 1, strlen(cmd) + 1, r->fp);
+	r->last = z80->icount;
+	z80->rec = r;
+	return 0;
+}
+
+/* A new private directory for a replay's files */
+
+static char *
+scratchdir(void)
+{
+	const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char *dir = (char *)malloc(strlen(tmp) + 20);
+
+	if (dir == NULL)
+		return NULL;
+
+	sprintf(dir, "%s/cpmreplayXXXXXX", tmp);
+
+	if (mkdtemp(dir) == NULL)
+	{
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+/* Empty it and take it away */
+
+static void
+rmscratch(const char *dir)
+{
+	DIR *dp = opendir(dir);
+	struct dirent *de;
+	char *path;
+
+	if (dp != NULL)
+	{
+		while ((de = readdir(dp)) != NULL)
+		{
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+
+			path = (char *)malloc(strlen(dir) + strlen(de->d_name) + 2);
+
+			if (path != NULL)
+			{
+				sprintf(path, "%s/%s", dir, de->d_name);
+
+				if (remove(path) != 0)
+					rmscratch(path);	/* the overlays */
+
+				free(path);
+			}
+		}
+
+		closedir(dp);
+	}
+
+	rmdir(dir);
+}
+
+/* Where a host file the guest names is: when replaying, the last part of
+   the name in the scratch directory, so that the replay reads what was
+   recorded and changes nothing outside it */
+
+const char *
+replaypath(z80info *z80, const char *name, char *buf, size_t size)
+{
+	const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+
+	if (!z80->replay || z80->rec == NULL ||
+			strlen(z80->rec->scratch) + strlen(base) + 2 > size)
+		return name;
+
+	sprintf(buf, "%s/%s", z80->rec->scratch, base);
+	return buf;
+}
+
+/* The directory the guest's files are searched for in */
+
+const char *
+replaydir(z80info *z80)
+{
+	return z80->replay && z80->rec != NULL ? z80->rec->scratch : ".";
+}
+
+/* Replay a recording, taking the options it was made with */
+
+int
+replaystart(z80info *z80, const char *file)
+{
+	struct recorder *r = (struct recorder *)calloc(1, sizeof *r);
+	FILE *fp = fopen(file, "rb");
+	byte *cmd;
+
+	if (r == NULL || fp == NULL || fseek(fp, 0L, SEEK_END) != 0 ||
+			(r->len = ftell(fp)) < RECMAGICLEN + 3 ||
+			(r->log = (byte *)malloc(r->len)) == NULL ||
+			fseek(fp, 0L, SEEK_SET) != 0 ||
+			fread(r->log, 1, r->len, fp) != (size_t)r->len)
+	{
+		fprintf(stderr, "Cannot read recording '%s'\n", file);
+		goto fail;
+	}
+
+	fclose(fp);
+	fp = NULL;
+
+	if (memcmp(r->log, RECMAGIC, RECMAGICLEN) != 0 ||
+			r->log[RECMAGICLEN] != RECVERSION ||
+			(cmd = memchr(r->log + RECMAGICLEN + 2, 0,
+				r->len - RECMAGICLEN - 2)) == NULL)
+	{
+		fprintf(stderr, "'%s' is not a recording\n", file);
+		goto fail;
+	}
+
+	z80->nobdos = (r->log[RECMAGICLEN + 1] & R_NOBDOS) != 0;
+	z80->exec = (r->log[RECMAGICLEN + 1] & R_EXEC) != 0;
+
+	if (cmd != r->log + RECMAGICLEN + 2)
+		z80->stuff_cmd = (const char *)r->log + RECMAGICLEN + 2;
+
+	if ((r->scratch = scratchdir()) == NULL)
+	{
+		fprintf(stderr, "Cannot make a directory for the replay's files\n");
+		goto fail;
+	}
+
+	r->pos = cmd + 1 - r->log;
+	r->last = z80->icount;
+	r->outhash = FNVBASIS;
+	r->start = clock();
+	z80->rec = r;
+	z80->replay = TRUE;
+	return 0;
+
+fail:
+	if (fp != NULL)
+		fclose(fp);
+
+	if (r != NULL)
+		free(r->log);
+
+	free(r);
+	return -1;
+}
+
+/* Finish recording, or report on a replay.  Returns nonzero if the
+   replay diverged from the recording. */
+
+int
+recordend(z80info *z80)
+{
+	struct recorder *r = z80->rec;
+	int diverged;
+
+	if (r == NULL)
+		return 0;
+
+	if (!z80->replay)
+	{
+		putev(z80, EV_END);
+		fclose(r->fp);
+	}
+	else
+	{
+		double secs = (double)(clock() - r->start) / CLOCKS_PER_SEC;
+
+		if (!r->ended && nextev(z80, EV_END))
+			r->ended = TRUE;
+		else if (!r->ended)
+			fprintf(stderr, "\r\nReplay diverged at instruction %lu: "
+					"CP/M exited early\r\n", z80->icount);
+
+		fprintf(stderr, "Replayed %lu instructions in %.2fs", z80->icount,
+				secs);
+
+		if (secs > 0)
+			fprintf(stderr, " (%.1f MIPS)", z80->icount / secs / 1e6);
+
+		fprintf(stderr, ", output hash %08lx\n", r->outhash);
+		r->diverged |= !r->ended;
+	}
+
+	diverged = r->diverged;
+
+	if (r->scratch != NULL)
+	{
+		rmscratch(r->scratch);
+		free(r->scratch);
+	}
+
+	free(r->log);
+	free(r);
+	z80->rec = NULL;
+	return diverged;
+}
+
+/* Throw away the console output of a replay, keeping a hash of it so that
+   replays can be compared */
+
+void
+replayoutput(z80info *z80)
+{
+	const unsigned char *p;
+	long len = conoutput(z80, &p);
+
+	if (z80->rec != NULL)
+		z80->rec->outhash = fnv(z80->rec->outhash, p, len);
+}
+
+
+/* The events.  Each is called with what was read from outside when
+   recording, or instead of reading it when replaying, and returns what
+   the guest is to see. */
+
+int
+reckey(z80info *z80, int c)
+{
+	struct recorder *r = z80->rec;
+
+	if (!z80->replay)
+	{
+		putev(z80, EV_KEY);
+		putnum(r->fp, c + 1);
+		return c;
+	}
+
+	return needev(z80, EV_KEY) ? (int)getnum(r) - 1 : -1;
+}
+
+int
+recstat(z80info *z80, int ready)
+{
+	struct recorder *r = z80->rec;
+	long pos;
+
+	if (!z80->replay)
+	{
+		if (ready)
+			putev(z80, EV_STAT);
+
+		return ready;
+	}
+
+	if (nextev(z80, EV_STAT))
+		return 1;
+
+	/* a guest polling for input that will never come must not be left
+	   to poll forever */
+	pos = r->pos;
+
+	if (pos >= r->len)
+		stop(z80, NULL);
+	else
+	{
+		r->pos++;
+
+		if (r->last + getnum(r) < z80->icount)
+			stop(z80, "it has not polled for input where it did");
+
+		r->pos = pos;
+	}
+
+	return 0;
+}
+
+void
+rectime(z80info *z80, byte *t)
+{
+	struct recorder *r = z80->rec;
+
+	if (!z80->replay)
+	{
+		putev(z80, EV_TIME);
+		fwrite(t, 1, 5, r->fp);
+	}
+	else if (needev(z80, EV_TIME) && r->pos + 5 <= r->len)
+	{
+		memcpy(t, r->log + r->pos, 5);
+		r->pos += 5;
+	}
+}
+
+void
+recstatfs(z80info *z80, unsigned long *total, unsigned long *avail)
+{
+	struct recorder *r = z80->rec;
+
+	if (!z80->replay)
+	{
+		putev(z80, EV_STATFS);
+		putnum(r->fp, *total);
+		putnum(r->fp, *avail);
+	}
+	else if (needev(z80, EV_STATFS))
+	{
+		*total = getnum(r);
+		*avail = getnum(r);
+	}
+}
+
+/* A host file has been opened for reading: record what is in it.  When
+   replaying, this is called (with NULL) before the file is looked for,
+   and puts back what was in it.  A file from another directory (the
+   BDOS looks in CPMLIBDIR) is put back in the current one. */
+
+void
+recfile(z80info *z80, const char *path)
+{
+	struct recorder *r = z80->rec;
+
+	if (!z80->replay)
+	{
+		FILE *fp = fopen(path, "rb");
+		const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+		byte buf[4096];
+		long len = 0, n;
+
+		if (fp != NULL && fseek(fp, 0L, SEEK_END) == 0)
+			len = ftell(fp);
+
+		putev(z80, EV_FILE);
+		putnum(r->fp, strlen(name));
+		fputs(name, r->fp);
+		putnum(r->fp, len < 0 ? 0 : len);
+
+		if (fp != NULL)
+		{
+			rewind(fp);
+
+			while (len > 0 && (n = fread(buf, 1, sizeof buf, fp)) > 0)
+			{
+				fwrite(buf, 1, n, r->fp);
+				len -= n;
+			}
+
+			/* the file was shorter than it said: keep the log in step */
+			while (len-- > 0)
+				putc(0, r->fp);
+
+			fclose(fp);
+		}
+
+		return;
+	}
+
+	while (nextev(z80, EV_FILE))
+	{
+		char name[256], path[1024];
+		unsigned long namelen = getnum(r), len;
+		FILE *fp;
+
+		if (namelen >= sizeof name || r->pos + (long)namelen > r->len)
+		{
+			stop(z80, "bad file event");
+			return;
+		}
+
+		memcpy(name, r->log + r->pos, namelen);
+		name[namelen] = '\0';
+		r->pos += namelen;
+		len = getnum(r);
+
+		/* only a plain name, which goes in the scratch directory */
+		if (r->pos + (long)len > r->len || strlen(name) != namelen ||
+				strchr(name, '/') != NULL || !strcmp(name, "") ||
+				!strcmp(name, ".") || !strcmp(name, ".."))
+		{
+			stop(z80, "bad file event");
+			return;
+		}
+
+		replaypath(z80, name, path, sizeof path);
+
+		if ((fp = fopen(path, "wb")) == NULL ||
+				fwrite(r->log + r->pos, 1, len, fp) != len)
+			fprintf(stderr, "\r\nReplay cannot write '%s'\r\n", name);
+
+		if (fp != NULL)
+			fclose(fp);
+
+		r->pos += len;
+	}
+}
+
+/* A disk image has been opened for the first time: a replay needs the
+   image the recording started with, so only its size and a hash are
+   recorded, and checked */
+
+void
+recimage(z80info *z80, int drive, const char *path)
+{
+	struct recorder *r = z80->rec;
+	FILE *fp;
+	unsigned long h = FNVBASIS, len = 0;
+	byte buf[8192];
+	long n;
+
+	if (r->imaged[drive])
+		return;
+
+	r->imaged[drive] = TRUE;
+
+	if ((fp = fopen(path, "rb")) != NULL)
+	{
+		while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+		{
+			h = fnv(h, buf, n);
+			len += n;
+		}
+
+		fclose(fp);
+	}
+
+	if (!z80->replay)
+	{
+		putev(z80, EV_IMAGE);
+		putc(drive, r->fp);
+		putnum(r->fp, len);
+		putnum(r->fp, h);
+	}
+	else if (needev(z80, EV_IMAGE))
+	{
+		int d = r->log[r->pos++];
+		unsigned long rlen = getnum(r), rh = getnum(r);
+
+		if (d != drive || rlen != len || rh != h)
+			stop(z80, "a disk image is not what it was");
+	}
+}
@@ -0,0 +1,236 @@
+/*-----------------------------------------------------------------------*\
+ |  snapshot.c  --  save the state of the emulator to a file and start  |
+ |  from it again later, skipping the boot and program load.            |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* A snapshot is a header, the 64k of z80 memory at a fixed offset and
+   then the BDOS open file table.  All words are little-endian. */
+
+#define SNAPMAGIC	"CPMSNAP\032"
+#define SNAPMAGICLEN	8
+#define SNAPVERSION	1
+#define SNAPMEM		4096		/* offset of the memory image */
+#define SNAPFILES	(SNAPMEM + 0x10000L)	/* offset of the file table */
+
+/* header offsets */
+#define S_VERSION	8
+#define S_NOBDOS	9
+#define S_SILENT	10
+#define S_REGS		12	/* af bc de hl af' bc' de' hl' sp pc ix iy */
+#define S_I		36
+#define S_R		37
+#define S_IFF		38
+#define S_IFF2		39
+#define S_IMODE		40
+#define S_DRIVE		42
+#define S_DMA		44
+#define S_TRACK		46
+#define S_SECTOR	48
+#define S_FILESLEN	50
+#define S_SIZE		54
+
+#define PUTW(p, w)	((p)[0] = (w) & 0xFF, (p)[1] = ((w) >> 8) & 0xFF)
+#define GETW(p)		((p)[0] | ((p)[1] << 8))
+
+/* Save the machine state, with the PC set to pc */
+
+int
+savestate(z80info *z80, const char *file, word pc)
+{
+	byte hdr[SNAPMEM];
+	byte files[FILETABLESIZE];
+	word *regs[12];
+	long fileslen;
+	FILE *fp;
+	int i;
+
+	regs[0] = &AF;	regs[1] = &BC;	regs[2] = &DE;	regs[3] = &HL;
+	regs[4] = &AF2;	regs[5] = &BC2;	regs[6] = &DE2;	regs[7] = &HL2;
+	regs[8] = &SP;	regs[9] = &PC;	regs[10] = &IX;	regs[11] = &IY;
+
+	/* anything the guest wrote must be in the files we reopen */
+	fflush(NULL);
+	fileslen = bdos_savefiles(z80, files, sizeof files);
+
+	memset(hdr, 0, sizeof hdr);
+	memcpy(hdr, SNAPMAGIC, SNAPMAGICLEN);
+	hdr[S_VERSION] = SNAPVERSION;
+	hdr[S_NOBDOS] = z80->nobdos;
+	hdr[S_SILENT] = z80->silent_exit;
+
+	for (i = 0; i < 12; i++)
+		PUTW(hdr + S_REGS + 2 * i, *regs[i]);
+
+	PUTW(hdr + S_REGS + 2 * 9, pc);
+	hdr[S_I] = I;
+	hdr[S_R] = R;
+	hdr[S_IFF] = z80->iff;
+	hdr[S_IFF2] = z80->iff2;
+	hdr[S_IMODE] = z80->imode;
+	hdr[S_DRIVE] = z80->drive;
+	PUTW(hdr + S_DMA, z80->dma);
+	PUTW(hdr + S_TRACK, z80->track);
+	PUTW(hdr + S_SECTOR, z80->sector);
+	PUTW(hdr + S_FILESLEN, fileslen);
+
+	fp = fopen(file, "wb");
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Cannot create snapshot '%s'\r\n", file);
+		return -1;
+	}
+
+	if (fwrite(hdr, 1, sizeof hdr, fp) != sizeof hdr ||
+			fwrite(z80->mem, 1, 0x10000L, fp) != 0x10000L ||
+			fwrite(files, 1, fileslen, fp) != (size_t)fileslen ||
+			fclose(fp) != 0)
+	{
+		fprintf(stderr, "Cannot write snapshot '%s'\r\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called when the guest is about to wait for console input, with the PC
+   the wait should be resumed at: the first one saves the snapshot asked
+   for with z80->savestatefile. */
+
+void
+inputwait(z80info *z80, word pc)
+{
+	const char *file = z80->savestatefile;
+
+	if (file == NULL)
+		return;
+
+	z80->savestatefile = NULL;
+	savestate(z80, file, pc);
+}
+
+/* Restore the machine state saved by savestate().  The file is mapped
+   rather than read to save a buffer, but the memory image is still
+   copied into the machine, so each process has its own 64K. */
+
+int
+loadstate(z80info *z80, const char *file)
+{
+	byte *snap = NULL;
+	long len = 0;
+	word *regs[12];
+	int i;
+
+#ifndef NO_MMAP
+	struct stat statbuf;
+	FILE *fp = fopen(file, "rb");
+
+	if (fp != NULL && fstat(fileno(fp), &statbuf) == 0 &&
+			statbuf.st_size >= SNAPFILES)
+	{
+		void *p = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+				fileno(fp), 0);
+
+		if (p != MAP_FAILED)
+		{
+			snap = p;
+			len = statbuf.st_size;
+		}
+	}
+#else
+	FILE *fp = fopen(file, "rb");
+
+	if (fp != NULL && fseek(fp, 0L, SEEK_END) == 0 &&
+			(len = ftell(fp)) >= SNAPFILES &&
+			(snap = (byte *)malloc(len)) != NULL)
+	{
+		rewind(fp);
+
+		if (fread(snap, 1, len, fp) != (size_t)len)
+		{
+			free(snap);
+			snap = NULL;
+		}
+	}
+#endif
+
+	if (fp != NULL)
+		fclose(fp);
+
+	if (snap == NULL)
+	{
+		fprintf(stderr, "Cannot read snapshot '%s'\n", file);
+		return -1;
+	}
+
+	if (memcmp(snap, SNAPMAGIC, SNAPMAGICLEN) != 0 ||
+			snap[S_VERSION] != SNAPVERSION ||
+			SNAPFILES + GETW(snap + S_FILESLEN) > len)
+	{
+		fprintf(stderr, "'%s' is not a snapshot\n", file);
+		goto fail;
+	}
+
+	if (snap[S_NOBDOS] != (z80->nobdos != 0))
+	{
+		fprintf(stderr, "Snapshot '%s' was saved %s --nobdos\n", file,
+				snap[S_NOBDOS] ? "with" : "without");
+		goto fail;
+	}
+
+	if (bdos_loadfiles(z80, snap + SNAPFILES,
+				GETW(snap + S_FILESLEN)) != 0)
+		goto fail;
+
+	regs[0] = &AF;	regs[1] = &BC;	regs[2] = &DE;	regs[3] = &HL;
+	regs[4] = &AF2;	regs[5] = &BC2;	regs[6] = &DE2;	regs[7] = &HL2;
+	regs[8] = &SP;	regs[9] = &PC;	regs[10] = &IX;	regs[11] = &IY;
+
+	for (i = 0; i < 12; i++)
+		*regs[i] = GETW(snap + S_REGS + 2 * i);
+
+	I = snap[S_I];
+	R = snap[S_R];
+	z80->iff = snap[S_IFF];
+	z80->iff2 = snap[S_IFF2];
+	z80->imode = snap[S_IMODE];
+	z80->silent_exit = snap[S_SILENT];
+
+	memcpy(z80->mem, snap + SNAPMEM, 0x10000L);
+
+	/* the disk images are opened again as they are used */
+	biosresume(z80);
+	z80->drive = snap[S_DRIVE];
+	z80->dma = GETW(snap + S_DMA);
+	z80->track = GETW(snap + S_TRACK);
+	z80->sector = GETW(snap + S_SECTOR);
+
+	/* a snapshot taken on entry to the BDOS makes the call again when
+	   it is run, just as a machine waiting for input does */
+	z80->blocked = !z80->nobdos && PC == BDOS_HOOK;
+
+#ifndef NO_MMAP
+	munmap(snap, len);
+#else
+	free(snap);
+#endif
+	return 0;
+
+fail:
+#ifndef NO_MMAP
+	munmap(snap, len);
+#else
+	free(snap);
+#endif
+	return -1;
+}
@@ -0,0 +1,157 @@
+/*-----------------------------------------------------------------------*\
+ |  trace.c  --  keep the last instructions executed in a ring buffer,  |
+ |  cheaply enough to leave on, and save them for "tracedump"           |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+
+/* Start keeping the last "size" instructions, to be saved in "file" */
+
+int
+traceon(z80info *z80, const char *file, long size)
+{
+	tracering *t;
+
+	if (size <= 0)
+		size = TRACESIZE;
+
+	t = (tracering *)malloc(sizeof *t + (size - 1) * sizeof(tracent));
+
+	if (t == NULL)
+	{
+		fprintf(stderr, "Cannot allocate a trace of %ld instructions\n",
+				size);
+		return -1;
+	}
+
+	t->file = file;
+	t->size = size;
+	t->next = 0;
+	t->count = 0;
+	free(z80->ring);
+	z80->ring = t;
+	z80->wrote = -1;
+	return 0;
+}
+
+/* Fill in the memory the last instruction wrote */
+
+static void
+lastwrote(z80info *z80)
+{
+	tracering *t = z80->ring;
+	tracent *e;
+
+	if (t->count > 0)
+	{
+		e = &t->ent[(t->next ? t->next : t->size) - 1];
+		e->wrote = (word)z80->wrote;
+		e->flags = z80->wrote >= 0 ? TR_WROTE : 0;
+	}
+}
+
+/* Called before every instruction: finishes the entry of the last one
+   and starts one for this one */
+
+void
+traceinsn(z80info *z80)
+{
+	tracering *t = z80->ring;
+	tracent *e;
+	word pc = PC;
+
+	lastwrote(z80);
+
+	e = &t->ent[t->next];
+	e->icount = z80->icount;
+	e->pc = pc;
+	e->af = AF;
+	e->bc = BC;
+	e->de = DE;
+	e->hl = HL;
+	e->ix = IX;
+	e->iy = IY;
+	e->sp = SP;
+	e->op[0] = z80->mem[pc];
+	e->op[1] = z80->mem[(word)(pc + 1)];
+	e->op[2] = z80->mem[(word)(pc + 2)];
+	e->op[3] = z80->mem[(word)(pc + 3)];
+	e->wrote = 0;
+	e->flags = 0;
+	z80->wrote = -1;
+
+	if (++t->next == t->size)
+		t->next = 0;
+
+	if (t->count < t->size)
+		t->count++;
+}
+
+static void
+putword(FILE *fp, unsigned long n, int len)
+{
+	while (len-- > 0)
+	{
+		putc(n & 0xFF, fp);
+		n >>= 8;
+	}
+}
+
+/* Save the trace, oldest instruction first: "why" says what stopped the
+   program, for the person reading it */
+
+int
+tracesave(z80info *z80, const char *why)
+{
+	tracering *t = z80->ring;
+	tracent *e;
+	FILE *fp;
+	long i, n;
+
+	if (t == NULL)
+		return -1;
+
+	lastwrote(z80);
+
+	if ((fp = fopen(t->file, "wb")) == NULL)
+	{
+		fprintf(stderr, "\r\nCannot create trace file '%s'\r\n", t->file);
+		return -1;
+	}
+
+	fwrite(TRACEMAGIC, 1, TRACEMAGICLEN, fp);
+	putc(TRACEVERSION, fp);
+	putword(fp, t->count, 4);
+	fwrite(why, 1, strlen(why) + 1, fp);
+
+	for (i = 0, n = t->next - t->count; i < t->count; i++, n++)
+	{
+		e = &t->ent[n < 0 ? n + t->size : n % t->size];
+		putword(fp, e->icount, 4);
+		putword(fp, e->pc, 2);
+		putword(fp, e->af, 2);
+		putword(fp, e->bc, 2);
+		putword(fp, e->de, 2);
+		putword(fp, e->hl, 2);
+		putword(fp, e->ix, 2);
+		putword(fp, e->iy, 2);
+		putword(fp, e->sp, 2);
+		fwrite(e->op, 1, 4, fp);
+		putword(fp, e->wrote, 2);
+		putc(e->flags, fp);
+	}
+
+	if (fclose(fp) != 0)
+	{
+		fprintf(stderr, "\r\nCannot write trace file '%s'\r\n", t->file);
+		return -1;
+	}
+
+	fprintf(stderr, "\r\nLast %ld instructions saved in '%s'\r\n",
+			t->count, t->file);
+	return 0;
+}
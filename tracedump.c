@@ -0,0 +1,121 @@
+/*-----------------------------------------------------------------------*\
+ |  tracedump.c  --  print a trace saved by "cpm --trace-ring" in the    |
+ |  format of the monitor's trace mode                                  |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+
+static unsigned long
+getword(const byte *p, int len)
+{
+	unsigned long n = 0;
+
+	while (len-- > 0)
+		n = (n << 8) | p[len];
+
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = NULL;
+	long count, last = -1, i;
+	byte head[TRACEMAGICLEN + 5], ent[TRACEENTLEN];
+	char why[256];
+	z80info *z80;
+	FILE *fp;
+	int c, n;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			last = atol(argv[++i]);
+		else if (file == NULL && argv[i][0] != '-')
+			file = argv[i];
+		else
+			file = NULL, i = argc;
+	}
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "tracedump [-n count] file\n\n");
+		fprintf(stderr, "Print the instructions saved by cpm --trace-ring, "
+				"oldest first\n");
+		fprintf(stderr, "  -n count  Only the last count instructions\n");
+		return 1;
+	}
+
+	if ((fp = fopen(file, "rb")) == NULL)
+	{
+		fprintf(stderr, "Cannot open '%s'\n", file);
+		return 1;
+	}
+
+	if (fread(head, 1, sizeof head, fp) != sizeof head ||
+			memcmp(head, TRACEMAGIC, TRACEMAGICLEN) != 0 ||
+			head[TRACEMAGICLEN] != TRACEVERSION)
+	{
+		fprintf(stderr, "'%s' is not a trace\n", file);
+		return 1;
+	}
+
+	count = getword(head + TRACEMAGICLEN + 1, 4);
+
+	for (n = 0; (c = getc(fp)) > 0; )
+		if (n < (int)sizeof why - 1)
+			why[n++] = c;
+
+	why[n] = '\0';
+	printf("%ld instructions, saved on %s\n", count, why);
+
+	/* disassem() reads the instruction from memory: each one is put
+	   back where it was in an otherwise empty machine */
+	if ((z80 = new_z80info()) == NULL)
+		return 1;
+
+	for (i = 0; i < count && fread(ent, 1, TRACEENTLEN, fp) == TRACEENTLEN;
+			i++)
+	{
+		if (last >= 0 && i < count - last)
+			continue;
+
+		PC = getword(ent + 4, 2);
+		AF = getword(ent + 6, 2);
+		BC = getword(ent + 8, 2);
+		DE = getword(ent + 10, 2);
+		HL = getword(ent + 12, 2);
+		IX = getword(ent + 14, 2);
+		IY = getword(ent + 16, 2);
+		SP = getword(ent + 18, 2);
+
+		for (n = 0; n < 4; n++)
+			z80->mem[(word)(PC + n)] = ent[20 + n];
+
+		printf("%10lu  ", getword(ent, 4));
+		printf("a%.2X f%.2X bc%.4X de%.4X hl%.4X ",
+				A, F, BC, DE, HL);
+		printf("ix%.4X iy%.4X sp%.4X pc%.4X:%.2X  ",
+				IX, IY, SP, PC, z80->mem[PC]);
+		disassem(z80, PC, stdout);
+		n = disassemlen();
+
+		if (ent[26] & TR_WROTE)
+			printf("%*s[%.4lX]", n < 24 ? 24 - n : 1, "",
+					getword(ent + 24, 2));
+
+		printf("\n");
+	}
+
+	if (i < count)
+		fprintf(stderr, "'%s' is cut short after %ld instructions\n",
+				file, i);
+
+	fclose(fp);
+	delete_z80info(z80);
+	return 0;
+}
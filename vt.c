@@ -1,33 +1,141 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include "defs.h"
 #include "vt.h"
 
-int last = -1;
+#if !defined _WIN32 && !defined macintosh && !defined DJGPP
+#	if defined POSIX_TTY
+#		include <sys/termios.h>
+#		define termio termios
+#	elif defined BeBox
+#		include <termios.h>
+#		define termio termios
+#	else
+#		include <termio.h>
+#	endif
+#	define HAVE_TERMIO
+#endif
+
+/* The console of each machine is the terminal of the process, unless it
+   is embedded: then its input is whatever has been fed to it with
+   coninput() and its output is collected for conoutput() to hand back.
+   The read-ahead and escape sequence state is per machine. */
+
+#define CON	(&z80->con)
+
+#ifdef HAVE_TERMIO
+static struct termio rawterm, oldterm;	/* for raw terminal I/O */
+#endif
+
+static int have_term = 0;   /* FALSE until initterm() has set up the tty */
+
+/*-----------------------------------------------------------------------*\
+ |  resetterm  --  reset terminal characteristics to original settings
+\*-----------------------------------------------------------------------*/
+
+void
+resetterm(void)
+{
+	fflush(stdout);
+#ifdef HAVE_TERMIO
+    if (have_term)
+		tcsetattr(fileno(stdin), TCSADRAIN, &oldterm);
+#endif
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  setterm  --  set terminal characteristics to raw mode
+\*-----------------------------------------------------------------------*/
+
+void
+setterm(void)
+{
+#ifdef HAVE_TERMIO
+    if (have_term)
+		tcsetattr(fileno(stdin), TCSADRAIN, &rawterm);
+#endif
+}
+
+
+
+/*-----------------------------------------------------------------------*\
+ |  initterm  --  initialize terminal stuff  --  called once on startup
+ |  and then after returning from a sub-shell
+\*-----------------------------------------------------------------------*/
+
+void
+initterm(void)
+{
+#ifndef HAVE_TERMIO
+		fprintf(stderr, "Sorry, terminal not found, using cooked mode.\n");
+		have_term = 0;
+#else
+	if (tcgetattr(fileno(stdin), &oldterm))
+	{
+		fprintf(stderr, "Sorry, terminal not found, using cooked mode.\n");
+		have_term = 0;
+	}
+        else {
+	have_term = 1;
+	rawterm = oldterm;
+	rawterm.c_iflag &= ~(ICRNL | IXON | IXOFF | INLCR | ICRNL);
+	rawterm.c_lflag &= ~(ICANON | ECHO);
+	rawterm.c_cc[VINTR] = -1;
+	rawterm.c_cc[VSUSP] = -1;
+	rawterm.c_cc[VQUIT] = -1;
+	rawterm.c_cc[VERASE] = -1;
+	rawterm.c_cc[VKILL] = -1;
+	tcsetattr(fileno(stdin), TCSADRAIN, &rawterm);
+  }
+#endif
+}
 
-int kpoll(int w)
+int kpoll(z80info *z80, int w)
 {
 	int c;
 	unsigned char d;
 	int tries;
-	if (last != -1) {
-		c = last;
-		last = -1;
+	if (CON->last != -1) {
+		c = CON->last;
+		CON->last = -1;
 		return c;
 	}
+	if (CON->embedded) {
+		if (CON->inpos == CON->inlen)
+			return -1;
+		c = CON->in[CON->inpos++];
+		if (CON->inpos == CON->inlen)
+			CON->inpos = CON->inlen = 0;
+		return c;
+	}
+	/* whatever we wrote must be visible before we wait for a reply */
+	if (CON->written) {
+		IOSTAT(1, 0);
+		CON->written = 0;
+	}
+	fflush(stdout);
 	for (tries = 0; tries != 1; ++tries) {
 #ifndef _WIN32
 		int flags;
 		if (w) {
 			flags = fcntl(fileno(stdin), F_GETFL);
 			fcntl(fileno(stdin), F_SETFL, flags | O_NONBLOCK);
+			IOSTAT(2, 0);
 		}
 #endif
 		c = read(fileno(stdin), &d, 1);
+		IOSTAT(1, c == 1);
 #ifndef _WIN32
 		if (w) {
 			fcntl(fileno(stdin), F_SETFL, flags);
+			IOSTAT(1, 0);
 		}
 #endif
 		if (c == 1) {
@@ -35,60 +143,128 @@ int kpoll(int w)
 			return d;
 		}
 /*		usleep(1); */
+#ifdef SIGUSR1
+		/* asked for the call counts while waiting: give them and
+		   go on waiting */
+		if (c < 0 && errno == EINTR && z80->sig == SIGUSR1) {
+			z80->sig = 0;
+			callstatsave(z80, z80->callstatsfile);
+			--tries;
+		}
+#endif
 	}
 /*	printf("\r\n--- no char after esc? ---\r\n"); fflush(stdout); */
 	return -1;
 }
 
-int constat()
+/* An embedded machine which has polled for input IDLEPOLLS times in a
+   row, each within IDLEGAP instructions of the last, is only waiting for
+   it: it is stopped at the next instruction to be run again once there
+   is some (or when its owner likes, since it may also be keeping time) */
+
+#define IDLEPOLLS	64
+#define IDLEGAP		256
+
+static void idlepoll(z80info *z80)
+{
+	if (z80->icount - CON->lastpoll > IDLEGAP)
+		CON->idlepolls = 0;
+	CON->lastpoll = z80->icount;
+	if (++CON->idlepolls == IDLEPOLLS) {
+		CON->idlepolls = 0;
+		CON->idle = 1;
+		z80->blocked = TRUE;
+		z80->event = TRUE;
+		z80->halt = TRUE;
+	}
+}
+
+static int constat1(z80info *z80)
 {
-	if (last != -1)
+	if (CON->last != -1)
 		return 1;
-	last = kpoll(1);
-	if (last != -1)
+	CON->last = kpoll(z80, 1);
+	if (CON->last != -1)
 		return 1;
-	else
-		return 0;
+	if (CON->embedded)
+		idlepoll(z80);
+	return 0;
+}
+
+/* When a session is being recorded or replayed (see record.c), what is
+   read from the console goes through recstat() and reckey() */
+
+int constat(z80info *z80)
+{
+	if (z80->rec == NULL)
+		return constat1(z80);
+	return recstat(z80, z80->replay ? 0 : constat1(z80));
 }
 
 /* Input FIFO */
 
-#define FIFO_SIZE 4
-int stuff[FIFO_SIZE];
-int stuff_ptr;
+void kpush(z80info *z80, int c)
+{
+	if (c != -1 && CON->stuff_ptr != KFIFO_SIZE) {
+		CON->stuff[CON->stuff_ptr++] = c;
+	}
+}
+
+/* Add len characters to the input of an embedded console */
 
-void kpush(int c)
+int coninput(z80info *z80, const unsigned char *s, long len)
 {
-	if (c != -1 && stuff_ptr != FIFO_SIZE) {
-		stuff[stuff_ptr++] = c;
+	if (CON->inlen + len > CON->insize) {
+		long size = CON->insize ? CON->insize : 256;
+		unsigned char *p;
+		while (size < CON->inlen + len)
+			size *= 2;
+		if (!(p = (unsigned char *)realloc(CON->in, size)))
+			return -1;
+		CON->in = p;
+		CON->insize = size;
 	}
+	memcpy(CON->in + CON->inlen, s, len);
+	CON->inlen += len;
+	return 0;
+}
+
+/* Hand back the output of an embedded console collected so far: it is
+   only valid until the machine runs again */
+
+long conoutput(z80info *z80, const unsigned char **s)
+{
+	long len = CON->outlen;
+	*s = CON->out;
+	CON->outlen = 0;
+	return len;
 }
 
-int kget(int w)
+static int kget1(z80info *z80, int w)
 {
         int c;
-        if (stuff_ptr) {
+        if (CON->stuff_ptr) {
         	int x;
-        	c = stuff[0];
-        	for (x = 0; x != stuff_ptr - 1; ++x) {
-        		stuff[x] = stuff[x + 1];
+        	c = CON->stuff[0];
+        	for (x = 0; x != CON->stuff_ptr - 1; ++x) {
+        		CON->stuff[x] = CON->stuff[x + 1];
         	}
-		stuff_ptr--;
-        	stuff[x] = 0;
+		CON->stuff_ptr--;
+        	CON->stuff[x] = 0;
         	return c;
         }
 
-        c = kpoll(w);
+        c = kpoll(z80, w);
         if (c != 27) {
                 return c;
         }
         /* We got ESC.. see if any chars follow */
-        c = kpoll(1);
+        c = kpoll(z80, 1);
 
         if (c == -1) { /* Just ESC */
         	return 27;
         } else if (c == '[') {
-                c = kpoll(0);
+                c = kpoll(z80, 0);
                 if (c == 'A') { /* Up arrow */
                         return 'E' - '@';
                 } else if (c == 'B') { /* Down arrow */
@@ -98,38 +274,38 @@ int kget(int w)
                 } else if (c == 'D') { /* Left arrow */
                         return 'S' - '@';
                 } else if (c == '3') { /* Delete key */
-                        c = kpoll(0);
+                        c = kpoll(z80, 0);
                         return 'G' - '@';
                 } else if (c == '2') { /* Insert key */
-                        c = kpoll(0);
+                        c = kpoll(z80, 0);
                         return 'V' - '@';
                 } else if (c == '5') { /* PgUp */
-                        c = kpoll(0);
+                        c = kpoll(z80, 0);
                         return 'R' - '@';
                 } else if (c == '6') { /* PgDn */
-                        c = kpoll(0);
+                        c = kpoll(z80, 0);
                         return 'C' - '@';
                 } else if (c == '1' || c == '7') { /* Home */
-                	kpush('s');
-                        c = kpoll(0);
+                	kpush(z80, 's');
+                        c = kpoll(z80, 0);
                         return 'Q' - '@';
                 } else if (c == '4' || c == '8') { /* End */
-                        kpush('d');
-                        c = kpoll(0);
+                        kpush(z80, 'd');
+                        c = kpoll(z80, 0);
                         return 'Q' - '@';
                 } else if (c == 'H') { /* Home */
-                        kpush('s');
+                        kpush(z80, 's');
                         return 'Q' - '@';
                 } else if (c == 'F') { /* End */
-                        kpush('d');
+                        kpush(z80, 'd');
                         return 'Q' - '@';
                 } else {
-                	kpush('[');
-                	kpush(c);
+                	kpush(z80, '[');
+                	kpush(z80, c);
                         return 27;
 		}
         } else if (c == 'O') {
-                c = kpoll(0);
+                c = kpoll(z80, 0);
                 if (c == 'A') { /* Up arrow */
                         return 'E' - '@';
                 } else if (c == 'B') { /* Down arrow */
@@ -143,24 +319,37 @@ int kget(int w)
                 } else if (c == 'c') { /* Ctrl right arrow (rxvt) */
                         return 'F' - '@';
                 } else if (c == 'H') { /* Home */
-                        kpush('s');
+                        kpush(z80, 's');
                         return 'Q' - '@';
                 } else if (c == 'F') { /* End */
-                        kpush('d');
+                        kpush(z80, 'd');
                         return 'Q' - '@';
 		} else if (c == 'P' || c == 'Q' || c == 'R' || c == 'S') {
 			return INTR_CHAR;
                 } else {
-                	kpush('O');
-                	kpush(c);
+                	kpush(z80, 'O');
+                	kpush(z80, c);
                 	return 27;
 		}
         } else {
-        	kpush(c);
+        	kpush(z80, c);
         	return 27;
         }
 }
 
+int kget(z80info *z80, int w)
+{
+	int c;
+	if (z80->rec == NULL)
+		return kget1(z80, w);
+	if (z80->replay)
+		return reckey(z80, 0);
+	c = kget1(z80, w);
+	if (c == -1 && CON->embedded)
+		return c;	/* the guest will ask again */
+	return reckey(z80, c);
+}
+
 /*
 [5~ PgUp
 [6~ PgDn
@@ -170,174 +359,238 @@ int kget(int w)
 Oc  Ctrl-Rtarw
 */
 
-void putch(char c) {	/* output character without postprocessing */
-    write(fileno(stdout), &c, 1);
+/* Console output goes through stdio so that it stays in order with the
+   printf()s done elsewhere.  It is flushed before we look for input and,
+   unless batch is set, at the end of each console call. */
+
+void conflush(z80info *z80) {
+    if (!CON->batch && !CON->embedded) {
+	if (CON->written) {
+	    IOSTAT(1, 0);
+	    CON->written = 0;
+	}
+	fflush(stdout);
+    }
 }
 
-void putmes(const char *s) {
-    write(fileno(stdout), s, strlen(s));
+static void conwrite(z80info *z80, const void *s, long len) {
+    IOSTAT(0, len);
+    if (!CON->embedded) {
+	CON->written = 1;
+	fwrite(s, 1, len, stdout);
+	return;
+    }
+    if (CON->outlen + len > CON->outsize) {
+	long size = CON->outsize ? CON->outsize : 1024;
+	unsigned char *p;
+	while (size < CON->outlen + len)
+	    size *= 2;
+	if (!(p = (unsigned char *)realloc(CON->out, size)))
+	    return;
+	CON->out = p;
+	CON->outsize = size;
+    }
+    memcpy(CON->out + CON->outlen, s, len);
+    CON->outlen += len;
 }
 
-void vt52(int c) {	/* simple vt52,adm3a => ANSI conversion */
-    static int state = 0, x, y;
+static void putch(z80info *z80, char c) {	/* output character without postprocessing */
+    conwrite(z80, &c, 1);
+}
+
+static void putmes(z80info *z80, const char *s) {
+    conwrite(z80, s, strlen(s));
+}
+
+#ifdef DEBUGLOG
+static FILE *vtlog = NULL;
+#endif
+
+void vt52(z80info *z80, int c) {	/* simple vt52,adm3a => ANSI conversion */
     char buff[32];
 #ifdef DEBUGLOG
-    static FILE *log = NULL;
-    if (!log)
-	log = fopen("cpm.out", "w");
-    fputc(c, log);
+    if (!vtlog)
+	vtlog = fopen("cpm.out", "w");
+    fputc(c, vtlog);
 #endif
-    switch (state) {
+    switch (CON->state) {
     case 0:
 	switch (c) {
 #ifdef VBELL
         case 0x07:              /* BEL: flash screen */
-            putmes("\033[?5h\033[?5l");
+            putmes(z80, "\033[?5h\033[?5l");
 	    break;
 #endif
 	case 0x7f:		/* DEL: echo BS, space, BS */
-	    putmes("\b \b");
+	    putmes(z80, "\b \b");
 	    break;
 	case 0x1a:		/* adm3a clear screen */
 	case 0x0c:		/* vt52 clear screen */
-	    putmes("\033[H\033[2J");
+	    putmes(z80, "\033[H\033[2J");
 	    break;
 	case 0x1e:		/* adm3a cursor home */
-	    putmes("\033[H");
+	    putmes(z80, "\033[H");
 	    break;
 	case 0x1b:
-	    state = 1;	/* esc-prefix */
+	    CON->state = 1;	/* esc-prefix */
 	    break;
 	case 1:
-	    state = 2;	/* cursor motion prefix */
+	    CON->state = 2;	/* cursor motion prefix */
 	    break;
 	case 2:		/* insert line */
-	    putmes("\033[L");
+	    putmes(z80, "\033[L");
 	    break;
 	case 3:		/* delete line */
-	    putmes("\033[M");
+	    putmes(z80, "\033[M");
 	    break;
 	case 0x18: case 5:	/* clear to eol */
-	    putmes("\033[K");
+	    putmes(z80, "\033[K");
 	    break;
 	case 0x12: case 0x13:
 	    break;
 	default:
-	    putch(c);
+	    putch(z80, c);
 	}
 	break;
     case 1:	/* esc was sent */
 	switch (c) {
         case 0x1b:
-	    putch(c);
+	    putch(z80, c);
 	    break;
 	case '=':
 	case 'Y':
-	    state = 2;
+	    CON->state = 2;
 	    break;
 	case 'E':	/* insert line */
-	    putmes("\033[L");
+	    putmes(z80, "\033[L");
 	    break;
 	case 'R':	/* delete line */
-	    putmes("\033[M");
+	    putmes(z80, "\033[M");
 	    break;
 	case 'B':	/* enable attribute */
-	    state = 4;
+	    CON->state = 4;
 	    break;
 	case 'C':	/* disable attribute */
-	    state = 5;
+	    CON->state = 5;
 	    break;
         case 'L':       /* set line */
         case 'D':       /* delete line */
-            state = 6;
+            CON->state = 6;
             break;
 	case '*':       /* set pixel */
 	case ' ':       /* clear pixel */
-	    state = 8;
+	    CON->state = 8;
 	    break;
 	default:		/* some true ANSI sequence? */
-	    state = 0;
-	    putch(0x1b);
-	    putch(c);
+	    CON->state = 0;
+	    putch(z80, 0x1b);
+	    putch(z80, c);
 	}
 	break;
     case 2:
-	y = c - ' '+1;
-	state = 3;
+	CON->y = c - ' '+1;
+	CON->state = 3;
 	break;
     case 3:
-	x = c - ' '+1;
-	state = 0;
-	sprintf(buff, "\033[%d;%dH", y, x);
-	putmes(buff);
+	CON->x = c - ' '+1;
+	CON->state = 0;
+	sprintf(buff, "\033[%d;%dH", CON->y, CON->x);
+	putmes(z80, buff);
 	break;
     case 4:	/* <ESC>+B prefix */
-        state = 0;
+        CON->state = 0;
         switch (c) {
 	case '0': /* start reverse video */
-	    putmes("\033[7m");
+	    putmes(z80, "\033[7m");
 	    break;
 	case '1': /* start half intensity */
-	    putmes("\033[1m");
+	    putmes(z80, "\033[1m");
 	    break;
 	case '2': /* start blinking */
-	    putmes("\033[5m");
+	    putmes(z80, "\033[5m");
 	    break;
 	case '3': /* start underlining */
-	    putmes("\033[4m");
+	    putmes(z80, "\033[4m");
 	    break;
 	case '4': /* cursor on */
-	    putmes("\033[?25h");
+	    putmes(z80, "\033[?25h");
 	    break;
 	case '6': /* remember cursor position */
-	    putmes("\033[s");
+	    putmes(z80, "\033[s");
 	    break;
 	case '5': /* video mode on */
 	case '7': /* preserve status line */
 	    break;
 	default:
-	    putch(0x1b);
-	    putch('B');
-	    putch(c);
+	    putch(z80, 0x1b);
+	    putch(z80, 'B');
+	    putch(z80, c);
         }
 	break;
     case 5:	/* <ESC>+C prefix */
-        state = 0;
+        CON->state = 0;
         switch (c) {
 	case '0': /* stop reverse video */
-	    putmes("\033[27m");
+	    putmes(z80, "\033[27m");
 	    break;
 	case '1': /* stop half intensity */
-	    putmes("\033[m");
+	    putmes(z80, "\033[m");
 	    break;
 	case '2': /* stop blinking */
-	    putmes("\033[25m");
+	    putmes(z80, "\033[25m");
 	    break;
 	case '3': /* stop underlining */
-	    putmes("\033[24m");
+	    putmes(z80, "\033[24m");
 	    break;
 	case '4': /* cursor off */
-	    putmes("\033[?25l");
+	    putmes(z80, "\033[?25l");
 	    break;
 	case '6': /* restore cursor position */
-	    putmes("\033[u");
+	    putmes(z80, "\033[u");
 	    break;
 	case '5': /* video mode off */
 	case '7': /* don't preserve status line */
 	    break;
 	default:
-	    putch(0x1b);
-	    putch('C');
-	    putch(c);
+	    putch(z80, 0x1b);
+	    putch(z80, 'C');
+	    putch(z80, c);
         }
 	break;
 /* set/clear line/point */
     case 6:
     case 7:
     case 8:
-        state ++;
+        CON->state ++;
 	break;
     case 9:
-	state = 0;
+	CON->state = 0;
     } 
 }
+
+/* Write len characters, stripped to 7 bits, as vt52() would.  Runs of
+   printable characters can not change the escape state, so they are
+   appended to the output in one go. */
+
+void vt52_puts(z80info *z80, const unsigned char *s, long len) {
+    long n;
+    while (len > 0) {
+	if (CON->state == 0) {
+	    for (n = 0; n != len && s[n] >= ' ' && s[n] < 0x7f; ++n)
+		;
+	    if (n) {
+		conwrite(z80, s, n);
+#ifdef DEBUGLOG
+		if (!vtlog)
+		    vtlog = fopen("cpm.out", "w");
+		fwrite(s, 1, n, vtlog);
+#endif
+		s += n;
+		len -= n;
+		continue;
+	    }
+	}
+	vt52(z80, 0x7F & *s++);
+	--len;
+    }
+}
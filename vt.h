@@ -1,14 +1,28 @@
 
+/* Console of a machine (see vt.c): every call takes the z80info whose
+   console it is */
+
 /* Return true if input character available */
-int constat();
+int constat(struct z80info *z80);
 
 /* Get input character:
     w = 0: wait until we have a character
     w = 1: return -1 if we don' have one
+   An embedded console never waits: it returns -1 when its input is used up
     */
-int kget(int w);
+int kget(struct z80info *z80, int w);
 
 /* Write character to terminal */
-void vt52(int c);
+void vt52(struct z80info *z80, int c);
+
+/* Write a string of len characters to terminal */
+void vt52_puts(struct z80info *z80, const unsigned char *s, long len);
+
+/* Flush terminal output, unless consecutive writes are being batched */
+void conflush(struct z80info *z80);
+
+/* Feed input to / take the output from an embedded console */
+int coninput(struct z80info *z80, const unsigned char *s, long len);
+long conoutput(struct z80info *z80, const unsigned char **s);
 
 #define INTR_CHAR	31	/* control-underscore */
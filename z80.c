@@ -10,10 +10,6 @@
 #include <string.h>
 #include "defs.h"
 
-int nobdos;
-int strace;
-int bdos_return = -1;
-
 /* All the following macros assume access to a parameter named "z80" */
 
 
@@ -41,9 +37,11 @@ static const byte bitmask[] =
 	BIT4, BIT5, BIT6, BIT7
 };
 
-/* parity setting array - initialized in init_z80info() below */
-static int parityarr[0x100];
-static boolean parity_inited = FALSE;
+/* parity setting array: 1 for the values with an even number of bits */
+#define P2(n)	n, n ^ 1, n ^ 1, n
+#define P4(n)	P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n)	P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+static const byte parityarr[0x100] = { P6(1), P6(0), P6(0), P6(1) };
 
 
 
@@ -185,12 +183,53 @@ z80_emulator(z80info *z80, int count)
 	longword ttt;
 	int i, j, h, n, s;
 
+	/* a machine stopped to wait for console input tries again: a BDOS
+	   call is made again, anything else is resumed by executing the
+	   instruction that was waiting */
+	if (z80->finished)
+		return FALSE;
+
+#ifdef OPCODE_STATS
+	/* an instruction that stopped to wait is not timed */
+	z80->optiming = FALSE;
+#endif
+
+	if (z80->blocked)
+	{
+		z80->blocked = FALSE;
+
+		if (!z80->nobdos && PC == BDOS_HOOK)
+			dobdos(z80);
+
+		if (z80->blocked || z80->finished)
+			return FALSE;
+	}
+
 	/* main loop  --  all "goto"s eventually end up here */
 infloop:
 
 	/* only execute "count" instructions at one whack */
 	if (count-- <= 0)
+	{
+#ifdef OPCODE_STATS
+		opstop(z80);
+#endif
 		return TRUE;
+	}
+
+	z80->icount++;
+
+	/* keep the last instructions for tracedump */
+	if (z80->ring != NULL)
+		traceinsn(z80);
+
+	if (z80->prof != NULL && --z80->profleft <= 0)
+		profsample(z80);
+
+#ifdef OPCODE_STATS
+	if (z80->opevery > 0)
+		opsample(z80);
+#endif
 
 	/* see if the z80 is to be interrupted for any reason */
 	if (EVENT)
@@ -199,8 +238,13 @@ infloop:
 
 		/* HALT execution if desired - this is for tracing & such */
 		if (HALT)
+		{
 			haltcpu(z80);
 
+			if (z80->blocked || z80->finished)
+				return FALSE;
+		}
+
 		/* "i" is used to see if we need to get the next opcode or not*/
 		i = TRUE;
 
@@ -284,6 +328,8 @@ infloop:
 	}
 
 
+	OPSTAT(OP_MAIN, t);
+
 	/* main "switch" for initial opcode */
 	switch (t)
 	{
@@ -946,7 +992,10 @@ contsw:
 
 	case 0xDB:					/* in a,n */
 		if (!input(z80, A, MEM(PC), &t1))
+		{
+			PC--;
 			return FALSE;
+		}
 
 		A = t1;
 		PC++;
@@ -963,33 +1012,39 @@ contsw:
 	}					/* end of main "switch" */
 
 	/* Trace system calls */
-	if (strace && PC == BDOS_HOOK)
+	if (z80->strace && PC == BDOS_HOOK)
 	{
 	        printf("\r\nbdos call %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
 		for (i = 0; i < 8; ++i)
 		    printf(" %4x", z80->mem[SP + 2*i]
 			   + 256 * z80->mem[SP + 2*i + 1]);
 		printf(")\r\n");
-		bdos_return = SP + 2;
+		z80->bdos_return = SP + 2;
 		if (bdos_fcb(C))
 			bdos_fcb_dump(z80);
 	}
 
-	if (SP == bdos_return)
+	if (SP == z80->bdos_return)
 	{
 	        printf("\r\nbdos return %d %s (AF=%04x BC=%04x DE=%04x HL =%04x SP=%04x STACK=", C, bdos_decode(C), AF, BC, DE, HL, SP);
 		for (i = 0; i < 8; ++i)
 		    printf(" %4x", z80->mem[SP + 2*i]
 			   + 256 * z80->mem[SP + 2*i + 1]);
 		printf(")\r\n");
-		bdos_return = -1;
+		z80->bdos_return = -1;
 		if (bdos_fcb(C))
 			bdos_fcb_dump(z80);
 	}
 
-	if (!nobdos && PC == BDOS_HOOK)
+	if (!z80->nobdos && PC == BDOS_HOOK)
 	{
-		check_BDOS_hook(z80);
+#ifdef OPCODE_STATS
+		opstop(z80);
+#endif
+		dobdos(z80);
+
+		if (z80->blocked || z80->finished)
+			return FALSE;
 	}
 
 	goto infloop;
@@ -1000,6 +1055,7 @@ contsw:
 bitinstr:
 	t = MEM(PC);
 	PC++;
+	OPSTAT(OP_CB, t);
 
 	switch (t)
 	{
@@ -1369,6 +1425,7 @@ ireginstr:
 	rr = REGIXY[(t >> 5) & MASK1];
 	t = MEM(PC);
 	PC++;
+	OPSTAT(rr == &IX ? OP_DD : OP_FD, t);
 
 	/* note: in comments below, "ir" is either "ix" or "iy" */
 	switch (t)
@@ -1561,6 +1618,7 @@ ireginstr:
 extinstr: 
 	t = MEM(PC);
 	PC++;
+	OPSTAT(OP_ED, t);
 	switch (t)
 	{
 	/* 8-bit load group */
@@ -1770,7 +1828,10 @@ extinstr:
 	case 0x70:					/* in ?,c */
 	case 0x78:					/* in a,c */
 		if (!input(z80, B, C, &t1))
+		{
+			PC -= 2;
 			return FALSE;
+		}
 
 		v = *REG[(t >> 3) & MASK3] = t1;
 		setflag(SIGN, v & BIT7);
@@ -1795,7 +1856,10 @@ extinstr:
 	case 0xB2:					/* inir */
 	case 0xBA:					/* indr */
 		if (!input(z80, B, C, &t1))
+		{
+			PC -= 2;
 			return FALSE;
+		}
 
 		SETMEM(HL, t1);
 
@@ -1845,7 +1909,10 @@ iregbitinstr:
 
 	/* note: we have to look ahead 1 byte for the opcode  -- the PC is
 	   bumped later after the "switch" */
-	switch (t = MEM((PC + 1) & 0xFFFF))
+	t = MEM((PC + 1) & 0xFFFF);
+	OPSTAT(rr == &IX ? OP_DDCB : OP_FDCB, t);
+
+	switch (t)
 	{
 
 	/* rotate & shift group */
@@ -1959,8 +2026,6 @@ iregbitinstr:
 z80info *
 init_z80info(z80info *z80)
 {
-	int i;
-
 	/* clear it the easy way */
 	memset(z80, 0, sizeof *z80);
 
@@ -2016,23 +2081,9 @@ init_z80info(z80info *z80)
 	z80->track = 0;
 	z80->sector = 1;
 
-	/* initialize the global parity array if necessary */
-	if (!parity_inited)
-	{
-		for (i = 0; i <= 0xFF; i++)
-		{
-			word tt = 1;
-			byte t;
-
-			for (t = 1; t; t <<= 1)
-				if (i & t)
-					tt++;
-
-			parityarr[i] = tt & BIT0;
-		}
-
-		parity_inited = TRUE;
-	}
+	/* no console input has been read ahead, no BDOS call is traced */
+	z80->con.last = -1;
+	z80->bdos_return = -1;
 
 	return z80;
 }
@@ -2042,6 +2093,11 @@ destroy_z80info(z80info *z80)
 {
 	/* free the mem array if allocated above */
 	/* free(z80->mem); */
+	free(z80->dcache);
+	z80->dcache = NULL;
+	free(z80->ring);
+	z80->ring = NULL;
+	profoff(z80);
 	return z80;
 }
 
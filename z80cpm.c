@@ -0,0 +1,94 @@
+/*-----------------------------------------------------------------------*\
+ |  z80cpm.c  --  library interface to the CP/M emulator (z80cpm.h)     |
+\*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "vt.h"
+#include "z80cpm.h"
+
+
+z80cpm *
+z80cpm_create(const z80cpm_options *opt)
+{
+	z80info *z80 = new_z80info();
+
+	if (z80 == NULL)
+		return NULL;
+
+	/* the console is ours, not the terminal's */
+	z80->con.embedded = TRUE;
+
+	if (opt != NULL)
+	{
+		z80->nobdos = opt->nobdos;
+		z80->exec = opt->exec;
+		z80->restricted_mode = opt->restricted;
+		z80->stuff_cmd = opt->command;
+		z80->overlaydir = opt->overlaydir;
+
+		if ((opt->disks != NULL && diskconfig(z80, opt->disks) != 0) ||
+				(opt->snapshot != NULL &&
+				loadstate(z80, opt->snapshot) != 0))
+		{
+			z80cpm_destroy(z80);
+			return NULL;
+		}
+	}
+
+	if (opt == NULL || opt->snapshot == NULL)
+		sysreset(z80);
+
+	return z80;
+}
+
+int
+z80cpm_run(z80cpm *z80, long count)
+{
+	z80->con.idle = FALSE;
+
+	/* z80_emulator() takes an int */
+	while (count > 0 && !z80->finished)
+	{
+		int n = count > 0x10000000L ? 0x10000000 : (int)count;
+
+		if (!z80_emulator(z80, n))
+			break;
+
+		count -= n;
+	}
+
+	if (z80->finished)
+		return Z80CPM_FINISHED;
+
+	if (!z80->blocked)
+		return Z80CPM_RUNNING;
+
+	return z80->con.idle ? Z80CPM_IDLE : Z80CPM_BLOCKED;
+}
+
+int
+z80cpm_feed(z80cpm *z80, const void *buf, long len)
+{
+	return coninput(z80, (const unsigned char *)buf, len);
+}
+
+long
+z80cpm_drain(z80cpm *z80, const unsigned char **buf)
+{
+	return conoutput(z80, buf);
+}
+
+void
+z80cpm_destroy(z80cpm *z80)
+{
+	if (z80 == NULL)
+		return;
+
+	bdos_closeall(z80);
+	biosclose(z80);
+	free(z80->con.in);
+	free(z80->con.out);
+	delete_z80info(z80);
+}
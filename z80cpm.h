@@ -0,0 +1,48 @@
+/*-----------------------------------------------------------------------*\
+ |  z80cpm.h  --  run any number of CP/M machines inside another        |
+ |  program: each one has its own memory, registers, console and open   |
+ |  files, and runs only when it is given a slice of instructions.      |
+\*-----------------------------------------------------------------------*/
+
+#ifndef __Z80CPM_H_
+#define __Z80CPM_H_
+
+typedef struct z80info z80cpm;
+
+/* how a machine is to be started - all zero for the defaults, which are
+   those of "cpm" with no options.  The strings are not copied, so they
+   must last as long as the machine does. */
+typedef struct z80cpm_options
+{
+    int nobdos;			/* --nobdos: use the disk images */
+    int exec;			/* --exec: exit once the command has run */
+    int restricted;		/* no changing the current directory */
+    const char *command;	/* typed at the first CP/M prompt */
+    const char *overlaydir;	/* --overlay dir */
+    const char *disks;		/* --disks file */
+    const char *snapshot;	/* --load-state file instead of booting */
+} z80cpm_options;
+
+/* what z80cpm_run() stopped for */
+#define Z80CPM_RUNNING	0	/* the slice was used up */
+#define Z80CPM_BLOCKED	1	/* waiting for console input */
+#define Z80CPM_FINISHED	2	/* CP/M has exited */
+#define Z80CPM_IDLE	3	/* doing nothing but polling for input */
+
+/* Start a machine, or return NULL if it could not be */
+extern z80cpm *z80cpm_create(const z80cpm_options *opt);
+
+/* Run at most count instructions, and say why it stopped */
+extern int z80cpm_run(z80cpm *m, long count);
+
+/* Queue console input for the machine: -1 if out of memory */
+extern int z80cpm_feed(z80cpm *m, const void *buf, long len);
+
+/* Take the console output written since the last call: *buf is only
+   good until the machine is run again */
+extern long z80cpm_drain(z80cpm *m, const unsigned char **buf);
+
+/* Close the machine's files and free it */
+extern void z80cpm_destroy(z80cpm *m);
+
+#endif /* __Z80CPM_H_ */